@@ -0,0 +1,40 @@
+/*
+##########################################################################
+# If not stated otherwise in this file or this component's LICENSE
+# file the following copyright and licenses apply:
+#
+# Copyright 2019 RDK Management
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+##########################################################################
+*/
+#ifndef __RT_CAPTURE_H__
+#define __RT_CAPTURE_H__
+
+// Capture files written by rtrouted --capture and read by rtreplay.
+//
+// The file starts with an 8 byte magic followed by a 32-bit version. Each
+// record is a 32-bit seconds, 32-bit nanoseconds (CLOCK_REALTIME) timestamp
+// and the 32-bit length of the frame, followed by the frame exactly as the
+// router received it (header and payload). All integers are in network byte
+// order, see rtEncoder. The file grows in chunks of zeroes, so a record with
+// a length of zero marks the end of the capture.
+
+#define RTCAPTURE_MAGIC "RTMSGCAP"
+#define RTCAPTURE_MAGIC_LENGTH 8
+#define RTCAPTURE_VERSION 1
+#define RTCAPTURE_FILE_HEADER_LENGTH (RTCAPTURE_MAGIC_LENGTH + 4)
+#define RTCAPTURE_RECORD_HEADER_LENGTH 12
+#define RTCAPTURE_CHUNK_SIZE (1024 * 1024 * 16)
+
+#endif
@@ -25,29 +25,90 @@
 #include "rtLog.h"
 #include "rtMessageHeader.h"
 #include "rtSocket.h"
+#include "rtVector.h"
 
 #include <arpa/inet.h>
+#include <cJSON.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
-#define RTMSG_LISTENERS_MAX 64
+#define RTMSG_LISTENERS_INITIAL_SIZE 64
 #define RTMSG_SEND_BUFFER_SIZE (1024 * 8)
+#define RTMSG_RECV_BUFFER_SIZE (1024 * 64)
+#define RTMSG_RECV_BUFFER_SHRINK_DELAY 10000
+#define RTMSG_MAX_MESSAGE_SIZE (1024 * 1024 * 8)
+#define RTMSG_SEND_IOV_MAX 64
+#define RTMSG_INTERNED_TOPICS_MAX 64
+#define RTMSG_DECLARED_TOPICS_MAX 64
+#define RTMSG_MAX_FILTER_CONDITIONS 8
+#define RTMSG_MAX_FILTER_LEN 1024
+#define RTMSG_MAX_FILTER_FIELD_LEN 64
+#define RTMSG_MAX_FILTER_VALUE_LEN 128
+#define RTMSG_RESPONSE_WAIT_INTERVAL 100
+#define RTMSG_RECONNECT_WAIT_INTERVAL 10
+#define RTMSG_RECONNECT_INTERVAL 1000
+#define RTMSG_PENDING_REQUESTS_MAX 128
+#define RTMSG_TIMED_OUT_REQUESTS_MAX 16
+#define RTMSG_INTEREST_TOPIC "_RTROUTED.INTEREST"
+
+extern char** environ;
 
 struct _rtListener
 {
   int                     in_use;
   void*                   closure;
   char*                   expression;
+  char*                   group;
+  char*                   filter;
+  uint32_t                max_rate;
   uint32_t                subscription_id;
   rtMessageCallback       callback;
+  int                     local;
+  struct _rtConnection*   owner;
+};
+
+struct _rtLocalListener
+{
+  rtMessageCallback       callback;
+  void*                   closure;
+  uint32_t                subscription_id;
+};
+
+struct _rtInternedTopic
+{
+  char*                   topic;
+  uint32_t                id;
+};
+
+struct _rtDeclaredTopic
+{
+  char*                   topic;
+  int                     interest;
+};
+
+struct _rtPendingRequest
+{
+  int                     in_use;
+  int                     done;
+  uint32_t                sequence_number;
+  uint64_t                deadline;
+  rtResponseCallback      callback;
+  void*                   closure;
+  rtMessage               response;
+  rtError                 error;
+  struct _rtConnection*   owner;
 };
 
 struct _rtConnection
@@ -57,37 +118,504 @@ struct _rtConnection
   struct sockaddr_storage remote_endpoint;
   uint8_t*                send_buffer;
   uint8_t*                recv_buffer;
+  uint32_t                recv_capacity;
+  uint32_t                max_message_size;
+  uint64_t                recv_grown;
+  uint32_t                recv_discard;
+  uint32_t                recv_start;
+  uint32_t                recv_end;
+  int                     recv_byte_saved;
+  uint8_t                 recv_saved_byte;
+  int                     dispatch_depth;
+  rtVector                retired_buffers;
   uint32_t                sequence_number;
   char*                   application_name;
   rtConnectionState       state;
   char                    inbox_name[RTMSG_HEADER_MAX_TOPIC_LENGTH];
-  struct _rtListener      listeners[RTMSG_LISTENERS_MAX];
-  rtMessage               response;
+  struct _rtListener*     listeners;
+  uint32_t                listeners_size;
+  uint32_t                num_listeners;
+  struct _rtInternedTopic interned_topics[RTMSG_INTERNED_TOPICS_MAX];
+  int                     num_interned_topics;
+  struct _rtDeclaredTopic declared_topics[RTMSG_DECLARED_TOPICS_MAX];
+  int                     num_declared_topics;
+  struct _rtPendingRequest* pending_requests;
+  uint32_t                timed_out_requests[RTMSG_TIMED_OUT_REQUESTS_MAX];
+  uint32_t                num_timed_out_requests;
+  uint32_t                generation;
+  int                     event_loop;
+  uint64_t                reconnect_after;
+  int                     closing;
+  int                     reader_running;
+  pthread_t               reader_thread;
+  uint64_t                reader_deadline;
+  int                     wake_fds[2];
+  int                     local_delivery;
+  struct _rtConnection*   transport;
+  int                     num_handles;
+  char*                   shared_uri;
+  pthread_mutex_t         mutex;
+  pthread_mutex_t         dispatch_mutex;
+  pthread_cond_t          response_cond;
 };
 
-static void onInboxMessage(rtMessageHeader const* hdr, uint8_t const* p, uint32_t n, void* closure)
+static void
+rtConnection_OnInterest(struct _rtConnection* con, uint8_t const* p, uint32_t n)
+{
+  int i;
+  int32_t interest;
+  char const* topic;
+  rtMessage m;
+
+  topic = NULL;
+  interest = 1;
+
+  rtMessage_FromBytes(&m, p, n);
+  rtMessage_GetString(m, "topic", &topic);
+  rtMessage_GetInt32(m, "interest", &interest);
+  pthread_mutex_lock(&con->mutex);
+  for (i = 0; topic && i < con->num_declared_topics; ++i)
+  {
+    if (strcmp(con->declared_topics[i].topic, topic) == 0)
+    {
+      con->declared_topics[i].interest = interest;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&con->mutex);
+  rtMessage_Release(m);
+}
+
+static uint64_t
+rtConnection_GetTimeMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static uint32_t
+rtConnection_NextSequenceNumber(rtConnection con)
+{
+  uint32_t sequence_number;
+
+  pthread_mutex_lock(&con->mutex);
+  // zero means "not a response" to rtConnection_SendInternal
+  if (con->sequence_number == 0)
+    con->sequence_number++;
+  sequence_number = con->sequence_number++;
+  pthread_mutex_unlock(&con->mutex);
+  return sequence_number;
+}
+
+/**
+ * Takes a slot in the pending request table, called with the mutex held.
+ * @return the slot, or NULL when too many requests are in flight
+ */
+static struct _rtPendingRequest*
+rtConnection_AddPendingRequest(rtConnection con, int32_t timeout, rtResponseCallback callback,
+  void* closure)
+{
+  int i;
+  struct _rtPendingRequest* pending;
+
+  for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+  {
+    if (!con->pending_requests[i].in_use)
+      break;
+  }
+
+  if (i == RTMSG_PENDING_REQUESTS_MAX)
+    return NULL;
+
+  pending = &con->pending_requests[i];
+  pending->in_use = 1;
+  pending->done = 0;
+  pending->sequence_number = rtConnection_NextSequenceNumber(con);
+  pending->deadline = rtConnection_GetTimeMillis() + timeout;
+  pending->callback = callback;
+  pending->closure = closure;
+  pending->response = NULL;
+  pending->error = RT_OK;
+  pending->owner = NULL;
+
+  // the reader thread may be sleeping past this request's deadline
+  if (callback && con->reader_running && pending->deadline < con->reader_deadline)
+  {
+    con->reader_deadline = pending->deadline;
+    if (write(con->wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+      rtLog_Warn("failed to wake reader thread. %s", strerror(errno));
+  }
+  return pending;
+}
+
+int32_t
+rtConnection_GetNextTimeout(rtConnection con)
+{
+  int i;
+  uint64_t now;
+  uint64_t deadline;
+
+  deadline = UINT64_MAX;
+  now = rtConnection_GetTimeMillis();
+
+  // a shared handle's requests time out on the shared connection's thread
+  if (con->transport)
+    return -1;
+
+  pthread_mutex_lock(&con->mutex);
+  for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+  {
+    struct _rtPendingRequest const* pending = &con->pending_requests[i];
+    if (pending->in_use && pending->callback && pending->deadline < deadline)
+      deadline = pending->deadline;
+  }
+
+  // the next attempt to reconnect
+  if (con->fd == -1 && con->reconnect_after < deadline)
+    deadline = con->reconnect_after;
+  pthread_mutex_unlock(&con->mutex);
+
+  if (deadline == UINT64_MAX)
+    return -1;
+  if (deadline <= now)
+    return 0;
+  return deadline - now > INT32_MAX ? INT32_MAX : (int32_t) (deadline - now);
+}
+
+/**
+ * Frees a request that timed out, called with the mutex held. Its sequence
+ * number is remembered so a late response isn't taken for another request's.
+ */
+static void
+rtConnection_TimeOutPendingRequest(rtConnection con, struct _rtPendingRequest* pending)
+{
+  con->timed_out_requests[con->num_timed_out_requests++ % RTMSG_TIMED_OUT_REQUESTS_MAX] =
+    pending->sequence_number;
+  pending->in_use = 0;
+}
+
+/**
+ * Completes asynchronous requests whose timeout is up with RT_ERROR_TIMEOUT.
+ * rtConnection_SendRequest times out on its own.
+ */
+static void
+rtConnection_ExpirePendingRequests(rtConnection con)
+{
+  int i;
+  int num_expired;
+  uint64_t now;
+  rtResponseCallback callbacks[RTMSG_PENDING_REQUESTS_MAX];
+  void* closures[RTMSG_PENDING_REQUESTS_MAX];
+
+  num_expired = 0;
+  now = rtConnection_GetTimeMillis();
+
+  pthread_mutex_lock(&con->mutex);
+  for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+  {
+    struct _rtPendingRequest* pending = &con->pending_requests[i];
+    if (pending->in_use && pending->callback && pending->deadline <= now)
+    {
+      callbacks[num_expired] = pending->callback;
+      closures[num_expired] = pending->closure;
+      num_expired++;
+      rtConnection_TimeOutPendingRequest(con, pending);
+    }
+  }
+  pthread_mutex_unlock(&con->mutex);
+
+  for (i = 0; i < num_expired; ++i)
+    callbacks[i](RT_ERROR_TIMEOUT, NULL, closures[i]);
+}
+
+/**
+ * Hands a response to the request with the same sequence number, either to
+ * its callback or to the thread waiting in rtConnection_SendRequest.
+ */
+static void
+rtConnection_OnResponse(struct _rtConnection* con, rtMessageHeader const* hdr, uint8_t const* p, uint32_t n,
+  rtError err)
 {
-  if (hdr->flags & rtMessageFlags_Response)
+  int i;
+  int num_waiting;
+  struct _rtPendingRequest* req;
+  rtResponseCallback callback;
+  void* closure;
+  rtMessage res;
+
+  req = NULL;
+  num_waiting = 0;
+
+  pthread_mutex_lock(&con->mutex);
+  for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
   {
-    struct _rtConnection* con = (struct _rtConnection *) closure;
-    if (con->response != NULL)
+    struct _rtPendingRequest* item = &con->pending_requests[i];
+    if (!item->in_use || item->done)
+      continue;
+    num_waiting++;
+    if (item->sequence_number == hdr->sequence_number)
+      req = item;
+  }
+
+  // older responders don't send the request's sequence number back, that's
+  // fine as long as there's only the one request to answer and this isn't
+  // the late response to one that timed out
+  for (i = 0; !req && i < RTMSG_TIMED_OUT_REQUESTS_MAX; ++i)
+  {
+    if (con->timed_out_requests[i] == hdr->sequence_number)
+      num_waiting = 0;
+  }
+
+  if (!req && num_waiting == 1)
+  {
+    for (i = 0; !req && i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+    {
+      if (con->pending_requests[i].in_use && !con->pending_requests[i].done)
+        req = &con->pending_requests[i];
+    }
+  }
+
+  if (!req)
+  {
+    pthread_mutex_unlock(&con->mutex);
+    rtLog_Debug("dropping response %u, the request is gone", hdr->sequence_number);
+    return;
+  }
+
+  if (req->callback)
+  {
+    callback = req->callback;
+    closure = req->closure;
+    req->in_use = 0;
+    pthread_mutex_unlock(&con->mutex);
+
+    if (err != RT_OK)
     {
-      rtMessage_Release(con->response);
-      con->response = NULL;
+      callback(err, NULL, closure);
+      return;
     }
-    rtMessage_FromBytes(&con->response, p, n);
+
+    rtMessage_FromBytes(&res, p, n);
+    callback(RT_OK, res, closure);
+    rtMessage_Release(res);
+    return;
+  }
+
+  if (err == RT_OK)
+    rtMessage_FromBytes(&req->response, p, n);
+  req->error = err;
+  req->done = 1;
+  pthread_cond_broadcast(&con->response_cond);
+  pthread_mutex_unlock(&con->mutex);
+}
+
+static void onInboxMessage(rtMessageHeader const* hdr, uint8_t const* p, uint32_t n, void* closure)
+{
+  if (strcmp(hdr->reply_topic, RTMSG_INTEREST_TOPIC) == 0)
+  {
+    rtConnection_OnInterest((struct _rtConnection *) closure, p, n);
   }
 }
 
+static rtError rtConnection_Publish(rtConnection con, char const* topic, struct iovec const* iov,
+  int iovcnt, int flags);
+static void rtConnection_RemoveListener(rtConnection con, struct _rtListener* listener);
 static rtError rtConnection_SendInternal(rtConnection con, char const* topic,
-  uint8_t const* buff, uint32_t n, char const* reply_topic, int flags);
+  uint8_t const* buff, uint32_t n, char const* reply_topic, int flags, uint32_t sequence_number);
+static rtError rtConnection_SendFrame(rtConnection con, char const* topic,
+  struct iovec const* iov, int iovcnt, char const* reply_topic, int flags, uint32_t sequence_number);
+static rtError rtConnection_WaitForResponse(rtConnection con, struct _rtPendingRequest* pending,
+  int32_t timeout);
   
 
+// connections shared by the handles created with "shared", by router address
+static pthread_mutex_t rtConnection_SharedMutex = PTHREAD_MUTEX_INITIALIZER;
+static rtVector rtConnection_SharedConnections = NULL;
+
+// connections created with "local_delivery", the lock is always taken before
+// any connection's own
+static pthread_mutex_t rtConnection_LocalMutex = PTHREAD_MUTEX_INITIALIZER;
+static rtVector rtConnection_LocalConnections = NULL;
+static pthread_mutex_t rtConnection_ProcessNameMutex = PTHREAD_MUTEX_INITIALIZER;
+static char rtConnection_ProcessName[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+static pid_t rtConnection_ProcessNamePid = 0;
+
+/**
+ * Gets the name that tells the router which of its clients live in this
+ * process. A forked child gets a new one.
+ */
+static void
+rtConnection_GetProcessName(char* name, size_t n)
+{
+  char host[64];
+  struct timespec ts;
+
+  pthread_mutex_lock(&rtConnection_ProcessNameMutex);
+  if (rtConnection_ProcessNamePid != getpid())
+  {
+    memset(host, 0, sizeof(host));
+    gethostname(host, sizeof(host) - 1);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rtConnection_ProcessNamePid = getpid();
+    snprintf(rtConnection_ProcessName, sizeof(rtConnection_ProcessName), "%s.%d.%ld.%ld", host,
+      (int) rtConnection_ProcessNamePid, (long) ts.tv_sec, (long) ts.tv_nsec);
+  }
+  snprintf(name, n, "%s", rtConnection_ProcessName);
+  pthread_mutex_unlock(&rtConnection_ProcessNameMutex);
+}
+
+/**
+ * Sends a message to the router itself. These never go to local listeners.
+ * Called without the mutex held, or with dispatch_mutex held too, a send
+ * that fails reconnects.
+ */
+static void
+rtConnection_SendControlMessage(rtConnection con, rtMessage m, char const* topic)
+{
+  uint8_t* p;
+  uint32_t n;
+
+  rtMessage_ToByteArray(m, &p, &n);
+  rtConnection_SendInternal(con, topic, p, n, NULL, 0, 0);
+  free(p);
+}
+
+static void
+rtConnection_SendDeclaration(rtConnection con, struct _rtDeclaredTopic const* declared)
+{
+  rtMessage m;
+  rtMessage_Create(&m);
+  rtMessage_SetString(m, "topic", declared->topic);
+  rtMessage_SetString(m, "inbox", con->inbox_name);
+  rtConnection_SendControlMessage(con, m, "_RTROUTED.INBOX.DECLARE");
+  rtMessage_Release(m);
+}
+
+static void
+rtConnection_SendLocalDelivery(rtConnection con)
+{
+  char name[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+  rtMessage m;
+
+  rtConnection_GetProcessName(name, sizeof(name));
+  rtMessage_Create(&m);
+  rtMessage_SetString(m, "process", name);
+  rtConnection_SendControlMessage(con, m, "_RTROUTED.INBOX.LOCAL");
+  rtMessage_Release(m);
+}
+
+static rtMessage
+rtConnection_CreateSubscription(struct _rtListener const* listener)
+{
+  rtMessage m;
+  rtMessage_Create(&m);
+  rtMessage_SetString(m, "topic", listener->expression);
+  rtMessage_SetInt32(m, "route_id", listener->subscription_id);
+  rtMessage_SetInt32(m, "multiple_subscriptions", 1);
+  if (listener->group)
+    rtMessage_SetString(m, "group", listener->group);
+  if (listener->filter)
+    rtMessage_SetString(m, "filter", listener->filter);
+  if (listener->max_rate)
+    rtMessage_SetInt32(m, "max_rate", listener->max_rate);
+  if (listener->local)
+    rtMessage_SetInt32(m, "local", 1);
+  return m;
+}
+
+static void
+rtConnection_SendSubscription(rtConnection con, struct _rtListener const* listener)
+{
+  rtMessage m;
+  m = rtConnection_CreateSubscription(listener);
+  rtConnection_SendControlMessage(con, m, "_RTROUTED.INBOX.SUBSCRIBE");
+  rtMessage_Release(m);
+}
+
+static uint32_t
+rtConnection_PriorityFlags(rtMessagePriority priority)
+{
+  rtMessageHeader hdr;
+  rtMessageHeader_Init(&hdr);
+  rtMessageHeader_SetPriority(&hdr, priority);
+  return hdr.flags;
+}
+
 static uint32_t
 rtConnection_GetNextSubscriptionId()
 {
   static uint32_t next_id = 1;
-  return next_id++;
+  return __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+rtConnection_FindInternedTopic(rtConnection con, char const* topic)
+{
+  int i;
+  for (i = 0; i < con->num_interned_topics; ++i)
+  {
+    if (strcmp(con->interned_topics[i].topic, topic) == 0)
+      return con->interned_topics[i].id;
+  }
+  return 0;
+}
+
+static void
+rtConnection_ClearInternedTopics(rtConnection con)
+{
+  int i;
+  for (i = 0; i < con->num_interned_topics; ++i)
+    free(con->interned_topics[i].topic);
+  con->num_interned_topics = 0;
+}
+
+static int
+rtConnection_IsClosing(rtConnection con)
+{
+  return __atomic_load_n(&con->closing, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Gets the connection a handle created with "shared" sends and subscribes
+ * on. Any other connection is its own.
+ */
+static rtConnection
+rtConnection_GetTransport(rtConnection con)
+{
+  return con->transport ? con->transport : con;
+}
+
+/**
+ * Finds a declared topic, called with the mutex held.
+ */
+static struct _rtDeclaredTopic*
+rtConnection_FindDeclaredTopic(rtConnection con, char const* topic)
+{
+  int i;
+  for (i = 0; i < con->num_declared_topics; ++i)
+  {
+    if (strcmp(con->declared_topics[i].topic, topic) == 0)
+      return &con->declared_topics[i];
+  }
+  return NULL;
+}
+
+/**
+ * Checks whether a declared topic has subscribers, as of the last interest
+ * update dispatch has read. Topics that weren't declared always have.
+ */
+static int
+rtConnection_HasInterest(rtConnection con, char const* topic)
+{
+  int interest;
+  struct _rtDeclaredTopic* declared;
+
+  pthread_mutex_lock(&con->mutex);
+  declared = rtConnection_FindDeclaredTopic(con, topic);
+  interest = declared ? declared->interest : 1;
+  pthread_mutex_unlock(&con->mutex);
+  return interest;
 }
 
 static int
@@ -98,59 +626,115 @@ rtConnection_ShouldReregister(rtError e)
   return 0;
 }
 
+/**
+ * Connects a new socket and registers the connection's listeners and
+ * declared topics on it. Called with dispatch_mutex held, or before anyone
+ * else has the connection. The mutex is only taken once the socket is
+ * connected, senders aren't held up while it retries. A connection driven by
+ * rtConnection_ProcessReadable tries once, and at most every
+ * RTMSG_RECONNECT_INTERVAL ms, it's left without a socket in between.
+ */
 static rtError
 rtConnection_ConnectAndRegister(rtConnection con)
 {
   int i;
+  int fd;
   int ret;
+  int retry;
   char buff[64];
   uint16_t port;
+  uint64_t now;
+  rtError err;
   socklen_t socket_length;
+  struct sockaddr_storage local_endpoint;
 
   i = 1;
+  fd = -1;
   ret = 0;
+  retry = 0;
+  err = RT_OK;
   memset(buff, 0, sizeof(buff));
+  memset(&local_endpoint, 0, sizeof(local_endpoint));
   port = 0;
+  now = rtConnection_GetTimeMillis();
 
   rtSocketStorage_GetLength(&con->remote_endpoint, &socket_length);
-
-  if (con->fd != -1)
-    close(con->fd);
-
-  con->fd = socket(con->remote_endpoint.ss_family, SOCK_STREAM, 0);
-  if (con->fd == -1)
-    return rtErrorFromErrno(errno);
-
-  fcntl(con->fd, F_SETFD, fcntl(con->fd, F_GETFD) | FD_CLOEXEC);
-  setsockopt(con->fd, SOL_TCP, TCP_NODELAY, &i, sizeof(i));
-
   rtSocketStorage_ToString(&con->remote_endpoint,buff, sizeof(buff), &port);
 
-  int retry = 0;
-  while (retry <= 3)
+  // dispatch_mutex keeps the socket from changing under this check
+  if (con->event_loop && now < con->reconnect_after)
+  {
+    if (con->fd == -1)
+      return rtErrorFromErrno(ENOTCONN);
+    err = rtErrorFromErrno(ENOTCONN);
+  }
+  else
   {
-    ret = connect(con->fd, (struct sockaddr *)&con->remote_endpoint, socket_length);
-    if (ret == -1)
+    fd = socket(con->remote_endpoint.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+      return rtErrorFromErrno(errno);
+
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &i, sizeof(i));
+
+    while (retry <= 3)
     {
-      int err = errno;
-      if (err == ECONNREFUSED)
+      ret = connect(fd, (struct sockaddr *)&con->remote_endpoint, socket_length);
+      if (ret == -1)
       {
+        err = rtErrorFromErrno(errno);
+
+        // an event loop can't wait, it's called again later
+        if (con->event_loop)
+          break;
+
         sleep(1);
-        retry++;
+        if (err == rtErrorFromErrno(ECONNREFUSED))
+          retry++;
+        else
+          rtLog_Warn("error connecting to %s:%d. %s", buff, port, rtStrError(err));
       }
       else
       {
-        sleep(1);
-        rtLog_Warn("error connecting to %s:%d. %s", buff, port, strerror(err));
+        err = RT_OK;
+        break;
       }
     }
+
+    if (ret == -1 && con->event_loop)
+    {
+      rtLog_Warn("error connecting to %s:%d. %s", buff, port, rtStrError(err));
+      close(fd);
+      fd = -1;
+    }
     else
     {
-      break;
+      err = RT_OK;
+      rtSocket_GetLocalEndpoint(fd, &local_endpoint);
     }
   }
 
-  rtSocket_GetLocalEndpoint(con->fd, &con->local_endpoint);
+  pthread_mutex_lock(&con->mutex);
+  if (con->fd != -1)
+    close(con->fd);
+  con->fd = fd;
+  con->local_endpoint = local_endpoint;
+  if (now >= con->reconnect_after)
+    con->reconnect_after = now + RTMSG_RECONNECT_INTERVAL;
+
+  // ids belong to the router we were connected to
+  rtConnection_ClearInternedTopics(con);
+  con->generation++;
+
+  // the rest of a frame from the old connection is never coming
+  con->recv_start = con->recv_end;
+  con->recv_discard = 0;
+
+  if (fd == -1)
+  {
+    pthread_mutex_unlock(&con->mutex);
+    return err;
+  }
 
   {
     uint16_t local_port;
@@ -163,87 +747,679 @@ rtConnection_ConnectAndRegister(rtConnection con)
     rtLog_Debug("connect %s:%d -> %s:%d", local_addr, local_port, remote_addr, remote_port);
   }
 
-  for (i = 0; i < RTMSG_LISTENERS_MAX; ++i)
+  // the router has to know before any local subscription or message arrives
+  if (con->local_delivery)
+    rtConnection_SendLocalDelivery(con);
+
+  for (i = 0; i < (int) con->listeners_size; ++i)
   {
     if (con->listeners[i].in_use)
-    {
-      rtMessage m;
-      rtMessage_Create(&m);
-      rtMessage_SetString(m, "topic", con->listeners[i].expression);
-      rtMessage_SetInt32(m, "route_id", con->listeners[i].subscription_id);
-      rtConnection_SendMessage(con, m, "_RTROUTED.INBOX.SUBSCRIBE");
-      rtMessage_Release(m);
-    }
+      rtConnection_SendSubscription(con, &con->listeners[i]);
+  }
+
+  // the new router sends fresh interest for each topic
+  for (i = 0; i < con->num_declared_topics; ++i)
+  {
+    con->declared_topics[i].interest = 1;
+    rtConnection_SendDeclaration(con, &con->declared_topics[i]);
   }
+  pthread_mutex_unlock(&con->mutex);
 
   return RT_OK;
 }
 
+static int
+rtConnection_IsRoutingDaemonRunning()
+{
+  int fd;
+  int running;
+
+  // rtrouted holds an exclusive lock on its pid file for as long as it runs
+  fd = open(RTMSG_ROUTER_PID_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+
+  running = (flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+  close(fd);
+  return running;
+}
+
 static rtError
 rtConnection_EnsureRoutingDaemon()
 {
-  int ret = system("/usr/bin/rtrouted 2> /dev/null");
-
-  // 127 is return from sh -c (@see system manpage) when command is not found in $PATH
-  if (WEXITSTATUS(ret) == 127)
-    ret = system("/usr/bin/rtrouted 2> /dev/null");
+  int ret;
+  int status;
+  pid_t pid;
+  char* argv[] = { "rtrouted", NULL };
+  posix_spawn_file_actions_t actions;
 
-  // exit(12) from rtrouted means another instance is already running
-  if (WEXITSTATUS(ret) == 12)
+  if (rtConnection_IsRoutingDaemonRunning())
     return RT_OK;
 
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  ret = posix_spawn(&pid, "/usr/bin/rtrouted", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+
   if (ret != 0)
-    rtLog_Error("Cannot run rtrouted. Code:%d", ret);
+  {
+    rtLog_Error("Cannot run rtrouted. %s", strerror(ret));
+    return RT_OK;
+  }
+
+  // rtrouted returns as soon as it has forked off the daemon. waitpid fails
+  // with ECHILD when the application ignores SIGCHLD, the exit status is
+  // lost then
+  status = 0;
+  while ((ret = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+    ;
+  if (ret == -1)
+    return RT_OK;
 
+  // exit(12) from rtrouted means another instance is already running
+  if (WIFEXITED(status) && (WEXITSTATUS(status) == 0 || WEXITSTATUS(status) == 12))
+    return RT_OK;
+
+  rtLog_Error("Cannot run rtrouted. Code:%d", status);
   return RT_OK;
 }
 
+/**
+ * Starts the router if needed and reconnects, called with dispatch_mutex
+ * held. An event loop's connection doesn't try either until its next
+ * attempt is due.
+ */
 static rtError
-rtConnection_ReadUntil(rtConnection con, uint8_t* buff, int count, int32_t timeout)
+rtConnection_Reestablish(rtConnection con)
 {
-  ssize_t bytes_read = 0;
-  ssize_t bytes_to_read = count;
+  rtError err;
 
-  (void) timeout;
+  if (!con->event_loop || rtConnection_GetTimeMillis() >= con->reconnect_after)
+  {
+    err = rtConnection_EnsureRoutingDaemon();
+    if (err != RT_OK)
+      return err;
+  }
+  return rtConnection_ConnectAndRegister(con);
+}
+
+/**
+ * Re-establishes the connection after a send failed on it, unless dispatch
+ * already has since generation. Dispatch reads the socket and the receive
+ * buffer under dispatch_mutex, so that's taken first, before the mutex. A
+ * thread sending must not hold the mutex when it gets here.
+ */
+static rtError
+rtConnection_Reconnect(rtConnection con, uint32_t generation)
+{
+  int reconnected;
+  rtError err;
+  struct timespec deadline;
 
-  while (bytes_read < bytes_to_read)
+  while (1)
   {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(con->fd, &read_fds);
+    pthread_mutex_lock(&con->mutex);
+    reconnected = con->generation != generation;
+    if (!reconnected && con->reader_running && write(con->wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+      rtLog_Warn("failed to wake reader thread. %s", strerror(errno));
+    pthread_mutex_unlock(&con->mutex);
 
-    #if 0
-    if (timeout != INT32_MAX)
-    {
-      // TODO: include suseconds_t tv_usecs;
-      time_t seconds = (timeout / 1000);
-      struct timeval tv = { seconds, 0 };
-      select(con->fd + 1, &read_fds, NULL, NULL, &tv);
-      if (!FD_ISSET(con->fd, &read_fds))
-        return RT_ERROR_TIMEOUT;
-    }
-    #endif
+    if (reconnected)
+      return RT_OK;
 
-    ssize_t n = recv(con->fd, buff + bytes_read, (bytes_to_read - bytes_read), MSG_NOSIGNAL);
-    if (n == 0)
+    // a thread blocked reading the broken socket wakes up and reconnects
+    // itself, or lets go of dispatch_mutex
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RTMSG_RECONNECT_WAIT_INTERVAL * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
     {
-      rtLog_Error("Failed to read error : %s", rtStrError(rtErrorFromErrno(ENOTCONN)));
-      return rtErrorFromErrno(ENOTCONN);
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
     }
+    if (pthread_mutex_timedlock(&con->dispatch_mutex, &deadline) == 0)
+      break;
+  }
 
-    if (n == -1)
-    {
-      if (errno == EINTR)
-        continue;
-      rtError e = rtErrorFromErrno(errno);
-      rtLog_Error("failed to read from fd %d. %s", con->fd, rtStrError(e));
-      return e;
+  err = RT_OK;
+  pthread_mutex_lock(&con->mutex);
+  reconnected = con->generation != generation;
+  pthread_mutex_unlock(&con->mutex);
+  if (!reconnected)
+    err = rtConnection_Reestablish(con);
+  pthread_mutex_unlock(&con->dispatch_mutex);
+  return err;
+}
+
+/**
+ * Moves the unread bytes to the front of a receive buffer of the given
+ * capacity. While callbacks are running they still point into the current
+ * buffer, so the bytes go to a new one instead and the old one is freed once
+ * the outermost dispatch is done.
+ */
+static rtError
+rtConnection_ResizeBuffer(rtConnection con, uint32_t capacity)
+{
+  uint8_t* buff;
+  uint32_t available;
+
+  available = con->recv_end - con->recv_start;
+  if (con->dispatch_depth == 0 && capacity == con->recv_capacity)
+  {
+    memmove(con->recv_buffer, con->recv_buffer + con->recv_start, available);
+  }
+  else
+  {
+    buff = (uint8_t *) malloc(capacity);
+    if (!buff)
+      return rtErrorFromErrno(ENOMEM);
+    memcpy(buff, con->recv_buffer + con->recv_start, available);
+    if (con->dispatch_depth == 0)
+      free(con->recv_buffer);
+    else
+      rtVector_PushBack(con->retired_buffers, con->recv_buffer);
+    con->recv_buffer = buff;
+    con->recv_capacity = capacity;
+  }
+
+  // the first unread byte may be standing in for the terminator of the
+  // frame being dispatched
+  if (con->recv_byte_saved)
+  {
+    con->recv_buffer[0] = con->recv_saved_byte;
+    con->recv_byte_saved = 0;
+  }
+
+  con->recv_start = 0;
+  con->recv_end = available;
+  return RT_OK;
+}
+
+/**
+ * Gives memory taken by a large message back once none has arrived for a
+ * while and nothing is buffered.
+ */
+static void
+rtConnection_ShrinkBuffer(rtConnection con)
+{
+  if (con->dispatch_depth == 0 && con->recv_capacity > RTMSG_RECV_BUFFER_SIZE &&
+      con->recv_start == con->recv_end &&
+      rtConnection_GetTimeMillis() - con->recv_grown >= RTMSG_RECV_BUFFER_SHRINK_DELAY)
+  {
+    rtConnection_ResizeBuffer(con, RTMSG_RECV_BUFFER_SIZE);
+  }
+}
+
+/**
+ * Reads whatever the socket has into the free end of recv_buffer, waiting
+ * until the deadline when it has nothing.
+ * @param deadline CLOCK_MONOTONIC milliseconds, 0 to wait forever
+ */
+static rtError
+rtConnection_FillBuffer(rtConnection con, uint64_t deadline)
+{
+  int ret;
+  int timeout;
+  ssize_t n;
+  nfds_t num_fds;
+  uint64_t now;
+  rtError err;
+  struct pollfd fds[2];
+
+  if (con->fd == -1)
+    return rtErrorFromErrno(ENOTCONN);
+
+  while (1)
+  {
+    // one byte is kept free for the terminator after the last frame
+    n = recv(con->fd, con->recv_buffer + con->recv_end, con->recv_capacity - 1 - con->recv_end,
+      MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0)
+    {
+      con->recv_end += n;
+      return RT_OK;
+    }
+
+    if (n == 0)
+    {
+      // rtConnection_Destroy shut the socket down under the reader thread
+      if (!rtConnection_IsClosing(con))
+        rtLog_Error("Failed to read error : %s", rtStrError(rtErrorFromErrno(ENOTCONN)));
+      return rtErrorFromErrno(ENOTCONN);
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      err = rtErrorFromErrno(errno);
+      if (!rtConnection_IsClosing(con))
+        rtLog_Error("failed to read from fd %d. %s", con->fd, rtStrError(err));
+      return err;
+    }
+
+    fds[0].fd = con->fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = con->wake_fds[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    num_fds = con->wake_fds[0] != -1 ? 2 : 1;
+
+    timeout = -1;
+    if (deadline)
+    {
+      now = rtConnection_GetTimeMillis();
+      timeout = deadline > now ? (int) (deadline - now) : 0;
+    }
+
+    ret = poll(fds, num_fds, timeout);
+    if (ret == -1 && errno != EINTR)
+      return rtErrorFromErrno(errno);
+
+    if (num_fds == 2 && (fds[1].revents & POLLIN))
+    {
+      char buff[64];
+      while (read(con->wake_fds[0], buff, sizeof(buff)) > 0)
+      {
+      }
+      return RT_ERROR_TIMEOUT;
+    }
+
+    if (ret == 0)
+      return RT_ERROR_TIMEOUT;
+  }
+  return RT_OK;
+}
+
+/**
+ * Checks whether recv_buffer holds a complete frame, decoding its header
+ * once enough of it is there.
+ * @param needed set to the number of bytes known to be missing, zero when
+ *   the frame is complete
+ */
+static rtError
+rtConnection_PeekFrame(rtConnection con, rtMessageHeader* hdr, uint32_t* needed)
+{
+  rtError err;
+  uint16_t header_length;
+  uint32_t available;
+  uint32_t frame_length;
+  uint8_t const* itr;
+
+  // what's left of a frame too large to take
+  if (con->recv_discard > 0)
+  {
+    available = con->recv_end - con->recv_start;
+    available = available < con->recv_discard ? available : con->recv_discard;
+    con->recv_start += available;
+    con->recv_discard -= available;
+    if (con->recv_discard > 0)
+    {
+      *needed = con->recv_discard;
+      return RT_OK;
+    }
+  }
+
+  available = con->recv_end - con->recv_start;
+
+  con->state = rtConnectionState_ReadHeaderPreamble;
+  if (available < 4)
+  {
+    *needed = 4 - available;
+    return RT_OK;
+  }
+
+  con->state = rtConnectionState_ReadHeader;
+  itr = con->recv_buffer + con->recv_start + 2;
+  rtEncoder_DecodeUInt16(&itr, &header_length);
+  if (available < header_length)
+  {
+    *needed = header_length - available;
+    return RT_OK;
+  }
+
+  err = rtMessageHeader_Decode(hdr, con->recv_buffer + con->recv_start);
+  if (err != RT_OK)
+    return err;
+
+  con->state = rtConnectionState_ReadPayload;
+  frame_length = hdr->header_length + hdr->payload_length;
+  *needed = available < frame_length ? frame_length - available : 0;
+  return RT_OK;
+}
+
+/**
+ * Skips a frame larger than max_message_size. A request waiting for it
+ * fails with EMSGSIZE instead of timing out.
+ */
+static void
+rtConnection_DiscardFrame(rtConnection con, rtMessageHeader const* hdr, uint32_t frame_length)
+{
+  rtLog_Error("dropping %u byte message on %s, more than the %u bytes allowed", frame_length,
+    hdr->topic, con->max_message_size);
+
+  con->recv_discard = frame_length - (con->recv_end - con->recv_start);
+  con->recv_start = con->recv_end;
+
+  if ((hdr->flags & rtMessageFlags_Response) && strcmp(hdr->topic, con->inbox_name) == 0)
+    rtConnection_OnResponse(con, hdr, NULL, 0, rtErrorFromErrno(EMSGSIZE));
+}
+
+/**
+ * Reads until recv_buffer holds a complete frame at recv_start. A frame
+ * that's only partly there when the deadline passes stays buffered and is
+ * finished by a later call. The buffer grows for frames that don't fit, up
+ * to max_message_size, larger ones are skipped with EMSGSIZE.
+ * @param deadline CLOCK_MONOTONIC milliseconds, 0 to wait forever
+ */
+static rtError
+rtConnection_ReadFrame(rtConnection con, rtMessageHeader* hdr, uint64_t deadline)
+{
+  rtError err;
+  uint32_t needed;
+  uint32_t capacity;
+  uint64_t frame_length;
+
+  while (1)
+  {
+    err = rtConnection_PeekFrame(con, hdr, &needed);
+    if (err != RT_OK || needed == 0)
+      return err;
+
+    if (con->recv_discard == 0)
+    {
+      frame_length = (uint64_t) con->recv_end - con->recv_start + needed;
+      if (con->state == rtConnectionState_ReadPayload && frame_length > con->max_message_size)
+      {
+        rtConnection_DiscardFrame(con, hdr, (uint32_t) frame_length);
+        return rtErrorFromErrno(EMSGSIZE);
+      }
+
+      if (frame_length > RTMSG_RECV_BUFFER_SIZE - 1)
+        con->recv_grown = rtConnection_GetTimeMillis();
+
+      // one byte more for the terminator
+      capacity = con->recv_capacity;
+      while (capacity - 1 < frame_length)
+        capacity *= 2;
+
+      if (capacity != con->recv_capacity || con->recv_start + frame_length > con->recv_capacity - 1 ||
+          (con->recv_start == con->recv_end && con->dispatch_depth == 0))
+      {
+        err = rtConnection_ResizeBuffer(con, capacity);
+        if (err != RT_OK)
+          return err;
+      }
+    }
+    else if (con->recv_end == con->recv_capacity - 1)
+    {
+      rtConnection_ResizeBuffer(con, con->recv_capacity);
+    }
+
+    err = rtConnection_FillBuffer(con, deadline);
+    if (err != RT_OK)
+      return err;
+  }
+  return RT_OK;
+}
+
+static void
+rtConnection_InitLocks(rtConnection con)
+{
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+
+  // sends and dispatch can both end up reconnecting and re-sending the
+  // subscriptions, or callbacks dispatching from within a dispatch
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&con->mutex, &mutex_attr);
+  pthread_mutex_init(&con->dispatch_mutex, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&con->response_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+static void*
+rtConnection_ReaderThread(void* arg)
+{
+  rtError err;
+  int32_t timeout;
+  rtConnection con = (rtConnection) arg;
+
+  while (!rtConnection_IsClosing(con))
+  {
+    // sleep until the next asynchronous request times out, new requests
+    // with an earlier deadline wake the thread up
+    pthread_mutex_lock(&con->mutex);
+    timeout = rtConnection_GetNextTimeout(con);
+    con->reader_deadline = timeout < 0 ? UINT64_MAX : rtConnection_GetTimeMillis() + timeout;
+    pthread_mutex_unlock(&con->mutex);
+
+    err = rtConnection_TimedDispatch(con, timeout);
+    if (err != RT_OK && err != RT_ERROR_TIMEOUT && !rtConnection_IsClosing(con))
+      rtLog_Warn("reader thread failed to dispatch");
+  }
+  return NULL;
+}
+
+/**
+ * Creates a handle on the process's connection to the router at
+ * router_config, connecting on the first one. The connection runs a reader
+ * thread and keeps the settings of the handle that created it.
+ */
+static rtError
+rtConnection_CreateShared(rtConnection* con, rtMessage const conf, char const* application_name,
+  char const* router_config)
+{
+  size_t i;
+  rtError err;
+  int32_t value;
+  rtMessage transport_conf;
+  rtConnection transport;
+  rtConnection handle;
+
+  err = RT_OK;
+  transport = NULL;
+
+  if (!application_name || !router_config)
+    return RT_ERROR_INVALID_ARG;
+
+  pthread_mutex_lock(&rtConnection_SharedMutex);
+  if (!rtConnection_SharedConnections)
+    rtVector_Create(&rtConnection_SharedConnections);
+
+  for (i = 0; i < rtVector_Size(rtConnection_SharedConnections); ++i)
+  {
+    rtConnection item = (rtConnection) rtVector_At(rtConnection_SharedConnections, i);
+    if (strcmp(item->shared_uri, router_config) == 0)
+    {
+      transport = item;
+      break;
+    }
+  }
+
+  if (!transport)
+  {
+    rtMessage_Create(&transport_conf);
+    rtMessage_SetString(transport_conf, "appname", application_name);
+    rtMessage_SetString(transport_conf, "uri", router_config);
+    value = 0;
+    rtMessage_GetInt32(conf, "start_router", &value);
+    rtMessage_SetInt32(transport_conf, "start_router", value);
+    value = RTMSG_MAX_MESSAGE_SIZE;
+    rtMessage_GetInt32(conf, "max_message_size", &value);
+    rtMessage_SetInt32(transport_conf, "max_message_size", value);
+    value = 0;
+    rtMessage_GetInt32(conf, "local_delivery", &value);
+    rtMessage_SetInt32(transport_conf, "local_delivery", value);
+    rtMessage_SetInt32(transport_conf, "reader_thread", 1);
+    err = rtConnection_CreateWithConfig(&transport, transport_conf);
+    rtMessage_Release(transport_conf);
+    if (err != RT_OK)
+    {
+      pthread_mutex_unlock(&rtConnection_SharedMutex);
+      return err;
+    }
+    transport->shared_uri = strdup(router_config);
+    rtVector_PushBack(rtConnection_SharedConnections, transport);
+  }
+
+  // a handle has no socket, buffers or request table of its own
+  handle = (rtConnection) calloc(1, sizeof(struct _rtConnection));
+  if (!handle)
+  {
+    if (transport->num_handles == 0)
+    {
+      rtVector_RemoveItem(rtConnection_SharedConnections, transport, NULL);
+      rtConnection_Destroy(transport);
     }
-    bytes_read += n;
+    pthread_mutex_unlock(&rtConnection_SharedMutex);
+    return rtErrorFromErrno(ENOMEM);
   }
+
+  handle->fd = -1;
+  handle->wake_fds[0] = -1;
+  handle->wake_fds[1] = -1;
+  handle->transport = transport;
+  handle->application_name = strdup(application_name);
+  rtConnection_InitLocks(handle);
+  transport->num_handles++;
+  pthread_mutex_unlock(&rtConnection_SharedMutex);
+
+  *con = handle;
   return RT_OK;
 }
 
+/**
+ * Takes a handle's listeners and outstanding asynchronous requests off the
+ * shared connection, and closes the connection after its last handle.
+ */
+static void
+rtConnection_DestroyShared(rtConnection con)
+{
+  int i;
+  uint32_t k;
+  int num_cancelled;
+  uint32_t num_removed;
+  uint32_t* removed;
+  rtMessage m;
+  rtConnection transport;
+  rtResponseCallback callbacks[RTMSG_PENDING_REQUESTS_MAX];
+  void* closures[RTMSG_PENDING_REQUESTS_MAX];
+
+  num_cancelled = 0;
+  num_removed = 0;
+  transport = con->transport;
+
+  // wakes up threads waiting in rtConnection_Dispatch on the handle
+  pthread_mutex_lock(&con->mutex);
+  __atomic_store_n(&con->closing, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&con->response_cond);
+  pthread_mutex_unlock(&con->mutex);
+
+  // the router is told once the mutex is released
+  pthread_mutex_lock(&transport->mutex);
+  // one slot spare so there's something to allocate without listeners
+  removed = (uint32_t *) malloc((transport->num_listeners + 1) * sizeof(uint32_t));
+  for (k = 0; k < transport->listeners_size;)
+  {
+    struct _rtListener* listener = &transport->listeners[k];
+    if (!listener->in_use || listener->owner != con)
+    {
+      k++;
+      continue;
+    }
+
+    if (removed)
+      removed[num_removed++] = listener->subscription_id;
+
+    // another listener may have moved into this slot
+    rtConnection_RemoveListener(transport, listener);
+  }
+
+  for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+  {
+    struct _rtPendingRequest* pending = &transport->pending_requests[i];
+    if (pending->in_use && pending->callback && pending->owner == con)
+    {
+      callbacks[num_cancelled] = pending->callback;
+      closures[num_cancelled] = pending->closure;
+      num_cancelled++;
+      pending->in_use = 0;
+    }
+  }
+  pthread_mutex_unlock(&transport->mutex);
+
+  for (k = 0; k < num_removed; ++k)
+  {
+    rtMessage_Create(&m);
+    rtMessage_SetInt32(m, "route_id", removed[k]);
+    rtConnection_SendControlMessage(transport, m, "_RTROUTED.INBOX.UNSUBSCRIBE");
+    rtMessage_Release(m);
+  }
+  free(removed);
+
+  for (i = 0; i < num_cancelled; ++i)
+    callbacks[i](rtErrorFromErrno(ECANCELED), NULL, closures[i]);
+
+  pthread_mutex_lock(&rtConnection_SharedMutex);
+  transport->num_handles--;
+  if (transport->num_handles == 0)
+    rtVector_RemoveItem(rtConnection_SharedConnections, transport, NULL);
+  else
+    transport = NULL;
+  pthread_mutex_unlock(&rtConnection_SharedMutex);
+
+  if (transport)
+    rtConnection_Destroy(transport);
+
+  free(con->application_name);
+  pthread_mutex_destroy(&con->mutex);
+  pthread_mutex_destroy(&con->dispatch_mutex);
+  pthread_cond_destroy(&con->response_cond);
+  free(con);
+}
+
+/**
+ * Waits in place of dispatch on a shared handle, the shared connection's
+ * reader thread invokes the handle's callbacks.
+ */
+static rtError
+rtConnection_WaitShared(rtConnection con, int32_t timeout)
+{
+  struct timespec ts;
+
+  pthread_mutex_lock(&con->mutex);
+  if (timeout < 0)
+  {
+    while (!rtConnection_IsClosing(con))
+      pthread_cond_wait(&con->response_cond, &con->mutex);
+  }
+  else
+  {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    while (!rtConnection_IsClosing(con))
+    {
+      if (pthread_cond_timedwait(&con->response_cond, &con->mutex, &ts) == ETIMEDOUT)
+        break;
+    }
+  }
+  pthread_mutex_unlock(&con->mutex);
+  return RT_ERROR_TIMEOUT;
+}
+
 rtError
 rtConnection_Create(rtConnection* con, char const* application_name, char const* router_config)
 {
@@ -252,6 +1428,7 @@ rtConnection_Create(rtConnection* con, char const* application_name, char const*
   rtMessage_SetString(conf, "appname", application_name);
   rtMessage_SetString(conf, "uri", router_config);
   rtMessage_SetInt32(conf, "start_router", 1);
+  rtMessage_SetInt32(conf, "shared", getenv("RTMSG_SHARED_CONNECTION") != NULL);
   return rtConnection_CreateWithConfig(con, conf);
 }
 
@@ -263,16 +1440,35 @@ rtConnection_CreateWithConfig(rtConnection* con, rtMessage const conf)
   char const* application_name;
   char const* router_config;
   int start_router;
+  int reader_thread;
+  int local_delivery;
+  int shared;
+  int32_t max_message_size;
 
   i = 0;
   err = RT_OK;
   application_name = NULL;
   router_config = NULL;
   start_router = 0;
+  reader_thread = 0;
+  local_delivery = 0;
+  shared = 0;
+  max_message_size = RTMSG_MAX_MESSAGE_SIZE;
 
   rtMessage_GetString(conf, "appname", &application_name);
   rtMessage_GetString(conf, "uri", &router_config);
   rtMessage_GetInt32(conf, "start_router", &start_router);
+  rtMessage_GetInt32(conf, "reader_thread", &reader_thread);
+  rtMessage_GetInt32(conf, "local_delivery", &local_delivery);
+  rtMessage_GetInt32(conf, "shared", &shared);
+  rtMessage_GetInt32(conf, "max_message_size", &max_message_size);
+
+  // a frame header always has to fit
+  if (max_message_size < RTMSG_RECV_BUFFER_SIZE - 1)
+    max_message_size = RTMSG_RECV_BUFFER_SIZE - 1;
+
+  if (shared)
+    return rtConnection_CreateShared(con, conf, application_name, router_config);
 
   if (start_router)
   {
@@ -281,374 +1477,1280 @@ rtConnection_CreateWithConfig(rtConnection* con, rtMessage const conf)
       return err;
   }
 
-  rtConnection c = (rtConnection) malloc(sizeof(struct _rtConnection));
-  if (!c)
+  rtConnection c = (rtConnection) malloc(sizeof(struct _rtConnection));
+  if (!c)
+    return rtErrorFromErrno(ENOMEM);
+
+  c->listeners = (struct _rtListener *) calloc(RTMSG_LISTENERS_INITIAL_SIZE, sizeof(struct _rtListener));
+  c->listeners_size = RTMSG_LISTENERS_INITIAL_SIZE;
+  c->num_listeners = 0;
+
+  c->num_interned_topics = 0;
+  c->num_declared_topics = 0;
+  c->pending_requests = (struct _rtPendingRequest *) calloc(RTMSG_PENDING_REQUESTS_MAX,
+    sizeof(struct _rtPendingRequest));
+  memset(c->timed_out_requests, 0, sizeof(c->timed_out_requests));
+  c->num_timed_out_requests = 0;
+  c->generation = 0;
+  c->event_loop = 0;
+  c->reconnect_after = 0;
+  c->closing = 0;
+  c->reader_running = 0;
+  c->reader_deadline = UINT64_MAX;
+  c->wake_fds[0] = -1;
+  c->wake_fds[1] = -1;
+  c->local_delivery = local_delivery;
+  c->transport = NULL;
+  c->num_handles = 0;
+  c->shared_uri = NULL;
+  c->recv_start = 0;
+  c->recv_end = 0;
+  c->recv_byte_saved = 0;
+  c->recv_saved_byte = 0;
+  c->dispatch_depth = 0;
+  rtVector_Create(&c->retired_buffers);
+  rtConnection_InitLocks(c);
+  c->send_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
+  c->recv_buffer = (uint8_t *) malloc(RTMSG_RECV_BUFFER_SIZE);
+  c->recv_capacity = RTMSG_RECV_BUFFER_SIZE;
+  c->max_message_size = max_message_size;
+  c->recv_grown = 0;
+  c->recv_discard = 0;
+  c->sequence_number = 1;
+  c->application_name = strdup(application_name);
+  c->fd = -1;
+  memset(c->inbox_name, 0, RTMSG_HEADER_MAX_TOPIC_LENGTH);
+  memset(&c->local_endpoint, 0, sizeof(struct sockaddr_storage));
+  memset(&c->remote_endpoint, 0, sizeof(struct sockaddr_storage));
+  memset(c->send_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
+  memset(c->recv_buffer, 0, RTMSG_RECV_BUFFER_SIZE);
+  snprintf(c->inbox_name, RTMSG_HEADER_MAX_TOPIC_LENGTH, "%s.INBOX.%d", c->application_name, (int) getpid());
+
+  err = rtSocketStorage_FromString(&c->remote_endpoint, router_config);
+  if (err != RT_OK)
+  {
+    rtLog_Warn("failed to parse:%s. %s", router_config, rtStrError(err));
+
+    // it isn't among the local delivery connections yet
+    c->local_delivery = 0;
+    rtConnection_Destroy(c);
+    return err;
+  }
+
+  err = rtConnection_ConnectAndRegister(c);
+  if (err != RT_OK)
+  {
+  }
+
+  if (err == RT_OK)
+  {
+    rtConnection_AddListener(c, c->inbox_name, onInboxMessage, c);
+    *con = c;
+
+    if (local_delivery)
+    {
+      pthread_mutex_lock(&rtConnection_LocalMutex);
+      if (!rtConnection_LocalConnections)
+        rtVector_Create(&rtConnection_LocalConnections);
+      rtVector_PushBack(rtConnection_LocalConnections, c);
+      pthread_mutex_unlock(&rtConnection_LocalMutex);
+    }
+
+    if (reader_thread && pipe(c->wake_fds) == -1)
+    {
+      rtLog_Warn("failed to create reader thread pipe. %s", strerror(errno));
+      c->wake_fds[0] = -1;
+      c->wake_fds[1] = -1;
+      reader_thread = 0;
+    }
+
+    for (i = 0; reader_thread && i < 2; ++i)
+    {
+      fcntl(c->wake_fds[i], F_SETFD, fcntl(c->wake_fds[i], F_GETFD) | FD_CLOEXEC);
+      fcntl(c->wake_fds[i], F_SETFL, fcntl(c->wake_fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    if (reader_thread)
+    {
+      int ret = pthread_create(&c->reader_thread, NULL, rtConnection_ReaderThread, c);
+      if (ret == 0)
+        c->reader_running = 1;
+      else
+        rtLog_Warn("failed to start reader thread. %s", strerror(ret));
+    }
+  }
+
+  return err;
+}
+
+rtError
+rtConnection_Destroy(rtConnection con)
+{
+  int i;
+
+  if (con && con->transport)
+  {
+    rtConnection_DestroyShared(con);
+    return 0;
+  }
+
+  if (con)
+  {
+    if (con->local_delivery)
+    {
+      pthread_mutex_lock(&rtConnection_LocalMutex);
+      rtVector_RemoveItem(rtConnection_LocalConnections, con, NULL);
+      pthread_mutex_unlock(&rtConnection_LocalMutex);
+    }
+
+    __atomic_store_n(&con->closing, 1, __ATOMIC_RELEASE);
+    if (con->fd != -1)
+      shutdown(con->fd, SHUT_RDWR);
+
+    // the shutdown wakes the reader thread up
+    if (con->reader_running)
+      pthread_join(con->reader_thread, NULL);
+
+    if (con->fd != -1)
+      close(con->fd);
+    if (con->wake_fds[0] != -1)
+      close(con->wake_fds[0]);
+    if (con->wake_fds[1] != -1)
+      close(con->wake_fds[1]);
+    if (con->send_buffer)
+      free(con->send_buffer);
+    if (con->recv_buffer)
+      free(con->recv_buffer);
+    rtVector_Destroy(con->retired_buffers, free);
+    if (con->application_name)
+      free(con->application_name);
+    rtConnection_ClearInternedTopics(con);
+    for (i = 0; i < con->num_declared_topics; ++i)
+      free(con->declared_topics[i].topic);
+    for (i = 0; i < (int) con->listeners_size; ++i)
+    {
+      if (con->listeners[i].in_use)
+      {
+        free(con->listeners[i].expression);
+        free(con->listeners[i].group);
+        free(con->listeners[i].filter);
+      }
+    }
+    free(con->listeners);
+    for (i = 0; i < RTMSG_PENDING_REQUESTS_MAX; ++i)
+    {
+      struct _rtPendingRequest* pending = &con->pending_requests[i];
+      if (pending->in_use && pending->callback)
+        pending->callback(rtErrorFromErrno(ECANCELED), NULL, pending->closure);
+      if (pending->response)
+        rtMessage_Release(pending->response);
+    }
+    free(con->pending_requests);
+    free(con->shared_uri);
+    pthread_mutex_destroy(&con->mutex);
+    pthread_mutex_destroy(&con->dispatch_mutex);
+    pthread_cond_destroy(&con->response_cond);
+    free(con);
+  }
+  return 0;
+}
+
+rtError
+rtConnection_SendErrorMessageToCaller(int clnt_fd ,rtMessageHeader const* request_header)
+{
+    rtConnection t_con = (rtConnection) malloc(sizeof(struct _rtConnection));
+    memset(t_con,0,sizeof(struct _rtConnection));
+    rtConnection_InitLocks(t_con);
+ 
+    t_con->fd = clnt_fd;
+    t_con->send_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
+    t_con->recv_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
+    memset(t_con->send_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
+    memset(t_con->recv_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
+    //Adding topic in request header
+    rtMessageHeader new_header;
+    rtMessageHeader_Init(&new_header);
+    strcpy(new_header.topic, "NO.ROUTE.RESPONSE");
+    strcpy(new_header.reply_topic, request_header->reply_topic);
+    new_header.sequence_number = request_header->sequence_number;
+
+    //Create Response
+    rtMessage res;
+    rtMessage_Create(&res);
+    rtMessage msg;
+    rtMessage_Create(&msg);
+    rtMessage_SetString(msg, "name", " ");
+    rtMessage_SetString(msg, "value", " ");
+    rtMessage_SetString(msg, "status_msg", "No Route found for this Parameter");
+    rtMessage_SetInt32(msg, "status", 1);
+    rtMessage_AddMessage(res, "result", msg);
+    //Send response
+    rtConnection_SendResponse(t_con, &new_header, res, 1000);
+    rtMessage_Release(msg);
+    rtMessage_Release(res);
+    return RT_OK;
+}
+rtError
+rtConnection_SendMessage(rtConnection con, rtMessage msg, char const* topic)
+{
+  return rtConnection_SendMessageWithPriority(con, msg, topic, rtMessagePriority_Normal);
+}
+
+rtError
+rtConnection_SendMessageWithPriority(rtConnection con, rtMessage msg, char const* topic,
+  rtMessagePriority priority)
+{
+  uint8_t* p;
+  uint32_t n;
+  rtError err;
+  struct iovec iov;
+
+  // a shared handle's messages go out on the process's connection
+  con = rtConnection_GetTransport(con);
+
+  // nobody would get it
+  if (!con->local_delivery && !rtConnection_HasInterest(con, topic))
+    return RT_OK;
+
+  rtMessage_ToByteArray(msg, &p, &n);
+  iov.iov_base = p;
+  iov.iov_len = n;
+  err = rtConnection_Publish(con, topic, &iov, 1, rtConnection_PriorityFlags(priority));
+  free(p);
+  return err;
+}
+
+rtError
+rtConnection_SendResponse(rtConnection con, rtMessageHeader const* request_hdr, rtMessage const res, int32_t timeout)
+{
+  uint8_t* p;
+  uint32_t n;
+  rtError err;
+
+  con = rtConnection_GetTransport(con);
+
+  // responses travel in the same lane as the request
+  rtMessage_ToByteArray(res, &p, &n);
+  err = rtConnection_SendInternal(con, request_hdr->reply_topic, p, n, request_hdr->topic,
+    rtMessageFlags_Response | (request_hdr->flags & rtMessageFlags_PriorityMask),
+    request_hdr->sequence_number);
+  free(p);
+
+  (void) timeout;
+
+  return err;
+}
+
+rtError
+rtConnection_SendBinary(rtConnection con, char const* topic, uint8_t const* p, uint32_t n)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) p;
+  iov.iov_len = n;
+  return rtConnection_Publish(rtConnection_GetTransport(con), topic, &iov, 1, 0);
+}
+
+rtError
+rtConnection_SendIov(rtConnection con, char const* topic, struct iovec const* iov, int n)
+{
+  return rtConnection_Publish(rtConnection_GetTransport(con), topic, iov, n, 0);
+}
+
+rtError
+rtConnection_SendRequest(rtConnection con, rtMessage const req, char const* topic,
+  rtMessage* res, int32_t timeout)
+{
+  return rtConnection_SendRequestWithPriority(con, req, topic, res, timeout, rtMessagePriority_Normal);
+}
+
+rtError
+rtConnection_SendRequestWithPriority(rtConnection con, rtMessage const req, char const* topic,
+  rtMessage* res, int32_t timeout, rtMessagePriority priority)
+{
+  uint8_t* p;
+  uint32_t n;
+  uint32_t sequence_number;
+  rtError err;
+  struct _rtPendingRequest* pending;
+
+  *res = NULL;
+  con = rtConnection_GetTransport(con);
+
+  pthread_mutex_lock(&con->mutex);
+  pending = rtConnection_AddPendingRequest(con, timeout, NULL, NULL);
+  sequence_number = pending ? pending->sequence_number : 0;
+  pthread_mutex_unlock(&con->mutex);
+  if (!pending)
+    return rtErrorFromErrno(ENOMEM);
+
+  rtMessage_ToByteArray(req, &p, &n);
+  err = rtConnection_SendInternal(con, topic, p, n, con->inbox_name,
+    rtMessageFlags_Request | rtConnection_PriorityFlags(priority), sequence_number);
+  free(p);
+
+  if (err == RT_OK)
+    err = rtConnection_WaitForResponse(con, pending, timeout);
+
+  pthread_mutex_lock(&con->mutex);
+  if (pending->done)
+    *res = pending->response;
+  pending->response = NULL;
+  if (pending->done && !*res)
+    err = pending->error;
+  if (pending->done)
+    pending->in_use = 0;
+  else
+    rtConnection_TimeOutPendingRequest(con, pending);
+  pthread_mutex_unlock(&con->mutex);
+
+  return *res ? RT_OK : err;
+}
+
+rtError
+rtConnection_SendRequestAsync(rtConnection con, rtMessage const req, char const* topic,
+  int32_t timeout, rtResponseCallback callback, void* closure)
+{
+  uint8_t* p;
+  uint32_t n;
+  uint32_t sequence_number;
+  rtError err;
+  rtConnection owner;
+  struct _rtPendingRequest* pending;
+
+  if (!callback)
+    return RT_ERROR_INVALID_ARG;
+
+  // a shared handle's requests are cancelled when it's destroyed
+  owner = con;
+  con = rtConnection_GetTransport(con);
+
+  rtConnection_ExpirePendingRequests(con);
+
+  pthread_mutex_lock(&con->mutex);
+  pending = rtConnection_AddPendingRequest(con, timeout, callback, closure);
+  sequence_number = pending ? pending->sequence_number : 0;
+  if (pending)
+    pending->owner = owner;
+  pthread_mutex_unlock(&con->mutex);
+  if (!pending)
+    return rtErrorFromErrno(ENOMEM);
+
+  rtMessage_ToByteArray(req, &p, &n);
+  err = rtConnection_SendInternal(con, topic, p, n, con->inbox_name, rtMessageFlags_Request,
+    sequence_number);
+  free(p);
+
+  // the caller hears about it right here, not from the callback
+  if (err != RT_OK)
+  {
+    pthread_mutex_lock(&con->mutex);
+    if (pending->in_use && pending->sequence_number == sequence_number)
+      pending->in_use = 0;
+    pthread_mutex_unlock(&con->mutex);
+  }
+  return err;
+}
+
+/**
+ * Waits until a response for the request arrives or the timeout is up.
+ */
+static rtError
+rtConnection_WaitForResponse(rtConnection con, struct _rtPendingRequest* pending, int32_t timeout)
+{
+  rtError err;
+  uint64_t now;
+  uint64_t until;
+  uint64_t deadline;
+  struct timespec ts;
+
+  err = RT_OK;
+  deadline = rtConnection_GetTimeMillis() + timeout;
+
+  pthread_mutex_lock(&con->mutex);
+  while (!pending->done && err == RT_OK)
+  {
+    // dispatch here unless the reader thread or some other thread already is,
+    // they hand the response over through response_cond. a callback running
+    // on the dispatching thread holds the dispatch lock already
+    if ((!con->reader_running || pthread_equal(pthread_self(), con->reader_thread)) &&
+        pthread_mutex_trylock(&con->dispatch_mutex) == 0)
+    {
+      pthread_mutex_unlock(&con->mutex);
+      now = rtConnection_GetTimeMillis();
+      err = rtConnection_TimedDispatch(con, deadline > now ? (int32_t) (deadline - now) : 0);
+      pthread_mutex_unlock(&con->dispatch_mutex);
+      pthread_mutex_lock(&con->mutex);
+      if (err == RT_ERROR_TIMEOUT)
+        err = RT_OK;
+    }
+    else
+    {
+      until = rtConnection_GetTimeMillis() + RTMSG_RESPONSE_WAIT_INTERVAL;
+      if (until > deadline)
+        until = deadline;
+      ts.tv_sec = until / 1000;
+      ts.tv_nsec = (until % 1000) * 1000000;
+      pthread_cond_timedwait(&con->response_cond, &con->mutex, &ts);
+    }
+
+    now = rtConnection_GetTimeMillis();
+    if (!pending->done && err == RT_OK && now >= deadline)
+      err = RT_ERROR_TIMEOUT;
+  }
+  pthread_mutex_unlock(&con->mutex);
+  return err;
+}
+
+/**
+ * Writes all of the vector, picking up after partial writes.
+ */
+static rtError
+rtConnection_WriteVector(int fd, struct iovec* vec, int count)
+{
+  ssize_t n;
+  struct msghdr msg;
+
+  while (count > 0)
+  {
+    // sendmsg rather than writev for MSG_NOSIGNAL, a router that went away
+    // is reconnected to instead of killing the process
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return rtErrorFromErrno(errno);
+    }
+
+    while (count > 0 && (size_t) n >= vec->iov_len)
+    {
+      n -= vec->iov_len;
+      vec++;
+      count--;
+    }
+
+    if (count > 0)
+    {
+      vec->iov_base = (uint8_t *) vec->iov_base + n;
+      vec->iov_len -= n;
+    }
+  }
+  return RT_OK;
+}
+
+/**
+ * Sends a frame with the payload gathered from iov, header and payload go
+ * out in a single sendmsg. A sequence_number of zero takes the next one,
+ * responses carry the request's.
+ */
+static rtError
+rtConnection_SendFrame(rtConnection con, char const* topic, struct iovec const* iov, int iovcnt,
+  char const* reply_topic, int flags, uint32_t sequence_number)
+{
+  int i;
+  rtError err;
+  int num_attempts;
+  int max_attempts;
+  uint32_t generation;
+  uint64_t payload_length;
+  rtMessageHeader header;
+  struct iovec vec[RTMSG_SEND_IOV_MAX + 1];
+  uint8_t buff[28 + (2 * RTMSG_HEADER_MAX_TOPIC_LENGTH)];
+
+  max_attempts = 2;
+  num_attempts = 0;
+  payload_length = 0;
+
+  if (iovcnt < 0 || iovcnt > RTMSG_SEND_IOV_MAX)
+    return RT_ERROR_INVALID_ARG;
+
+  for (i = 0; i < iovcnt; ++i)
+    payload_length += iov[i].iov_len;
+
+  if (payload_length > UINT32_MAX)
+    return RT_ERROR_INVALID_ARG;
+
+  // the whole frame goes out before any other thread's
+  pthread_mutex_lock(&con->mutex);
+
+  rtMessageHeader_Init(&header);
+  header.payload_length = (uint32_t) payload_length;
+  if (reply_topic)
+  {
+    strncpy(header.reply_topic, reply_topic, sizeof(header.reply_topic)-1);
+    header.reply_topic_length = strlen(reply_topic);
+  }
+  else
+  {
+    header.reply_topic[0] = '\0';
+    header.reply_topic_length = 0;
+  }
+  header.sequence_number = sequence_number ? sequence_number : rtConnection_NextSequenceNumber(con);
+
+  do
+  {
+    // encoded again after a reconnect, the new router doesn't know the
+    // interned ids of the old one
+    header.flags = flags;
+    header.control_data = rtConnection_FindInternedTopic(con, topic);
+    if (header.control_data != 0)
+    {
+      header.flags |= rtMessageFlags_InternedTopic;
+      header.topic[0] = '\0';
+      header.topic_length = 0;
+    }
+    else
+    {
+      strncpy(header.topic, topic, sizeof(header.topic)-1);
+      header.topic_length = strlen(header.topic);
+    }
+
+    err = rtMessageHeader_Encode(&header, buff);
+    if (err != RT_OK)
+      break;
+
+    // the send moves through its own copy of the vector
+    vec[0].iov_base = buff;
+    vec[0].iov_len = header.header_length;
+    for (i = 0; i < iovcnt; ++i)
+      vec[i + 1] = iov[i];
+
+    // an event loop's connection is left without a socket until it reconnects
+    generation = con->generation;
+    if (con->fd == -1)
+      err = rtErrorFromErrno(ENOTCONN);
+    else
+      err = rtConnection_WriteVector(con->fd, vec, iovcnt + 1);
+
+    // a frame that didn't make it is sent again on the new connection
+    if (err != RT_OK && rtConnection_ShouldReregister(err) && num_attempts < max_attempts)
+    {
+      pthread_mutex_unlock(&con->mutex);
+      err = rtConnection_Reconnect(con, generation);
+      pthread_mutex_lock(&con->mutex);
+      if (err == RT_OK)
+        err = RT_FAIL;
+    }
+  }
+  while ((err != RT_OK) && (num_attempts++ < max_attempts));
+
+  pthread_mutex_unlock(&con->mutex);
+  return err;
+}
+
+rtError
+rtConnection_SendInternal(rtConnection con, char const* topic, uint8_t const* buff,
+  uint32_t n, char const* reply_topic, int flags, uint32_t sequence_number)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) buff;
+  iov.iov_len = n;
+  return rtConnection_SendFrame(con, topic, &iov, 1, reply_topic, flags, sequence_number);
+}
+
+static int
+rtConnection_IsTopicMatch(char const* topic, char const* exp)
+{
+  char const* t = topic;
+  char const* e = exp;
+
+  // same rules as the router's
+  while (*t && *e)
+  {
+    if (*e == '*')
+    {
+      while (*t && *t != '.')
+        t++;
+      e++;
+    }
+
+    if (*e == '>')
+    {
+      while (*t)
+        t++;
+      e++;
+    }
+
+    if (!(*t || *e))
+      break;
+
+    if (*t != *e)
+      break;
+
+    t++;
+    e++;
+  }
+  return !(*t || *e);
+}
+
+/**
+ * Hands a message straight to the local listeners of every connection in the
+ * process that has local delivery on. The router leaves these listeners out
+ * when it routes the same message.
+ */
+static void
+rtConnection_DeliverLocal(char const* topic, struct iovec const* iov, int iovcnt, int flags)
+{
+  int i;
+  size_t j;
+  uint32_t k;
+  size_t num_matches;
+  size_t max_matches;
+  uint32_t n;
+  uint8_t* payload;
+  rtMessageHeader hdr;
+  struct _rtLocalListener* matches;
+  struct _rtLocalListener* tmp;
+
+  num_matches = 0;
+  max_matches = 0;
+  matches = NULL;
+
+  if (strlen(topic) >= RTMSG_HEADER_MAX_TOPIC_LENGTH)
+    return;
+
+  // callbacks run unlocked, like they do on dispatch
+  pthread_mutex_lock(&rtConnection_LocalMutex);
+  for (j = 0; rtConnection_LocalConnections && j < rtVector_Size(rtConnection_LocalConnections); ++j)
+  {
+    rtConnection con = (rtConnection) rtVector_At(rtConnection_LocalConnections, j);
+
+    pthread_mutex_lock(&con->mutex);
+    for (k = 0; k < con->listeners_size; ++k)
+    {
+      struct _rtListener const* listener = &con->listeners[k];
+      if (!listener->in_use || !listener->local || !rtConnection_IsTopicMatch(topic, listener->expression))
+        continue;
+
+      if (num_matches == max_matches)
+      {
+        max_matches = max_matches ? max_matches * 2 : 8;
+        tmp = (struct _rtLocalListener *) realloc(matches, max_matches * sizeof(struct _rtLocalListener));
+        if (!tmp)
+          break;
+        matches = tmp;
+      }
+      matches[num_matches].callback = listener->callback;
+      matches[num_matches].closure = listener->closure;
+      matches[num_matches].subscription_id = listener->subscription_id;
+      num_matches++;
+    }
+    pthread_mutex_unlock(&con->mutex);
+  }
+  pthread_mutex_unlock(&rtConnection_LocalMutex);
+
+  if (num_matches == 0)
+  {
+    free(matches);
+    return;
+  }
+
+  // listeners get the payload terminated, as they would from the socket
+  n = 0;
+  for (i = 0; i < iovcnt; ++i)
+    n += iov[i].iov_len;
+  payload = (uint8_t *) malloc(n + 1);
+  if (!payload)
+  {
+    free(matches);
+    return;
+  }
+  for (i = 0, n = 0; i < iovcnt; ++i)
+  {
+    memcpy(payload + n, iov[i].iov_base, iov[i].iov_len);
+    n += iov[i].iov_len;
+  }
+  payload[n] = '\0';
+
+  rtMessageHeader_Init(&hdr);
+  strcpy(hdr.topic, topic);
+  hdr.topic_length = strlen(hdr.topic);
+  hdr.flags = flags;
+  hdr.payload_length = n;
+
+  for (j = 0; j < num_matches; ++j)
+  {
+    hdr.control_data = matches[j].subscription_id;
+    matches[j].callback(&hdr, payload, n, matches[j].closure);
+  }
+
+  free(payload);
+  free(matches);
+}
+
+/**
+ * Sends a message that isn't a request or response, to local listeners first
+ * when the connection has local delivery on.
+ */
+static rtError
+rtConnection_Publish(rtConnection con, char const* topic, struct iovec const* iov, int iovcnt,
+  int flags)
+{
+  int i;
+  uint64_t payload_length;
+
+  if (con->local_delivery && iovcnt >= 0 && iovcnt <= RTMSG_SEND_IOV_MAX)
+  {
+    for (i = 0, payload_length = 0; i < iovcnt; ++i)
+      payload_length += iov[i].iov_len;
+    if (payload_length < UINT32_MAX)
+      rtConnection_DeliverLocal(topic, iov, iovcnt, flags);
+  }
+
+  // nobody else would get it
+  if (!rtConnection_HasInterest(con, topic))
+    return RT_OK;
+  return rtConnection_SendFrame(con, topic, iov, iovcnt, NULL, flags, 0);
+}
+
+rtError
+rtConnection_InternTopic(rtConnection con, char const* topic)
+{
+  int32_t id;
+  uint32_t generation;
+  rtError err;
+  rtMessage req;
+  rtMessage res;
+
+  con = rtConnection_GetTransport(con);
+
+  pthread_mutex_lock(&con->mutex);
+  id = (int32_t) rtConnection_FindInternedTopic(con, topic);
+  err = con->num_interned_topics >= RTMSG_INTERNED_TOPICS_MAX ? rtErrorFromErrno(ENOMEM) : RT_OK;
+  generation = con->generation;
+  pthread_mutex_unlock(&con->mutex);
+
+  if (id != 0)
+    return RT_OK;
+  if (err != RT_OK)
+    return err;
+
+  rtMessage_Create(&req);
+  rtMessage_SetString(req, "topic", topic);
+  err = rtConnection_SendRequest(con, req, "_RTROUTED.INBOX.INTERN", &res, 2000);
+  rtMessage_Release(req);
+  if (err != RT_OK)
+    return err;
+
+  id = 0;
+  rtMessage_GetInt32(res, "id", &id);
+  rtMessage_Release(res);
+
+  // the router's table is full, the topic keeps going out as a string
+  if (id <= 0)
+    return RT_ERROR_INVALID_OPERATION;
+
+  // another thread may have registered it meanwhile, and an id from before
+  // a reconnect belongs to another router
+  pthread_mutex_lock(&con->mutex);
+  if (con->generation == generation && rtConnection_FindInternedTopic(con, topic) == 0 &&
+      con->num_interned_topics < RTMSG_INTERNED_TOPICS_MAX)
+  {
+    con->interned_topics[con->num_interned_topics].topic = strdup(topic);
+    con->interned_topics[con->num_interned_topics].id = (uint32_t) id;
+    con->num_interned_topics++;
+  }
+  pthread_mutex_unlock(&con->mutex);
+  return RT_OK;
+}
+
+rtError
+rtConnection_DeclareTopic(rtConnection con, char const* topic)
+{
+  int i;
+
+  con = rtConnection_GetTransport(con);
+
+  pthread_mutex_lock(&con->mutex);
+  for (i = 0; i < con->num_declared_topics; ++i)
+  {
+    if (strcmp(con->declared_topics[i].topic, topic) == 0)
+    {
+      pthread_mutex_unlock(&con->mutex);
+      return RT_OK;
+    }
+  }
+
+  if (con->num_declared_topics >= RTMSG_DECLARED_TOPICS_MAX)
+  {
+    pthread_mutex_unlock(&con->mutex);
+    return rtErrorFromErrno(ENOMEM);
+  }
+
+  // sends go through until the router says otherwise, an older router never does
+  con->declared_topics[i].topic = strdup(topic);
+  con->declared_topics[i].interest = 1;
+  con->num_declared_topics++;
+  pthread_mutex_unlock(&con->mutex);
+
+  // declared topics stay put until the connection is destroyed
+  rtConnection_SendDeclaration(con, &con->declared_topics[i]);
+  return RT_OK;
+}
+
+/**
+ * Finds the slot of a subscription id in the listener table, or the empty
+ * slot it would go in. The table is open addressed with linear probing and
+ * never more than half full.
+ */
+static struct _rtListener*
+rtConnection_ProbeListener(struct _rtListener* listeners, uint32_t size, uint32_t subscription_id)
+{
+  uint32_t i;
+
+  i = (subscription_id * 2654435761u) & (size - 1);
+  while (listeners[i].in_use && listeners[i].subscription_id != subscription_id)
+    i = (i + 1) & (size - 1);
+  return &listeners[i];
+}
+
+static rtError
+rtConnection_GrowListeners(rtConnection con)
+{
+  uint32_t i;
+  uint32_t size;
+  struct _rtListener* listeners;
+
+  size = con->listeners_size * 2;
+  listeners = (struct _rtListener *) calloc(size, sizeof(struct _rtListener));
+  if (!listeners)
     return rtErrorFromErrno(ENOMEM);
 
-  for (i = 0; i < RTMSG_LISTENERS_MAX; ++i)
+  for (i = 0; i < con->listeners_size; ++i)
   {
-    c->listeners[i].in_use = 0;
-    c->listeners[i].closure = NULL;
-    c->listeners[i].callback = NULL;
-    c->listeners[i].subscription_id = 0;
+    if (con->listeners[i].in_use)
+      *rtConnection_ProbeListener(listeners, size, con->listeners[i].subscription_id) = con->listeners[i];
   }
 
-  c->response = NULL;
-  c->send_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
-  c->recv_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
-  c->sequence_number = 1;
-  c->application_name = strdup(application_name);
-  c->fd = -1;
-  memset(c->inbox_name, 0, RTMSG_HEADER_MAX_TOPIC_LENGTH);
-  memset(&c->local_endpoint, 0, sizeof(struct sockaddr_storage));
-  memset(&c->remote_endpoint, 0, sizeof(struct sockaddr_storage));
-  memset(c->send_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
-  memset(c->recv_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
-  snprintf(c->inbox_name, RTMSG_HEADER_MAX_TOPIC_LENGTH, "%s.INBOX.%d", c->application_name, (int) getpid());
-
-  err = rtSocketStorage_FromString(&c->remote_endpoint, router_config);
-  if (err != RT_OK)
-  {
-    rtLog_Warn("failed to parse:%s. %s", router_config, rtStrError(err));
-    free(c);
-    return err;
-  }
+  free(con->listeners);
+  con->listeners = listeners;
+  con->listeners_size = size;
+  return RT_OK;
+}
 
-  err = rtConnection_ConnectAndRegister(c);
-  if (err != RT_OK)
+/**
+ * Frees a listener's slot, moving listeners further along its probe
+ * sequence back so lookups still find them. Called with the mutex held.
+ */
+static void
+rtConnection_RemoveListener(rtConnection con, struct _rtListener* listener)
+{
+  uint32_t i;
+  uint32_t j;
+  uint32_t home;
+  uint32_t mask;
+
+  free(listener->expression);
+  free(listener->group);
+  free(listener->filter);
+
+  mask = con->listeners_size - 1;
+  i = (uint32_t) (listener - con->listeners);
+  j = i;
+  while (1)
   {
-  }
+    j = (j + 1) & mask;
+    if (!con->listeners[j].in_use)
+      break;
 
-  if (err == RT_OK)
-  {
-    rtConnection_AddListener(c, c->inbox_name, onInboxMessage, c);
-    *con = c;
+    // a listener can only move back as far as its home slot
+    home = (con->listeners[j].subscription_id * 2654435761u) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask))
+    {
+      con->listeners[i] = con->listeners[j];
+      i = j;
+    }
   }
 
-  return err;
+  memset(&con->listeners[i], 0, sizeof(struct _rtListener));
+  con->num_listeners--;
 }
 
-rtError
-rtConnection_Destroy(rtConnection con)
+static rtError
+rtConnection_AddListenerInternal(rtConnection con, char const* expression, char const* group,
+  char const* filter, uint32_t max_rate, rtMessageCallback callback, void* closure)
 {
-  if (con)
+  rtError err;
+  uint32_t subscription_id;
+  rtMessage m;
+  rtConnection owner;
+  struct _rtListener* listener;
+
+  // subscription ids are unique within the process, a shared connection
+  // tells its handles' messages apart by them
+  owner = con;
+  con = rtConnection_GetTransport(con);
+
+  pthread_mutex_lock(&con->mutex);
+  if ((con->num_listeners + 1) * 2 > con->listeners_size)
   {
-    if (con->fd != -1)
+    err = rtConnection_GrowListeners(con);
+    if (err != RT_OK)
     {
-      shutdown(con->fd, SHUT_RDWR);
-      close(con->fd);
+      pthread_mutex_unlock(&con->mutex);
+      return err;
     }
-    if (con->send_buffer)
-      free(con->send_buffer);
-    if (con->recv_buffer)
-      free(con->recv_buffer);
-    if (con->application_name)
-      free(con->application_name);
-    free(con);
   }
+
+  subscription_id = rtConnection_GetNextSubscriptionId();
+  listener = rtConnection_ProbeListener(con->listeners, con->listeners_size, subscription_id);
+  listener->in_use = 1;
+  listener->subscription_id = subscription_id;
+  listener->closure = closure;
+  listener->callback = callback;
+  listener->expression = strdup(expression);
+  listener->group = group ? strdup(group) : NULL;
+  listener->filter = filter ? strdup(filter) : NULL;
+  listener->max_rate = max_rate;
+  listener->local = con->local_delivery && !group && !filter && !max_rate;
+  listener->owner = owner;
+  con->num_listeners++;
+
+  // the listener may move in the table once the mutex is released, a
+  // reconnect meanwhile subscribes it too and the router ignores the repeat
+  m = rtConnection_CreateSubscription(listener);
+  pthread_mutex_unlock(&con->mutex);
+
+  rtConnection_SendControlMessage(con, m, "_RTROUTED.INBOX.SUBSCRIBE");
+  rtMessage_Release(m);
   return 0;
 }
 
 rtError
-rtConnection_SendErrorMessageToCaller(int clnt_fd ,rtMessageHeader const* request_header)
+rtConnection_AddListener(rtConnection con, char const* expression, rtMessageCallback callback, void* closure)
 {
-    rtConnection t_con = (rtConnection) malloc(sizeof(struct _rtConnection));
-    memset(t_con,0,sizeof(struct _rtConnection));
- 
-    t_con->fd = clnt_fd;
-    t_con->send_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
-    t_con->recv_buffer = (uint8_t *) malloc(RTMSG_SEND_BUFFER_SIZE);
-    memset(t_con->send_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
-    memset(t_con->recv_buffer, 0, RTMSG_SEND_BUFFER_SIZE);
-    //Adding topic in request header
-    rtMessageHeader new_header;
-    rtMessageHeader_Init(&new_header);
-    strcpy(new_header.topic, "NO.ROUTE.RESPONSE");
-    strcpy(new_header.reply_topic, request_header->reply_topic);
-
-    //Create Response
-    rtMessage res;
-    rtMessage_Create(&res);
-    rtMessage msg;
-    rtMessage_Create(&msg);
-    rtMessage_SetString(msg, "name", " ");
-    rtMessage_SetString(msg, "value", " ");
-    rtMessage_SetString(msg, "status_msg", "No Route found for this Parameter");
-    rtMessage_SetInt32(msg, "status", 1);
-    rtMessage_AddMessage(res, "result", msg);
-    //Send response
-    rtConnection_SendResponse(t_con, &new_header, res, 1000);
-    rtMessage_Release(msg);
-    rtMessage_Release(res);
-    return RT_OK;
+  return rtConnection_AddListenerInternal(con, expression, NULL, NULL, 0, callback, closure);
 }
+
 rtError
-rtConnection_SendMessage(rtConnection con, rtMessage msg, char const* topic)
+rtConnection_AddGroupListener(rtConnection con, char const* expression, char const* group,
+  rtMessageCallback callback, void* closure)
 {
-  uint8_t* p;
-  uint32_t n;
-  rtError err;
-  rtMessage_ToByteArray(msg, &p, &n);
-  err = rtConnection_SendBinary(con, topic, p, n);
-  free(p);
-  return err;
+  return rtConnection_AddListenerInternal(con, expression, group, NULL, 0, callback, closure);
+}
+
+/**
+ * Checks a filter against the limits rtrouted evaluates filters with, the
+ * router refuses a subscription with any other filter.
+ */
+static int
+rtConnection_IsValidFilter(char const* text)
+{
+  int num_conditions;
+  cJSON* json;
+  cJSON* item;
+  cJSON* min;
+  cJSON* max;
+
+  if (strlen(text) >= RTMSG_MAX_FILTER_LEN)
+    return 0;
+
+  json = cJSON_Parse(text);
+  if (!json || json->type != cJSON_Object)
+  {
+    if (json)
+      cJSON_Delete(json);
+    return 0;
+  }
+
+  num_conditions = 0;
+  for (item = json->child; item; item = item->next)
+  {
+    if (num_conditions >= RTMSG_MAX_FILTER_CONDITIONS || strlen(item->string) >= RTMSG_MAX_FILTER_FIELD_LEN)
+      break;
+
+    if (item->type == cJSON_String)
+    {
+      if (strlen(item->valuestring) >= RTMSG_MAX_FILTER_VALUE_LEN)
+        break;
+    }
+    else if (item->type == cJSON_Object)
+    {
+      min = cJSON_GetObjectItem(item, "min");
+      max = cJSON_GetObjectItem(item, "max");
+      if ((min && min->type != cJSON_Number) || (max && max->type != cJSON_Number) || (!min && !max))
+        break;
+    }
+    else if (item->type != cJSON_Number && item->type != cJSON_True && item->type != cJSON_False &&
+             item->type != cJSON_NULL)
+    {
+      break;
+    }
+    num_conditions++;
+  }
+
+  cJSON_Delete(json);
+  return !item && num_conditions > 0;
 }
 
 rtError
-rtConnection_SendResponse(rtConnection con, rtMessageHeader const* request_hdr, rtMessage const res, int32_t timeout)
+rtConnection_AddFilteredListener(rtConnection con, char const* expression, rtMessage filter,
+  rtMessageCallback callback, void* closure)
 {
-  uint8_t* p;
-  uint32_t n;
   rtError err;
+  char* text;
+  uint32_t n;
 
-  rtMessage_ToByteArray(res, &p, &n);
-  err = rtConnection_SendInternal(con, request_hdr->reply_topic, p, n, request_hdr->topic, rtMessageFlags_Response);
-  free(p);
+  text = NULL;
+  if (!filter || rtMessage_ToString(filter, &text, &n) != RT_OK || !text)
+    return RT_ERROR_INVALID_ARG;
 
-  (void) timeout;
+  if (!rtConnection_IsValidFilter(text))
+  {
+    free(text);
+    return RT_ERROR_INVALID_ARG;
+  }
 
+  err = rtConnection_AddListenerInternal(con, expression, NULL, text, 0, callback, closure);
+  free(text);
   return err;
 }
 
 rtError
-rtConnection_SendBinary(rtConnection con, char const* topic, uint8_t const* p, uint32_t n)
+rtConnection_AddConflatedListener(rtConnection con, char const* expression, uint32_t max_rate,
+  rtMessageCallback callback, void* closure)
 {
-  return rtConnection_SendInternal(con, topic, p, n, NULL, 0);
+  if (max_rate == 0)
+    return RT_ERROR_INVALID_ARG;
+  return rtConnection_AddListenerInternal(con, expression, NULL, NULL, max_rate, callback, closure);
 }
 
 rtError
-rtConnection_SendRequest(rtConnection con, rtMessage const req, char const* topic,
-  rtMessage* res, int32_t timeout)
+rtConnection_Dispatch(rtConnection con)
 {
-  uint8_t* p;
-  uint32_t n;
-  rtError err;
-  rtMessage_ToByteArray(req, &p, &n);
+  return rtConnection_TimedDispatch(con, -1);
+}
 
-  err = rtConnection_SendInternal(con, topic, p, n, con->inbox_name, rtMessageFlags_Request);
-  free(p);
-  if (err != RT_OK)
-    return err;
+int
+rtConnection_GetFd(rtConnection con)
+{
+  int fd;
 
-  *res = NULL;
+  pthread_mutex_lock(&con->mutex);
+  fd = con->fd;
+  pthread_mutex_unlock(&con->mutex);
+  return fd;
+}
 
-  time_t start = time(NULL);
-  time_t now   = start;
-  time_t duration = (timeout / 1000);
+rtError
+rtConnection_ProcessReadable(rtConnection con)
+{
+  rtError err;
 
-  while ((now - start) < duration)
-  {
-    err = rtConnection_TimedDispatch(con, timeout);
-    if (err != RT_ERROR_TIMEOUT && err != RT_OK)
-      return err;
+  if (con->reader_running || con->transport)
+    return RT_ERROR_INVALID_ARG;
 
-    if (con->response != NULL)
-    {
-      // TODO: add ref counting to rtMessage
-      *res = con->response;
-      con->response = NULL;
-      return RT_OK;
-    }
+  // from now on the connection is reconnected without waiting
+  con->event_loop = 1;
 
-    now = time(NULL);
+  // a zero timeout reads what's there, a frame that isn't complete yet is
+  // finished on a later call
+  do
+  {
+    err = rtConnection_TimedDispatch(con, 0);
   }
+  while (err == RT_OK && !rtConnection_IsClosing(con));
 
-  return RT_ERROR_TIMEOUT;
+  return err == RT_ERROR_TIMEOUT ? RT_OK : err;
 }
 
-rtError
-rtConnection_SendInternal(rtConnection con, char const* topic, uint8_t const* buff,
-  uint32_t n, char const* reply_topic, int flags)
+static int
+rtConnection_FindListener(rtConnection con, uint32_t subscription_id, rtMessageCallback* callback,
+  void** closure)
 {
-  rtError err;
-  int num_attempts;
-  int max_attempts;
-  ssize_t bytes_sent;
-  rtMessageHeader header;
-
-  max_attempts = 2;
-  num_attempts = 0;
+  int found;
+  struct _rtListener const* listener;
 
-  rtMessageHeader_Init(&header);
-  header.payload_length = n;
-
-  strncpy(header.topic, topic, sizeof(header.topic)-1);
-  header.topic_length = strlen(header.topic);
-  if (reply_topic)
+  found = 0;
+  pthread_mutex_lock(&con->mutex);
+  listener = rtConnection_ProbeListener(con->listeners, con->listeners_size, subscription_id);
+  if (listener->in_use)
   {
-    strncpy(header.reply_topic, reply_topic, sizeof(header.reply_topic)-1);
-    header.reply_topic_length = strlen(reply_topic);
+    *callback = listener->callback;
+    *closure = listener->closure;
+    found = 1;
   }
-  else
+  pthread_mutex_unlock(&con->mutex);
+  return found;
+}
+
+/**
+ * Hands the frame at recv_start to its listeners and consumes it. Called
+ * with the dispatch lock held.
+ */
+static void
+rtConnection_DispatchFrame(rtConnection con, rtMessageHeader* hdr)
+{
+  uint32_t i;
+  uint32_t num_ids;
+  uint32_t ids[RTMSG_HEADER_MAX_SUBSCRIPTIONS];
+  uint32_t frame_end;
+  uint8_t* buff;
+  uint8_t* payload;
+  rtMessageCallback callback;
+  void* closure;
+
+  num_ids = 0;
+  buff = con->recv_buffer;
+  payload = buff + con->recv_start + hdr->header_length;
+  frame_end = con->recv_start + hdr->header_length + hdr->payload_length;
+
+  // other subscriptions matched by the same message, copied out before any
+  // callback gets a chance to dispatch on its own
+  if (hdr->flags & rtMessageFlags_MultipleSubscriptions)
   {
-    header.reply_topic[0] = '\0';
-    header.reply_topic_length = 0;
+    num_ids = rtMessageHeader_DecodeSubscriptions(hdr, buff + con->recv_start, ids,
+      RTMSG_HEADER_MAX_SUBSCRIPTIONS);
   }
-  header.sequence_number = con->sequence_number++;
-  header.flags = flags;
-
-  err = rtMessageHeader_Encode(&header, con->send_buffer);
-  if (err != RT_OK)
-    return err;
 
-  do
+  // help out json parsers and other string parses. the byte may be the
+  // start of the next frame and is put back afterwards
+  con->recv_saved_byte = buff[frame_end];
+  con->recv_byte_saved = 1;
+  buff[frame_end] = '\0';
+  con->recv_start = frame_end;
+  con->dispatch_depth++;
+
+  // responses to our requests, including the router's no-route errors that
+  // carry no subscription id, are matched by sequence number instead
+  if ((hdr->flags & rtMessageFlags_Response) && strcmp(hdr->topic, con->inbox_name) == 0)
   {
-    bytes_sent = send(con->fd, con->send_buffer, header.header_length, MSG_NOSIGNAL);
-    if (bytes_sent != header.header_length)
-    {
-      if (bytes_sent == -1)
-        err = rtErrorFromErrno(errno);
-      else
-        err = RT_FAIL;
-    }
+    rtConnection_OnResponse(con, hdr, payload, hdr->payload_length, RT_OK);
+  }
+  else
+  {
+    // callbacks run unlocked, they're free to send or add listeners
+    if (rtConnection_FindListener(con, hdr->control_data, &callback, &closure))
+      callback(hdr, payload, hdr->payload_length, closure);
 
-    if (err == RT_OK)
+    for (i = 0; i < num_ids; ++i)
     {
-      bytes_sent = send(con->fd, buff, header.payload_length, MSG_NOSIGNAL);
-      if (bytes_sent != header.payload_length)
+      if (rtConnection_FindListener(con, ids[i], &callback, &closure))
       {
-        if (bytes_sent == -1)
-          err = rtErrorFromErrno(errno);
-        else
-          err = RT_FAIL;
+        hdr->control_data = ids[i];
+        callback(hdr, payload, hdr->payload_length, closure);
       }
     }
-
-    if (err != RT_OK && rtConnection_ShouldReregister(err))
-    {
-      err = rtConnection_EnsureRoutingDaemon();
-      if (err == RT_OK)
-        err = rtConnection_ConnectAndRegister(con);
-    }
   }
-  while ((err != RT_OK) && (num_attempts++ < max_attempts));
-
-  return err;
-}
 
-rtError
-rtConnection_AddListener(rtConnection con, char const* expression, rtMessageCallback callback, void* closure)
-{
-  int i;
+  con->dispatch_depth--;
 
-  for (i = 0; i < RTMSG_LISTENERS_MAX; ++i)
+  // unless a dispatch from within a callback already moved on to a new buffer
+  if (con->recv_byte_saved && con->recv_buffer == buff)
   {
-    if (!con->listeners[i].in_use)
-      break;
+    buff[frame_end] = con->recv_saved_byte;
+    con->recv_byte_saved = 0;
   }
-
-  if (i >= RTMSG_LISTENERS_MAX)
-    return rtErrorFromErrno(ENOMEM);
-
-  con->listeners[i].in_use = 1;
-  con->listeners[i].subscription_id = rtConnection_GetNextSubscriptionId();
-  con->listeners[i].closure = closure;
-  con->listeners[i].callback = callback;
-  con->listeners[i].expression = strdup(expression);
-
-  rtMessage m;
-  rtMessage_Create(&m);
-  rtMessage_SetString(m, "topic", expression);
-  rtMessage_SetInt32(m, "route_id", con->listeners[i].subscription_id); 
-  rtConnection_SendMessage(con, m, "_RTROUTED.INBOX.SUBSCRIBE");
-  rtMessage_Release(m);
-
-  return 0;
 }
 
 rtError
-rtConnection_Dispatch(rtConnection con)
+rtConnection_TimedDispatch(rtConnection con, int32_t timeout)
 {
-  return rtConnection_TimedDispatch(con, -1);
+  return rtConnection_DispatchBatch(con, INT32_MAX, timeout);
 }
 
 rtError
-rtConnection_TimedDispatch(rtConnection con, int32_t timeout)
+rtConnection_DispatchBatch(rtConnection con, int32_t max_messages, int32_t timeout)
 {
-  int i;
+  int reconnected;
   int num_attempts;
   int max_attempts;
-  uint8_t const*  itr;
+  int32_t num_messages;
+  uint32_t needed;
+  uint32_t generation;
+  uint64_t deadline;
   rtMessageHeader hdr;
   rtError err;
 
-  i = 0;
   num_attempts = 0;
   max_attempts = 4;
+  num_messages = 0;
+  deadline = timeout < 0 ? 0 : rtConnection_GetTimeMillis() + timeout;
+
+  // the shared connection dispatches on its own thread, or on this one if
+  // that thread couldn't be started
+  if (con->transport && con->transport->reader_running)
+    return rtConnection_WaitShared(con, timeout);
+  con = rtConnection_GetTransport(con);
 
   rtMessageHeader_Init(&hdr);
 
-  // TODO: no error handling right now, all synch I/O
+  // one reader at a time, frames stay in recv_buffer until all of their
+  // callbacks have returned
+  pthread_mutex_lock(&con->dispatch_mutex);
+
+  // a callback dispatching on its own mustn't read over the terminator of
+  // the frame it was handed
+  if (con->dispatch_depth > 0 && con->recv_byte_saved)
+    rtConnection_ResizeBuffer(con, con->recv_capacity);
 
   do
   {
-    con->state = rtConnectionState_ReadHeaderPreamble;
-    err = rtConnection_ReadUntil(con, con->recv_buffer, 4, timeout);
+    pthread_mutex_lock(&con->mutex);
+    generation = con->generation;
+    pthread_mutex_unlock(&con->mutex);
 
-    if (err == RT_ERROR_TIMEOUT)
-      return err;
+    err = rtConnection_ReadFrame(con, &hdr, deadline);
 
-    if (err == RT_OK)
-    {
-      itr = &con->recv_buffer[2];
-      rtEncoder_DecodeUInt16(&itr, &hdr.header_length);
-      err = rtConnection_ReadUntil(con, con->recv_buffer + 4, (hdr.header_length-4), timeout);
-    }
+    // a frame too large to take was dropped, that's all for this call
+    if (err == rtErrorFromErrno(EMSGSIZE))
+      break;
 
-    if (err == RT_OK)
+    if (err == RT_ERROR_TIMEOUT)
     {
-      #if 0
-      int i;
-      for (i = 0; i < hdr.header_length; ++i)
-      {
-        if (i %16 == 0)
-          printf("\n");
-        printf("0x%02x ", con->recv_buffer[i]);
-      }
-      printf("\n\n\n");
-      #endif
-      err = rtMessageHeader_Decode(&hdr, con->recv_buffer);
+      rtConnection_ShrinkBuffer(con);
+      pthread_mutex_unlock(&con->dispatch_mutex);
+      rtConnection_ExpirePendingRequests(con);
+      return err;
     }
 
-    if (err == RT_OK)
+    // a sender may already have reconnected, either way the frame is read
+    // again from the new connection
+    if (err != RT_OK && rtConnection_ShouldReregister(err) && !rtConnection_IsClosing(con))
     {
-      err = rtConnection_ReadUntil(con, con->recv_buffer + hdr.header_length, hdr.payload_length, timeout);
-      if (err == RT_OK)
+      pthread_mutex_lock(&con->mutex);
+      reconnected = generation != con->generation;
+      pthread_mutex_unlock(&con->mutex);
+      if (!reconnected)
       {
-        // help out json parsers and other string parses
-        con->recv_buffer[hdr.header_length + hdr.payload_length] = '\0';
+        err = rtConnection_Reestablish(con);
+        if (err == RT_OK)
+          err = RT_FAIL;
       }
     }
-
-    if (err != RT_OK && rtConnection_ShouldReregister(err))
-    {
-      err = rtConnection_EnsureRoutingDaemon();
-      if (err == RT_OK)
-        err = rtConnection_ConnectAndRegister(con);
-    }
   }
-  while ((err != RT_OK) && (num_attempts++ < max_attempts));
+  while ((err != RT_OK) && !rtConnection_IsClosing(con) && (num_attempts++ < max_attempts));
 
-  if (err == RT_OK)
+  // only the first frame is waited for, the rest were read along with it
+  while (err == RT_OK && num_messages < max_messages)
   {
-    for (i = 0; i < RTMSG_LISTENERS_MAX; ++i)
-    {
-      if(strstr(hdr.reply_topic,"NO.ROUTE.RESPONSE")) {
-        con->listeners[i].subscription_id = 0;
-      }
-      if (con->listeners[i].in_use && (con->listeners[i].subscription_id == hdr.control_data))
-      {
-        rtLog_Debug("found subscription match:%d", i);
-        break;
-      }
-    }
+    rtConnection_DispatchFrame(con, &hdr);
+    num_messages++;
 
-    if (i < RTMSG_LISTENERS_MAX)
-    {
-      con->listeners[i].callback(&hdr, con->recv_buffer + hdr.header_length, hdr.payload_length,
-        con->listeners[i].closure);
-    }
+    rtMessageHeader_Init(&hdr);
+    if (rtConnection_PeekFrame(con, &hdr, &needed) != RT_OK || needed > 0)
+      break;
   }
 
-  return RT_OK;
+  if (con->dispatch_depth == 0)
+  {
+    while (rtVector_Size(con->retired_buffers) > 0)
+      rtVector_RemoveItem(con->retired_buffers, rtVector_At(con->retired_buffers, 0), free);
+  }
+
+  rtConnection_ShrinkBuffer(con);
+
+  pthread_mutex_unlock(&con->dispatch_mutex);
+
+  rtConnection_ExpirePendingRequests(con);
+
+  // the connection is fine after dropping a frame, that's been logged and
+  // reported to a request waiting for it
+  return err == rtErrorFromErrno(EMSGSIZE) ? RT_OK : err;
 }
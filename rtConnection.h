@@ -25,7 +25,10 @@
 #include "rtMessage.h"
 #include "rtMessageHeader.h"
 
+#include <sys/uio.h>
+
 #define RTMSG_DEFAULT_ROUTER_LOCATION "tcp://127.0.0.1:10001"
+#define RTMSG_ROUTER_PID_FILE "/tmp/rtrouted.pid"
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,15 +40,24 @@ typedef struct _rtConnection* rtConnection;
 typedef void (*rtMessageCallback)(rtMessageHeader const* hdr, uint8_t const* buff,
   uint32_t n, void* closure);
 
+/**
+ * Receives the response to an asynchronous request. res is NULL when err
+ * isn't RT_OK and is released after the callback returns, use
+ * rtMessage_Retain to keep it.
+ */
+typedef void (*rtResponseCallback)(rtError err, rtMessage const res, void* closure);
+
 typedef enum
 {
   rtConnectionState_ReadHeaderPreamble,
   rtConnectionState_ReadHeader,
-  rtConnectionState_ReadPayload
+  rtConnectionState_ReadPayload,
+  rtConnectionState_DiscardPayload
 } rtConnectionState;
 
 /**
- * Creates an rtConnection
+ * Creates an rtConnection. With the RTMSG_SHARED_CONNECTION environment
+ * variable set the connection is created with "shared".
  * @param con
  * @param application_name
  * @param router_config
@@ -54,6 +66,26 @@ typedef enum
 rtError
 rtConnection_Create(rtConnection* con, char const* application_name, char const* router_config);
 
+/**
+ * Creates an rtConnection from a config message. A connection may be shared
+ * between threads. The keys are:
+ * "appname" and "uri", as for rtConnection_Create.
+ * "start_router", 1 to start rtrouted if it isn't running.
+ * "reader_thread", 1 to invoke callbacks on a thread of the connection's own.
+ * "max_message_size", the largest message received, 8 MB by default.
+ * "local_delivery", 1 to invoke listeners in the process from the sender.
+ * "shared", 1 for a handle on the process's one connection to "uri".
+ * A larger message is dropped, a request waiting for it fails with EMSGSIZE.
+ * Local delivery only reaches connections that set it too, and a declared
+ * topic then only goes to the router when another process subscribes.
+ * Requests, responses and group, filtered and conflated listeners always go
+ * through the router. See rtConnection_InternTopic for the router needed.
+ * A shared handle's callbacks are invoked on the shared reader thread, and
+ * destroying it removes its listeners and cancels its asynchronous requests.
+ * @param con
+ * @param conf
+ * @return error
+ */
 rtError
 rtConnection_CreateWithConfig(rtConnection* con, rtMessage const conf);
 
@@ -83,6 +115,19 @@ rtConnection_SendErrorMessageToCaller(int clnt_fd , rtMessageHeader const* reque
 rtError
 rtConnection_SendMessage(rtConnection con, rtMessage msg, char const* topic);
 
+/**
+ * Sends a message in a priority lane. The router delivers higher lanes first
+ * when a subscriber falls behind.
+ * @param con
+ * @param msg
+ * @param topic
+ * @param priority
+ * @return error
+ */
+rtError
+rtConnection_SendMessageWithPriority(rtConnection con, rtMessage msg, char const* topic,
+  rtMessagePriority priority);
+
 /**
  * Sends a binary payload
  * @param con
@@ -94,6 +139,18 @@ rtConnection_SendMessage(rtConnection con, rtMessage msg, char const* topic);
 rtError
 rtConnection_SendBinary(rtConnection con, char const* topic, uint8_t const* p, uint32_t n);
 
+/**
+ * Sends a binary payload gathered from several buffers, without copying
+ * them together first. The frame is written with a single system call.
+ * @param con
+ * @param topic
+ * @param iov buffers making up the payload, in order
+ * @param n number of buffers, at most 64
+ * @return error
+ */
+rtError
+rtConnection_SendIov(rtConnection con, char const* topic, struct iovec const* iov, int n);
+
 /**
  * Sends a request and receive a response
  * @param con
@@ -107,10 +164,71 @@ rtError
 rtConnection_SendRequest(rtConnection con, rtMessage const req, char const* topic,
   rtMessage* res, int32_t timeout);
 
+/**
+ * Sends a request in a priority lane and receive a response. The response
+ * is sent back in the same lane.
+ * @param con
+ * @param req
+ * @param topic
+ * @param response
+ * @param timeout
+ * @param priority
+ * @return error
+ */
+rtError
+rtConnection_SendRequestWithPriority(rtConnection con, rtMessage const req, char const* topic,
+  rtMessage* res, int32_t timeout, rtMessagePriority priority);
+
+/**
+ * Sends a request and returns without waiting for the response. The callback
+ * is invoked from dispatch with the response, with RT_ERROR_TIMEOUT when none
+ * arrives within the timeout, or when the connection is destroyed. Many
+ * requests may be in flight at once, responses are matched to requests by
+ * sequence number. A callback is never invoked for a request that failed to
+ * send, the error is returned instead.
+ * @param con
+ * @param req
+ * @param topic
+ * @param timeout
+ * @param callback
+ * @param closure
+ * @return error
+ */
+rtError
+rtConnection_SendRequestAsync(rtConnection con, rtMessage const req, char const* topic,
+  int32_t timeout, rtResponseCallback callback, void* closure);
+
 rtError
 rtConnection_SendResponse(rtConnection con, rtMessageHeader const* request_hdr, rtMessage const res,
   int32_t timeout);
 
+/**
+ * Registers a topic with the router. Messages sent on the topic afterwards
+ * carry a compact id instead of the topic string. Ids are forgotten when the
+ * connection to the router is re-established, sends fall back to the topic
+ * string until the topic is registered again. Interning and "local_delivery"
+ * need an rtrouted that supports them, an older router never replies here
+ * and delivers locally delivered messages a second time.
+ * @param con
+ * @param topic
+ * @return error
+ */
+rtError
+rtConnection_InternTopic(rtConnection con, char const* topic);
+
+/**
+ * Declares a topic this connection publishes on. The router tells the
+ * connection whether anyone subscribes to it, and rtConnection_SendMessage
+ * and rtConnection_SendBinary on the topic return right away without
+ * serializing or sending anything while nobody does. Interest updates are
+ * read on dispatch, a connection that never dispatches keeps sending.
+ * @param con
+ * @param topic
+ * @return error
+ */
+rtError
+rtConnection_DeclareTopic(rtConnection con, char const* topic);
+
 /**
  * Register a callback for message receipt
  * @param con
@@ -123,6 +241,55 @@ rtError
 rtConnection_AddListener(rtConnection con, char const* expression,
   rtMessageCallback callback, void* closure);
 
+/**
+ * Register a callback as a member of a queue group. The router delivers each
+ * message matching the expression to only one member of the group.
+ * @param con
+ * @param topic expression
+ * @param group name
+ * @param callback handler
+ * @param closure
+ * @return error
+ */
+rtError
+rtConnection_AddGroupListener(rtConnection con, char const* expression, char const* group,
+  rtMessageCallback callback, void* closure);
+
+/**
+ * Register a callback for messages whose payload also passes a filter. The
+ * router evaluates the filter, messages that fail it are never sent. Each
+ * field of the filter names a top-level field of the payload, which must be
+ * equal to the filter's string, number, boolean or null value, or lie within
+ * the "min" and "max" of a nested message. All fields must match. A filter
+ * with more than 8 fields, or any other kind of value, is refused.
+ * e.g. {"status":"up","rssi":{"min":-70}}
+ * @param con
+ * @param topic expression
+ * @param filter
+ * @param callback handler
+ * @param closure
+ * @return error
+ */
+rtError
+rtConnection_AddFilteredListener(rtConnection con, char const* expression, rtMessage filter,
+  rtMessageCallback callback, void* closure);
+
+/**
+ * Register a callback that receives at most max_rate messages per second for
+ * each topic matching the expression. The router keeps only the latest
+ * message of a topic that arrives too soon and sends it when the topic's
+ * interval is up, older ones are dropped.
+ * @param con
+ * @param topic expression
+ * @param max_rate messages per second, per topic
+ * @param callback handler
+ * @param closure
+ * @return error
+ */
+rtError
+rtConnection_AddConflatedListener(rtConnection con, char const* expression, uint32_t max_rate,
+  rtMessageCallback callback, void* closure);
+
 /**
  * Dispatch incoming messages
  * @param con
@@ -132,7 +299,8 @@ rtError
 rtConnection_Dispatch(rtConnection con);
 
 /**
- * Dispatch with a timeout
+ * Dispatch with a timeout. Waits up to the timeout for a message, then also
+ * dispatches every other message that has already been received.
  * @param con
  * @param timeout
  * return error
@@ -140,6 +308,50 @@ rtConnection_Dispatch(rtConnection con);
 rtError
 rtConnection_TimedDispatch(rtConnection con, int32_t timeout);
 
+/**
+ * Dispatch with a timeout, stopping after max_messages. Waits up to the
+ * timeout for the first message, the rest are messages that have already
+ * been received along with it.
+ * @param con
+ * @param max_messages
+ * @param timeout
+ * @return error
+ */
+rtError
+rtConnection_DispatchBatch(rtConnection con, int32_t max_messages, int32_t timeout);
+
+/**
+ * Gets the socket to watch for readability from an application's own event
+ * loop. The socket changes when the connection to the router is
+ * re-established, get it again after each rtConnection_ProcessReadable.
+ * @param con
+ * @return file descriptor, -1 for a shared handle or while not connected
+ */
+int
+rtConnection_GetFd(rtConnection con);
+
+/**
+ * Dispatches every complete message waiting on the socket without blocking.
+ * Call it when the socket from rtConnection_GetFd is readable, or when the
+ * timeout from rtConnection_GetNextTimeout is up. Not for connections with
+ * a reader thread or shared handles. A lost connection is re-established
+ * with a single attempt, when that fails the error is returned and the
+ * connection has no socket until the next attempt.
+ * @param con
+ * @return error
+ */
+rtError
+rtConnection_ProcessReadable(rtConnection con);
+
+/**
+ * Gets the time until the earliest asynchronous request times out, or until
+ * the next attempt to reconnect, to use as an event loop's poll timeout.
+ * @param con
+ * @return milliseconds, or -1 when there's nothing to wait for
+ */
+int32_t
+rtConnection_GetNextTimeout(rtConnection con);
+
 #ifdef __cplusplus
 }
 #endif
@@ -89,3 +89,85 @@ rtMessageHeader_IsRequest(rtMessageHeader const* hdr)
 {
   return ((hdr->flags & rtMessageFlags_Request) == rtMessageFlags_Request ? 1 : 0);
 }
+
+rtError
+rtMessageHeader_SetPriority(rtMessageHeader* hdr, rtMessagePriority priority)
+{
+  if (priority < rtMessagePriority_Normal || priority >= RTMSG_PRIORITY_LANES)
+    return RT_ERROR_INVALID_ARG;
+  hdr->flags &= ~rtMessageFlags_PriorityMask;
+  hdr->flags |= ((uint32_t) priority << RTMSG_PRIORITY_SHIFT);
+  return RT_OK;
+}
+
+rtMessagePriority
+rtMessageHeader_GetPriority(rtMessageHeader const* hdr)
+{
+  uint32_t priority = (hdr->flags & rtMessageFlags_PriorityMask) >> RTMSG_PRIORITY_SHIFT;
+  if (priority >= RTMSG_PRIORITY_LANES)
+    priority = RTMSG_PRIORITY_LANES - 1;
+  return (rtMessagePriority) priority;
+}
+
+/**
+ * Appends the ids of further subscriptions to a header already written to
+ * buff by rtMessageHeader_Encode, growing header_length to cover them.
+ */
+rtError
+rtMessageHeader_EncodeSubscriptions(rtMessageHeader* hdr, uint8_t* buff, uint32_t const* ids,
+  uint32_t count)
+{
+  uint32_t i;
+  uint8_t* ptr;
+
+  if (count == 0)
+    return RT_OK;
+  if (count > RTMSG_HEADER_MAX_SUBSCRIPTIONS)
+    return RT_ERROR_INVALID_ARG;
+
+  ptr = buff + hdr->header_length;
+  rtEncoder_EncodeUInt32(&ptr, count);
+  for (i = 0; i < count; ++i)
+    rtEncoder_EncodeUInt32(&ptr, ids[i]);
+
+  hdr->header_length += 4 + (4 * count);
+  hdr->flags |= rtMessageFlags_MultipleSubscriptions;
+
+  ptr = buff + 2;
+  rtEncoder_EncodeUInt16(&ptr, hdr->header_length);
+  ptr = buff + 8;
+  rtEncoder_EncodeInt32(&ptr, hdr->flags);
+  return RT_OK;
+}
+
+/**
+ * Reads the ids appended by rtMessageHeader_EncodeSubscriptions.
+ * @return number of ids copied to ids, at most max
+ */
+uint32_t
+rtMessageHeader_DecodeSubscriptions(rtMessageHeader const* hdr, uint8_t const* buff, uint32_t* ids,
+  uint32_t max)
+{
+  uint32_t i;
+  uint32_t count;
+  uint32_t offset;
+  uint8_t const* ptr;
+
+  if (!(hdr->flags & rtMessageFlags_MultipleSubscriptions))
+    return 0;
+
+  offset = 28 + hdr->topic_length + hdr->reply_topic_length;
+  if (offset + 4 > hdr->header_length)
+    return 0;
+
+  ptr = buff + offset;
+  rtEncoder_DecodeUInt32(&ptr, &count);
+  if (count > max)
+    count = max;
+  if (offset + 4 + (4 * count) > hdr->header_length)
+    count = (hdr->header_length - offset - 4) / 4;
+
+  for (i = 0; i < count; ++i)
+    rtEncoder_DecodeUInt32(&ptr, &ids[i]);
+  return count;
+}
@@ -34,12 +34,34 @@
 extern "C" {
 #endif
 
+// with InternedTopic set the topic string is empty and control_data holds
+// the id the router handed out for the topic. MultipleSubscriptions means
+// the ids of further subscriptions the frame is delivered for follow the
+// reply topic, readers that don't know the flag skip them since the payload
+// starts at header_length
 typedef enum
 {
   rtMessageFlags_Request = 0x01,
-  rtMessageFlags_Response = 0x02
+  rtMessageFlags_Response = 0x02,
+  rtMessageFlags_InternedTopic = 0x04,
+  rtMessageFlags_MultipleSubscriptions = 0x08,
+  rtMessageFlags_PriorityMask = 0x0300
 } rtMessageFlags;
 
+#define RTMSG_HEADER_MAX_SUBSCRIPTIONS 16
+
+#define RTMSG_PRIORITY_SHIFT 8
+#define RTMSG_PRIORITY_LANES 3
+
+// the priority travels in the flags field so routers and clients that
+// don't know about it forward it unchanged and treat it as normal
+typedef enum
+{
+  rtMessagePriority_Normal = 0,
+  rtMessagePriority_High = 1,
+  rtMessagePriority_Urgent = 2
+} rtMessagePriority;
+
 typedef struct
 {
   uint16_t version;
@@ -59,6 +81,12 @@ rtError rtMessageHeader_Encode(rtMessageHeader* hdr, uint8_t* buff);
 rtError rtMessageHeader_Decode(rtMessageHeader* hdr, uint8_t const* buff);
 rtError rtMessageHeader_SetIsRequest(rtMessageHeader* hdr);
 int     rtMessageHeader_IsRequest(rtMessageHeader const* hdr);
+rtError rtMessageHeader_SetPriority(rtMessageHeader* hdr, rtMessagePriority priority);
+rtMessagePriority rtMessageHeader_GetPriority(rtMessageHeader const* hdr);
+rtError rtMessageHeader_EncodeSubscriptions(rtMessageHeader* hdr, uint8_t* buff, uint32_t const* ids,
+  uint32_t count);
+uint32_t rtMessageHeader_DecodeSubscriptions(rtMessageHeader const* hdr, uint8_t const* buff, uint32_t* ids,
+  uint32_t max);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,358 @@
+/*
+##########################################################################
+# If not stated otherwise in this file or this component's LICENSE
+# file the following copyright and licenses apply:
+#
+# Copyright 2019 RDK Management
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+##########################################################################
+*/
+#include "rtCapture.h"
+#include "rtConnection.h"
+#include "rtEncoder.h"
+#include "rtError.h"
+#include "rtLog.h"
+#include "rtMessageHeader.h"
+#include "rtSocket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+void
+printUsage()
+{
+  printf("\n");
+  printf("Usage: rtreplay [OPTIONS] <capture file>\n");
+  printf("\t-b\t--broker <uri>     URI for broker (default %s)\n", RTMSG_DEFAULT_ROUTER_LOCATION);
+  printf("\t-r\t--rate <factor>    Replay at factor times the original rate (default 1.0)\n");
+  printf("\t-m\t--max-rate         Replay as fast as possible\n");
+  printf("\t-c\t--include-control  Also replay _RTROUTED control messages\n");
+  printf("\n");
+}
+
+static uint64_t
+getTimeNanos(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void
+drainSocket(int fd)
+{
+  uint8_t buff[4096];
+
+  // the router sends back no-route errors for replayed requests, nobody reads
+  // them so throw them away before they fill up the socket
+  while (recv(fd, buff, sizeof(buff), MSG_DONTWAIT) > 0)
+  {
+  }
+}
+
+/**
+ * Checks that a captured frame holds the fixed header fields and both topics,
+ * each short enough for rtMessageHeader, before it's decoded.
+ */
+static int
+isValidFrame(uint8_t const* p, uint32_t n)
+{
+  uint16_t header_length;
+  uint32_t topic_length;
+  uint32_t reply_topic_length;
+  uint8_t const* itr;
+
+  if (n < 28)
+    return 0;
+
+  itr = p + 2;
+  rtEncoder_DecodeUInt16(&itr, &header_length);
+
+  itr = p + 20;
+  rtEncoder_DecodeUInt32(&itr, &topic_length);
+  if (topic_length >= RTMSG_HEADER_MAX_TOPIC_LENGTH || 28 + topic_length > n)
+    return 0;
+
+  itr += topic_length;
+  rtEncoder_DecodeUInt32(&itr, &reply_topic_length);
+  if (reply_topic_length >= RTMSG_HEADER_MAX_TOPIC_LENGTH || 28 + topic_length + reply_topic_length > n)
+    return 0;
+
+  return header_length >= 28 + topic_length + reply_topic_length && header_length <= n;
+}
+
+static rtError
+sendFrame(int fd, uint8_t const* p, uint32_t n)
+{
+  uint32_t bytes_sent = 0;
+
+  while (bytes_sent < n)
+  {
+    ssize_t ret = send(fd, p + bytes_sent, n - bytes_sent, MSG_NOSIGNAL);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return rtErrorFromErrno(errno);
+    }
+    bytes_sent += ret;
+  }
+  return RT_OK;
+}
+
+static int
+connectToRouter(char const* uri)
+{
+  int fd;
+  int one;
+  rtError err;
+  socklen_t socket_length;
+  struct sockaddr_storage endpoint;
+
+  memset(&endpoint, 0, sizeof(endpoint));
+  err = rtSocketStorage_FromString(&endpoint, uri);
+  if (err != RT_OK)
+  {
+    rtLog_Error("failed to parse:%s. %s", uri, rtStrError(err));
+    return -1;
+  }
+
+  fd = socket(endpoint.ss_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  one = 1;
+  if (endpoint.ss_family != AF_UNIX)
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  rtSocketStorage_GetLength(&endpoint, &socket_length);
+  if (connect(fd, (struct sockaddr *) &endpoint, socket_length) == -1)
+  {
+    rtLog_Error("failed to connect to %s. %s", uri, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int main(int argc, char* argv[])
+{
+  int           fd;
+  int           file;
+  int           max_rate;
+  int           include_control;
+  int           optionIndex;
+  double        rate;
+  char const*   uri;
+  char const*   fname;
+  uint8_t*      base;
+  uint8_t const* itr;
+  uint8_t const* end;
+  struct stat   st;
+  uint64_t      first_frame;
+  uint64_t      start;
+  uint64_t      elapsed;
+  uint32_t      version;
+  uint64_t      num_frames;
+  uint64_t      num_bytes;
+  rtError       err;
+
+  uri = RTMSG_DEFAULT_ROUTER_LOCATION;
+  rate = 1.0;
+  max_rate = 0;
+  include_control = 0;
+  optionIndex = 0;
+  first_frame = 0;
+  num_frames = 0;
+  num_bytes = 0;
+  err = RT_OK;
+
+  rtLog_SetLevel(RT_LOG_INFO);
+
+  while (1)
+  {
+    static struct option longOptions[] =
+    {
+      { "broker",           required_argument, 0, 'b' },
+      { "rate",             required_argument, 0, 'r' },
+      { "max-rate",         no_argument,       0, 'm' },
+      { "include-control",  no_argument,       0, 'c' },
+      { 0, 0, 0, 0 }
+    };
+
+    int c = getopt_long(argc, argv, "b:r:mc", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'b':
+      uri = optarg;
+      break;
+
+      case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+
+      case 'm':
+      max_rate = 1;
+      break;
+
+      case 'c':
+      include_control = 1;
+      break;
+
+      case '?':
+      break;
+
+      default:
+        break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printf("missing capture file\n");
+    printUsage();
+    exit(1);
+  }
+
+  if (rate <= 0.0)
+  {
+    printf("invalid rate\n");
+    printUsage();
+    exit(2);
+  }
+
+  fname = argv[optind];
+  file = open(fname, O_RDONLY);
+  if (file == -1 || fstat(file, &st) == -1)
+  {
+    rtLog_Error("failed to open %s. %s", fname, strerror(errno));
+    exit(3);
+  }
+
+  if (st.st_size < RTCAPTURE_FILE_HEADER_LENGTH)
+  {
+    rtLog_Error("%s is not a capture file", fname);
+    exit(3);
+  }
+
+  base = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  if (base == MAP_FAILED)
+  {
+    rtLog_Error("failed to map %s. %s", fname, strerror(errno));
+    exit(3);
+  }
+
+  itr = base + RTCAPTURE_MAGIC_LENGTH;
+  rtEncoder_DecodeUInt32(&itr, &version);
+  if (memcmp(base, RTCAPTURE_MAGIC, RTCAPTURE_MAGIC_LENGTH) != 0 || version != RTCAPTURE_VERSION)
+  {
+    rtLog_Error("%s is not a version %d capture file", fname, RTCAPTURE_VERSION);
+    exit(3);
+  }
+
+  fd = connectToRouter(uri);
+  if (fd == -1)
+    exit(4);
+
+  end = base + st.st_size;
+  start = getTimeNanos(CLOCK_MONOTONIC);
+
+  while (itr + RTCAPTURE_RECORD_HEADER_LENGTH <= end)
+  {
+    uint32_t sec;
+    uint32_t nsec;
+    uint32_t length;
+    uint64_t timestamp;
+
+    rtEncoder_DecodeUInt32(&itr, &sec);
+    rtEncoder_DecodeUInt32(&itr, &nsec);
+    rtEncoder_DecodeUInt32(&itr, &length);
+
+    if (length == 0 || itr + length > end)
+      break;
+
+    if (!isValidFrame(itr, length))
+    {
+      rtLog_Warn("skipping malformed frame at offset %ld", (long) (itr - base));
+      itr += length;
+      continue;
+    }
+
+    if (!include_control)
+    {
+      rtMessageHeader hdr;
+      rtMessageHeader_Init(&hdr);
+      if (rtMessageHeader_Decode(&hdr, itr) != RT_OK || strncmp(hdr.topic, "_RTROUTED.", 10) == 0)
+      {
+        itr += length;
+        continue;
+      }
+    }
+
+    timestamp = ((uint64_t) sec * 1000000000) + nsec;
+    if (num_frames == 0)
+      first_frame = timestamp;
+
+    if (!max_rate)
+    {
+      uint64_t due = start + (uint64_t) ((timestamp - first_frame) / rate);
+      uint64_t now = getTimeNanos(CLOCK_MONOTONIC);
+      if (due > now)
+      {
+        struct timespec ts;
+        ts.tv_sec = (due - now) / 1000000000;
+        ts.tv_nsec = (due - now) % 1000000000;
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    err = sendFrame(fd, itr, length);
+    if (err != RT_OK)
+    {
+      rtLog_Error("failed to send frame. %s", rtStrError(err));
+      break;
+    }
+
+    drainSocket(fd);
+
+    itr += length;
+    num_frames++;
+    num_bytes += length;
+  }
+
+  elapsed = getTimeNanos(CLOCK_MONOTONIC) - start;
+  rtLog_Info("replayed %llu frames, %llu bytes in %.3f seconds (%.0f frames/sec)",
+    (unsigned long long) num_frames, (unsigned long long) num_bytes, elapsed / 1e9,
+    elapsed > 0 ? num_frames / (elapsed / 1e9) : 0.0);
+
+  munmap(base, st.st_size);
+  close(file);
+  close(fd);
+
+  return err == RT_OK ? 0 : 5;
+}
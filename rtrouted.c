@@ -27,10 +27,13 @@
 #include "rtSocket.h"
 #include "rtVector.h"
 #include "rtConnection.h"
+#include "rtCapture.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdint.h>
@@ -41,7 +44,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 
 #include <cJSON.h>
 
@@ -49,12 +56,102 @@
 #include "breakpadwrap.h"
 #endif
 
+#ifdef RTROUTED_USE_IO_URING
+#include <liburing.h>
+#include <poll.h>
+#endif
+
 #define RTMSG_MAX_CONNECTED_CLIENTS 64
 #define RTMSG_CLIENT_MAX_TOPICS 64
 #define RTMSG_CLIENT_READ_BUFFER_SIZE (1024 * 8)
+#define RTMSG_MAX_MESSAGE_SIZE (1024 * 1024 * 8)
 #define RTMSG_INVALID_FD -1
 #define RTMSG_MAX_EXPRESSION_LEN 128
 #define RTMSG_ADDR_MAX 128
+#define RTMSG_RETAINED_DEFAULT_MAX_BYTES (1024 * 256)
+#define RTMSG_COALESCE_DEFAULT_TIMEOUT 5000
+#define RTMSG_COALESCE_TOPIC_PREFIX "_RTROUTED.COALESCE."
+#define RTMSG_MAX_GROUPS_PER_MESSAGE 16
+#define RTMSG_MAX_CLIENTS_PER_MESSAGE 64
+#define RTMSG_CLIENT_MAX_OUTBOUND_BYTES (1024 * 1024 * 4)
+#define RTMSG_FLUSH_MAX_BYTES (1024 * 64)
+#define RTMSG_FLUSH_MAX_IOV 64
+#define RTMSG_FLUSH_DEADLINE 2
+#define RTMSG_FLUSH_COPY_MAX_BYTES 1024
+#define RTMSG_MAX_FRAMES_PER_READ 64
+#define RTMSG_MAX_INTERNED_TOPICS 4096
+#define RTMSG_MAX_DECLARED_TOPICS 256
+#define RTMSG_MAX_FILTER_CONDITIONS 8
+#define RTMSG_MAX_FILTER_LEN 1024
+#define RTMSG_MAX_FILTER_FIELD_LEN 64
+#define RTMSG_MAX_FILTER_VALUE_LEN 128
+#define RTMSG_MAX_CONFLATED_TOPICS 256
+#define RTMSG_INTEREST_TOPIC "_RTROUTED.INTEREST"
+#define RTMSG_HANDOFF_SOCKET "/tmp/rtrouted.handoff"
+#define RTMSG_HANDOFF_MAGIC 0x7274686f
+#define RTMSG_HANDOFF_VERSION 8
+#define RTMSG_HANDOFF_MAX_FDS_PER_MESSAGE 64
+#define RTMSG_HANDOFF_TIMEOUT 5
+#define RTMSG_PID_LOCK_ATTEMPTS 20
+#define RTMSG_PID_LOCK_INTERVAL 5
+#define RTMSG_URING_ENTRIES 512
+#define RTMSG_URING_BUFFER_COUNT 256
+#define RTMSG_URING_BUFFER_SIZE (1024 * 16)
+#define RTMSG_URING_BUFFER_GROUP 0
+
+typedef struct _rtOutboundFrame
+{
+  struct _rtOutboundFrame*  next;
+  uint32_t                  length;
+  uint32_t                  offset;
+  uint8_t*                  data;
+} rtOutboundFrame;
+
+typedef struct
+{
+  rtOutboundFrame*          head;
+  rtOutboundFrame*          tail;
+} rtOutboundQueue;
+
+typedef enum
+{
+  rtRateLimitAction_None,
+  rtRateLimitAction_Drop,
+  rtRateLimitAction_Delay,
+  rtRateLimitAction_Disconnect
+} rtRateLimitAction;
+
+typedef struct
+{
+  char                      expression[RTMSG_MAX_EXPRESSION_LEN];
+  double                    rate;
+  double                    burst;
+  rtRateLimitAction         action;
+} rtRateLimit;
+
+typedef struct
+{
+  double                    tokens;
+  uint64_t                  last_refill;
+} rtTokenBucket;
+
+typedef struct
+{
+  char                      topic[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+  int                       interest;
+} rtDeclaredTopic;
+
+typedef struct
+{
+  uint64_t                  messages_received;
+  uint64_t                  rate_limit_dropped;
+  uint64_t                  rate_limit_delayed;
+  uint64_t                  rate_limit_disconnects;
+  uint64_t                  backlog_dropped;
+  uint64_t                  conflated;
+  uint64_t                  frames_sent;
+  uint64_t                  write_calls;
+} rtRouterStats;
 
 typedef struct
 {
@@ -62,17 +159,85 @@ typedef struct
   struct sockaddr_storage   endpoint;
   char                      ident[RTMSG_ADDR_MAX];
   uint8_t*                  read_buffer;
+  int                       read_buffer_size;
   uint8_t*                  send_buffer;
   rtConnectionState         state;
   int                       bytes_read;
   int                       bytes_to_read;
+  int                       outstanding_requests;
   rtMessageHeader           header;
+  rtOutboundQueue           outbound[RTMSG_PRIORITY_LANES];
+  rtOutboundFrame*          partial_frame;
+  size_t                    outbound_bytes;
+  uint8_t*                  pending_input;
+  size_t                    pending_input_length;
+  int                       dirty;
+  rtTokenBucket*            buckets;
+  uint64_t                  resume_time;
+  uint64_t                  rate_limited;
+  uint32_t                  topic_id;
+  int                       multiple_subscriptions;
+  rtVector                  declared_topics;
+  char                      interest_inbox[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+  char                      process[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+#ifdef RTROUTED_USE_IO_URING
+  int                       closing;
+  int                       ops_inflight;
+  int                       recv_armed;
+  int                       recv_cancelled;
+  int                       send_inflight;
+  int                       send_count;
+  struct msghdr             send_msg;
+  struct iovec              send_iov[RTMSG_FLUSH_MAX_IOV];
+  rtOutboundFrame*          send_frames[RTMSG_FLUSH_MAX_IOV];
+  int                       send_lanes[RTMSG_FLUSH_MAX_IOV];
+#endif
 } rtConnectedClient;
 
+struct _rtQueueGroup;
+
+typedef enum
+{
+  rtFilterOp_EqualString,
+  rtFilterOp_EqualNumber,
+  rtFilterOp_EqualLiteral,
+  rtFilterOp_Range
+} rtFilterOp;
+
+typedef struct
+{
+  char        field[RTMSG_MAX_FILTER_FIELD_LEN];
+  rtFilterOp  op;
+  char        value[RTMSG_MAX_FILTER_VALUE_LEN];
+  double      min;
+  double      max;
+} rtFilterCondition;
+
+typedef struct
+{
+  char*             text;
+  uint32_t          num_conditions;
+  rtFilterCondition conditions[RTMSG_MAX_FILTER_CONDITIONS];
+} rtFilter;
+
+typedef struct
+{
+  rtMessageHeader header;
+  uint8_t*        payload;
+  uint64_t        last_sent;
+  int             pending;
+} rtConflatedSlot;
+
 typedef struct
 {
   uint32_t id;
   rtConnectedClient* client;
+  struct _rtQueueGroup* group;
+  rtFilter* filter;
+  uint32_t max_rate;
+  uint32_t interval;
+  rtVector slots;
+  int local;
 } rtSubscription;
 
 typedef rtError (*rtRouteMessageHandler)(rtConnectedClient* sender, rtMessageHeader* hdr,
@@ -85,21 +250,130 @@ typedef struct
   char                  expression[RTMSG_MAX_EXPRESSION_LEN];
 } rtRouteEntry;
 
+typedef struct
+{
+  rtConnectedClient*    client;
+  uint32_t              num_ids;
+  uint32_t              ids[RTMSG_HEADER_MAX_SUBSCRIPTIONS + 1];
+} rtClientDelivery;
+
+typedef enum
+{
+  rtQueueGroupPolicy_RoundRobin,
+  rtQueueGroupPolicy_LeastOutstanding
+} rtQueueGroupPolicy;
+
+typedef struct _rtQueueGroup
+{
+  char                  name[RTMSG_MAX_EXPRESSION_LEN];
+  char                  expression[RTMSG_MAX_EXPRESSION_LEN];
+  rtVector              members;
+  uint32_t              next_member;
+} rtQueueGroup;
+
 typedef struct
 {
   int fd;
   struct sockaddr_storage local_endpoint;
 } rtListener;
 
+typedef struct
+{
+  int       fd;
+  uint8_t*  base;
+  size_t    mapped;
+  size_t    offset;
+} rtCapture;
+
+typedef struct
+{
+  rtMessageHeader header;
+  uint8_t*        payload;
+  uint64_t        last_update;
+} rtRetainedMessage;
+
+typedef struct
+{
+  char            reply_topic[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+  uint32_t        sequence_number;
+} rtCoalescedWaiter;
+
+typedef struct
+{
+  uint32_t        id;
+  char            topic[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+  uint8_t*        payload;
+  uint32_t        payload_length;
+  uint64_t        start_time;
+  rtVector        waiters;
+} rtCoalescedRequest;
+
+typedef struct
+{
+  uint8_t*  data;
+  size_t    length;
+  size_t    capacity;
+  size_t    offset;
+  int       failed;
+} rtHandoffBuffer;
+
 rtVector clients;
 rtVector listeners;
 rtVector routes;
+rtVector retained_topics;
+rtVector retained_messages;
+size_t   retained_bytes = 0;
+size_t   retained_max_bytes = RTMSG_RETAINED_DEFAULT_MAX_BYTES;
+uint64_t retained_clock = 0;
+rtVector coalesced_topics;
+rtVector coalesced_requests;
+uint32_t coalesce_timeout = RTMSG_COALESCE_DEFAULT_TIMEOUT;
+uint32_t coalesce_next_id = 1;
+uint32_t max_message_size = RTMSG_MAX_MESSAGE_SIZE;
+rtVector queue_groups;
+rtCapture* capture = NULL;
+rtQueueGroupPolicy queue_group_policy = rtQueueGroupPolicy_RoundRobin;
+int handoff_fd = RTMSG_INVALID_FD;
+rtVector rate_limits;
+rtVector interned_topics;
+rtVector conflated_subscriptions;
+int interest_changed = 0;
+rtRouterStats stats;
 //rtListener        listeners[RTMSG_MAX_LISTENERS];
 //rtRouteEntry      routes[RTMSG_MAX_ROUTES];
 
 static rtError
 rtRouted_BindListener(char const* socket_name, int no_delay);
 
+static void
+rtRouted_SendRetained(rtSubscription* subscription, char const* expression);
+
+static uint64_t
+rtRouted_GetTimeMillis();
+
+static void
+rtRouted_CompleteCoalescedRequest(rtConnectedClient* sender, rtMessageHeader* hdr,
+  uint8_t const* buff, int n);
+
+static int
+rtRouted_RouteMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff, int n);
+
+static int
+rtRouted_IsTopicMatch(char const* topic, char const* exp);
+
+static int
+rtRouted_IsRetainedTopic(char const* topic);
+
+#ifdef RTROUTED_USE_IO_URING
+static int uring_active = 0;
+
+static rtError
+rtRouted_UringQueueSend(rtConnectedClient* clnt);
+
+static void
+rtRouted_UringClose(rtConnectedClient* clnt);
+#endif
+
 static void
 rtRouted_PrintHelp()
 {
@@ -108,557 +382,4524 @@ rtRouted_PrintHelp()
   printf("\t-d, --no-delay            Enabled debugging\n");
   printf("\t-l, --log-level <level>   Change logging level\n");
   printf("\t-r, --debug-route         Add a catch all route that dumps messages to stdout\n");
+  printf("\t-w, --capture <file>      Write every received frame to a capture file for rtreplay\n");
   printf("\t-s, --socket              [tcp://ip:port unix:///path/to/domain_socket]\n");
+  printf("\t-t, --takeover            Take over sockets and state from the running rtrouted\n");
   printf("\t-h, --help                Print this help\n");
   exit(0);
 }
 
-static rtError
-rtRouted_AddRoute(rtRouteMessageHandler handler, char const* exp, rtSubscription* subscription)
-{
-  rtRouteEntry* route = (rtRouteEntry *) malloc(sizeof(rtRouteEntry));
-  route->subscription = subscription;
-  route->message_handler = handler;
-  strncpy(route->expression, exp, RTMSG_MAX_EXPRESSION_LEN);
-  rtVector_PushBack(routes, route);
-  rtLog_Debug("client [%s] added new route:%s", subscription->client->ident, exp);
-  return RT_OK;
-}
-
-static int
-rtRouted_FileExists(char const* s)
+static void
+rtFilter_Destroy(rtFilter* filter)
 {
-  int ret;
-  struct stat buf;
-
-  if (!s || strlen(s) == 0) return 0;
-
-  memset(&buf, 0, sizeof(buf));
-  ret = stat(s, &buf);
-
-  return ret == 0 ? 1 : 0;
+  if (!filter)
+    return;
+  free(filter->text);
+  free(filter);
 }
 
+/**
+ * Compiles a subscription filter. The filter is a json object whose keys name
+ * top-level fields of the payload. A string, number, true, false or null
+ * value must be equal to the field, an object with "min" and/or "max"
+ * bounds the field as a number, inclusive. All conditions must hold.
+ */
 static rtError
-rtRouted_ParseConfig(char const* fname)
+rtFilter_Create(rtFilter** filter, char const* text)
 {
-  int       i;
-  int       n;
-  char*     buff;
-  FILE*     fin;
-  cJSON*    json;
-  cJSON*    listeners;
+  cJSON* json;
+  cJSON* item;
+  rtFilter* f;
 
-  if (!fname || strlen(fname) == 0)
-  {
-    rtLog_Warn("cannot prase empty configuration file");
-    return RT_OK;
-  }
+  *filter = NULL;
+  if (strlen(text) >= RTMSG_MAX_FILTER_LEN)
+    return RT_ERROR_INVALID_ARG;
 
-  if (!rtRouted_FileExists(fname))
+  json = cJSON_Parse(text);
+  if (!json || json->type != cJSON_Object)
   {
-    rtLog_Error("configuration file %s doesn't exist", fname);
-    return RT_OK;
+    if (json)
+      cJSON_Delete(json);
+    return RT_ERROR_INVALID_ARG;
   }
 
-  n = 0;
-  buff = NULL;
-  fin = NULL;
-  json = NULL;
-
-  // take easy way out. this is used to store contents of configuration file
-  buff = (char *) malloc(8192);
-  buff[0] = '\0';
-
-
-  rtLog_Debug("parsing configuration from file %s", fname);
-
-  fin = fopen(fname, "r");
-  if (fin)
+  f = (rtFilter *) calloc(1, sizeof(rtFilter));
+  if (!f)
   {
-    char temp[256];
-    while (fgets(temp, sizeof(temp), fin))
-      strncat(buff, temp, strlen(temp));
-    fclose(fin);
+    cJSON_Delete(json);
+    return rtErrorFromErrno(ENOMEM);
   }
-  else
+
+  for (item = json->child; item; item = item->next)
   {
-    int err = errno;
-    rtLog_Error("failed to open configuration file %s. %s", fname, strerror(errno));
-    exit(1);
-  }
+    rtFilterCondition* cond;
 
-  json = cJSON_Parse(buff);
-  free(buff);
+    if (f->num_conditions >= RTMSG_MAX_FILTER_CONDITIONS ||
+        strlen(item->string) >= RTMSG_MAX_FILTER_FIELD_LEN)
+      break;
 
-  if (!json)
-  {
-    rtLog_Error("error parising configuration file");
+    cond = &f->conditions[f->num_conditions];
+    strcpy(cond->field, item->string);
 
-    char const* p = cJSON_GetErrorPtr();
-    if (p)
+    if (item->type == cJSON_String)
     {
-      char const* end = (buff + strlen(buff));
-      int n = (int) (end - p);
-      if (n > 64)
-        n = 64;
-      rtLog_Error("%.*s\n", n, p);
+      if (strlen(item->valuestring) >= RTMSG_MAX_FILTER_VALUE_LEN)
+        break;
+      cond->op = rtFilterOp_EqualString;
+      strcpy(cond->value, item->valuestring);
     }
-
-    exit(1);
-  }
-  else
-  {
-    listeners = cJSON_GetObjectItem(json, "listeners");
-    if (listeners)
+    else if (item->type == cJSON_Number)
     {
-      for (i = 0, n = cJSON_GetArraySize(listeners); i < n; ++i)
-      {
-        cJSON* item = cJSON_GetArrayItem(listeners, i);
-        if (item)
-        {
-          cJSON* uri = cJSON_GetObjectItem(item, "uri");
-          if (uri)
-            rtRouted_BindListener(uri->valuestring, 1);
-        }
-      }
+      cond->op = rtFilterOp_EqualNumber;
+      cond->min = cond->max = item->valuedouble;
     }
-    cJSON_Delete(json);
-  }
-}
-
-static rtError
-rtRouted_ClearClientRoutes(rtConnectedClient* clnt)
-{
-  size_t i;
-  for (i = 0; i < rtVector_Size(routes);)
-  {
-    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
-    if (route->subscription && route->subscription->client == clnt)
+    else if (item->type == cJSON_True || item->type == cJSON_False || item->type == cJSON_NULL)
     {
-      rtVector_RemoveItem(routes, route, NULL);
-      free(route->subscription);
-      free(route);
+      cond->op = rtFilterOp_EqualLiteral;
+      strcpy(cond->value, item->type == cJSON_True ? "true" : item->type == cJSON_False ? "false" : "null");
+    }
+    else if (item->type == cJSON_Object)
+    {
+      cJSON* min = cJSON_GetObjectItem(item, "min");
+      cJSON* max = cJSON_GetObjectItem(item, "max");
+      if ((min && min->type != cJSON_Number) || (max && max->type != cJSON_Number) || (!min && !max))
+        break;
+      cond->op = rtFilterOp_Range;
+      cond->min = min ? min->valuedouble : -HUGE_VAL;
+      cond->max = max ? max->valuedouble : HUGE_VAL;
     }
     else
     {
-      i++;
+      break;
     }
+    f->num_conditions++;
+  }
+
+  if (item || f->num_conditions == 0)
+  {
+    cJSON_Delete(json);
+    free(f);
+    return RT_ERROR_INVALID_ARG;
   }
 
+  cJSON_Delete(json);
+  f->text = strdup(text);
+  *filter = f;
   return RT_OK;
 }
 
-static void
-rtConnectedClient_Destroy(rtConnectedClient* clnt)
+static uint8_t const*
+rtFilter_SkipSpace(uint8_t const* p, uint8_t const* end)
 {
-  rtRouted_ClearClientRoutes(clnt);
-
-  if (clnt->fd != -1)
-    close(clnt->fd);
-
-  if (clnt->read_buffer)
-    free(clnt->read_buffer);
-
-  if (clnt->send_buffer)
-    free(clnt->send_buffer);
-
-  free(clnt);
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
 }
 
-static rtError
-rtRouted_ForwardMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff, int n, rtSubscription* subscription)
+/**
+ * @return the position after the closing quote of the string starting at p
+ */
+static uint8_t const*
+rtFilter_SkipString(uint8_t const* p, uint8_t const* end)
 {
-  ssize_t bytes_sent;
-
-  (void) sender;
+  for (p++; p < end; ++p)
+  {
+    if (*p == '\\')
+      p++;
+    else if (*p == '"')
+      return p + 1;
+  }
+  return NULL;
+}
 
-  rtMessageHeader new_header;
-  rtMessageHeader_Init(&new_header);
-  new_header.version = hdr->version;
-  new_header.header_length = hdr->header_length;
-  new_header.sequence_number = hdr->sequence_number;
-  new_header.control_data = subscription->id;
-  new_header.payload_length = hdr->payload_length;
-  new_header.topic_length = hdr->topic_length;
-  new_header.reply_topic_length = hdr->reply_topic_length;
-  new_header.flags = hdr->flags;
-  strcpy(new_header.topic, hdr->topic);
-  strcpy(new_header.reply_topic, hdr->reply_topic);
-  rtMessageHeader_Encode(&new_header, subscription->client->send_buffer);
+/**
+ * @return the position after the json value starting at p
+ */
+static uint8_t const*
+rtFilter_SkipValue(uint8_t const* p, uint8_t const* end)
+{
+  int depth;
 
-  // rtDebug_PrintBuffer("fwd header", subscription->client->send_buffer, new_header.length);
+  if (*p == '"')
+    return rtFilter_SkipString(p, end);
 
-  bytes_sent = send(subscription->client->fd, subscription->client->send_buffer, new_header.header_length, MSG_NOSIGNAL);
-  if (bytes_sent == -1)
+  depth = 0;
+  while (p < end)
   {
-    if (errno == EBADF)
+    if (*p == '"')
     {
-      return rtErrorFromErrno(errno);
+      p = rtFilter_SkipString(p, end);
+      if (!p)
+        return NULL;
+      continue;
     }
-    else
+    if (*p == '{' || *p == '[')
+      depth++;
+    else if (*p == '}' || *p == ']')
     {
-      rtLog_Warn("error forwarding message to client. %d %s", errno, strerror(errno));
+      if (depth == 0)
+        return p;
+      if (--depth == 0)
+        return p + 1;
     }
-    return RT_FAIL;
+    else if (*p == ',' && depth == 0)
+      return p;
+    p++;
   }
+  return depth == 0 ? p : NULL;
+}
 
-  bytes_sent = send(subscription->client->fd, buff, n, MSG_NOSIGNAL);
-  if (bytes_sent == -1)
+static int
+rtFilter_MatchValue(rtFilterCondition const* cond, uint8_t const* p, uint8_t const* end)
+{
+  size_t n;
+  char number[64];
+  char* number_end;
+  double d;
+
+  n = end - p;
+  switch (cond->op)
   {
-    if (errno == EBADF)
-    {
-      return rtErrorFromErrno(EBADF);
-    }
-    else
-    {
-      rtLog_Warn("error forwarding message to client. %d %s", errno, strerror(errno));
-    }
-    return RT_FAIL;
+    case rtFilterOp_EqualString:
+      // compared as written, the value can't contain anything json escapes
+      return *p == '"' && n - 2 == strlen(cond->value) && memcmp(p + 1, cond->value, n - 2) == 0;
+
+    case rtFilterOp_EqualLiteral:
+      return n == strlen(cond->value) && memcmp(p, cond->value, n) == 0;
+
+    case rtFilterOp_EqualNumber:
+    case rtFilterOp_Range:
+      if (n == 0 || n >= sizeof(number) || *p == '"' || *p == '{' || *p == '[')
+        return 0;
+      memcpy(number, p, n);
+      number[n] = '\0';
+      d = strtod(number, &number_end);
+      if (number_end == number)
+        return 0;
+      return d >= cond->min && d <= cond->max;
   }
-  return RT_OK;
+  return 0;
 }
 
-static rtError 
-rtRouted_PrintMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff,
-  int n, rtSubscription* subscription)
+/**
+ * Checks a payload against a subscription filter, reading just the top level
+ * of the json object and only looking at the fields the filter names.
+ * Payloads that aren't json objects don't match any filter.
+ */
+static int
+rtFilter_Match(rtFilter const* filter, uint8_t const* buff, int n)
 {
-  (void) hdr;
-  (void) sender;
-  (void) subscription;
+  uint32_t i;
+  uint32_t matched;
+  uint8_t const* p;
+  uint8_t const* end;
 
-  printf("message debug\n");
-  printf("'%.*s'\n", n, (char *) buff);
-  return RT_OK;
-}
+  if (!filter)
+    return 1;
 
-static rtError
-rtRouted_OnMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff,
-  int n, rtSubscription* not_unsed)
-{
-  (void) not_unsed;
+  matched = 0;
+  p = buff;
+  end = buff + n;
 
-  if (strcmp(hdr->topic, "_RTROUTED.INBOX.SUBSCRIBE") == 0)
+  // the payload may be nul terminated
+  while (end > p && end[-1] == '\0')
+    end--;
+
+  p = rtFilter_SkipSpace(p, end);
+  if (p == end || *p++ != '{')
+    return 0;
+
+  while (1)
+  {
+    uint8_t const* key;
+    uint8_t const* key_end;
+    uint8_t const* value;
+    uint8_t const* value_end;
+
+    p = rtFilter_SkipSpace(p, end);
+    if (p == end || *p != '"')
+      break;
+    key = p + 1;
+    p = rtFilter_SkipString(p, end);
+    if (!p)
+      return 0;
+    key_end = p - 1;
+
+    p = rtFilter_SkipSpace(p, end);
+    if (p == end || *p++ != ':')
+      return 0;
+    p = rtFilter_SkipSpace(p, end);
+    if (p == end)
+      return 0;
+
+    value = p;
+    p = rtFilter_SkipValue(p, end);
+    if (!p)
+      return 0;
+    value_end = p;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t' ||
+           value_end[-1] == '\r' || value_end[-1] == '\n'))
+      value_end--;
+
+    for (i = 0; i < filter->num_conditions; ++i)
+    {
+      rtFilterCondition const* cond = &filter->conditions[i];
+      if (strlen(cond->field) == (size_t) (key_end - key) && memcmp(cond->field, key, key_end - key) == 0)
+      {
+        if (!rtFilter_MatchValue(cond, value, value_end))
+          return 0;
+        matched |= (1u << i);
+      }
+    }
+
+    if (matched == (1u << filter->num_conditions) - 1)
+      return 1;
+
+    p = rtFilter_SkipSpace(p, end);
+    if (p == end || *p != ',')
+      break;
+    p++;
+  }
+
+  return 0;
+}
+
+static void
+rtConflatedSlot_Destroy(void* p)
+{
+  rtConflatedSlot* slot = (rtConflatedSlot *) p;
+  free(slot->payload);
+  free(slot);
+}
+
+static void
+rtSubscription_SetMaxRate(rtSubscription* subscription, uint32_t max_rate)
+{
+  subscription->max_rate = max_rate;
+  subscription->interval = max_rate < 1000 ? 1000 / max_rate : 1;
+  rtVector_Create(&subscription->slots);
+  rtVector_PushBack(conflated_subscriptions, subscription);
+}
+
+static void
+rtSubscription_Destroy(rtSubscription* subscription)
+{
+  if (subscription->slots)
+  {
+    rtVector_RemoveItem(conflated_subscriptions, subscription, NULL);
+    rtVector_Destroy(subscription->slots, rtConflatedSlot_Destroy);
+  }
+  rtFilter_Destroy(subscription->filter);
+  free(subscription);
+}
+
+static rtError
+rtRouted_AddRoute(rtRouteMessageHandler handler, char const* exp, rtSubscription* subscription)
+{
+  rtRouteEntry* route = (rtRouteEntry *) malloc(sizeof(rtRouteEntry));
+  route->subscription = subscription;
+  route->message_handler = handler;
+  strncpy(route->expression, exp, RTMSG_MAX_EXPRESSION_LEN);
+  rtVector_PushBack(routes, route);
+  interest_changed = 1;
+  rtLog_Debug("client [%s] added new route:%s", subscription->client->ident, exp);
+  return RT_OK;
+}
+
+static rtQueueGroup*
+rtRouted_JoinQueueGroup(char const* name, rtRouteEntry* route)
+{
+  size_t i;
+  size_t n;
+  rtQueueGroup* group;
+
+  group = NULL;
+  for (i = 0, n = rtVector_Size(queue_groups); i < n; ++i)
+  {
+    rtQueueGroup* item = (rtQueueGroup *) rtVector_At(queue_groups, i);
+    if (strcmp(item->name, name) == 0 && strcmp(item->expression, route->expression) == 0)
+    {
+      group = item;
+      break;
+    }
+  }
+
+  if (!group)
+  {
+    group = (rtQueueGroup *) malloc(sizeof(rtQueueGroup));
+    if (!group)
+      return NULL;
+    strncpy(group->name, name, RTMSG_MAX_EXPRESSION_LEN - 1);
+    group->name[RTMSG_MAX_EXPRESSION_LEN - 1] = '\0';
+    strcpy(group->expression, route->expression);
+    group->next_member = 0;
+    rtVector_Create(&group->members);
+    rtVector_PushBack(queue_groups, group);
+    rtLog_Debug("created queue group %s for %s", group->name, group->expression);
+  }
+
+  rtVector_PushBack(group->members, route);
+  route->subscription->group = group;
+  return group;
+}
+
+static void
+rtRouted_LeaveQueueGroup(rtRouteEntry* route)
+{
+  rtQueueGroup* group = route->subscription->group;
+
+  rtVector_RemoveItem(group->members, route, NULL);
+  route->subscription->group = NULL;
+
+  if (rtVector_Size(group->members) == 0)
+  {
+    rtLog_Debug("removing empty queue group %s for %s", group->name, group->expression);
+    rtVector_RemoveItem(queue_groups, group, NULL);
+    rtVector_Destroy(group->members, NULL);
+    free(group);
+  }
+}
+
+static rtError
+rtRouted_OpenCapture(char const* fname)
+{
+  int ret;
+  uint8_t* p;
+
+  capture = (rtCapture *) malloc(sizeof(rtCapture));
+  if (!capture)
+    return rtErrorFromErrno(ENOMEM);
+
+  capture->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (capture->fd == -1)
+  {
+    rtError err = rtErrorFromErrno(errno);
+    rtLog_Error("failed to open capture file %s. %s", fname, rtStrError(err));
+    free(capture);
+    capture = NULL;
+    return err;
+  }
+
+  // the blocks are allocated up front, writing to a sparse mapping on a full
+  // disk raises SIGBUS
+  capture->mapped = RTCAPTURE_CHUNK_SIZE;
+  capture->base = MAP_FAILED;
+  ret = posix_fallocate(capture->fd, 0, capture->mapped);
+  if (ret == 0)
+    capture->base = (uint8_t *) mmap(NULL, capture->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+  else
+    errno = ret;
+
+  if (capture->base == MAP_FAILED)
+  {
+    rtError err = rtErrorFromErrno(errno);
+    rtLog_Error("failed to map capture file %s. %s", fname, rtStrError(err));
+    close(capture->fd);
+    free(capture);
+    capture = NULL;
+    return err;
+  }
+
+  p = capture->base;
+  memcpy(p, RTCAPTURE_MAGIC, RTCAPTURE_MAGIC_LENGTH);
+  p += RTCAPTURE_MAGIC_LENGTH;
+  rtEncoder_EncodeUInt32(&p, RTCAPTURE_VERSION);
+  capture->offset = RTCAPTURE_FILE_HEADER_LENGTH;
+
+  rtLog_Info("capturing frames to %s", fname);
+  return RT_OK;
+}
+
+static void
+rtRouted_CloseCapture()
+{
+  if (!capture)
+    return;
+  if (capture->base != MAP_FAILED)
+    munmap(capture->base, capture->mapped);
+  close(capture->fd);
+  free(capture);
+  capture = NULL;
+}
+
+static void
+rtRouted_CaptureFrame(uint8_t const* frame, uint32_t n)
+{
+  int ret;
+  uint8_t* p;
+  size_t length;
+  struct timespec now;
+
+  length = RTCAPTURE_RECORD_HEADER_LENGTH + n;
+
+  if (capture->offset + length > capture->mapped)
+  {
+    size_t size = capture->mapped + RTCAPTURE_CHUNK_SIZE;
+    while (capture->offset + length > size)
+      size += RTCAPTURE_CHUNK_SIZE;
+
+    // the old mapping stays until the new blocks are there, it's unmapped on
+    // close if they can't be had
+    ret = posix_fallocate(capture->fd, capture->mapped, size - capture->mapped);
+    if (ret == 0)
+    {
+      munmap(capture->base, capture->mapped);
+      capture->base = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+    }
+    else
+    {
+      errno = ret;
+    }
+
+    if (ret != 0 || capture->base == MAP_FAILED)
+    {
+      rtLog_Error("failed to grow capture file, capture stopped. %s", rtStrError(rtErrorFromErrno(errno)));
+      rtRouted_CloseCapture();
+      return;
+    }
+    capture->mapped = size;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  p = capture->base + capture->offset;
+  rtEncoder_EncodeUInt32(&p, (uint32_t) now.tv_sec);
+  rtEncoder_EncodeUInt32(&p, (uint32_t) now.tv_nsec);
+  rtEncoder_EncodeUInt32(&p, n);
+  memcpy(p, frame, n);
+  capture->offset += length;
+}
+
+static int
+rtRouted_FileExists(char const* s)
+{
+  int ret;
+  struct stat buf;
+
+  if (!s || strlen(s) == 0) return 0;
+
+  memset(&buf, 0, sizeof(buf));
+  ret = stat(s, &buf);
+
+  return ret == 0 ? 1 : 0;
+}
+
+static rtError
+rtRouted_ParseConfig(char const* fname, int bind_listeners)
+{
+  int       i;
+  int       n;
+  char*     buff;
+  FILE*     fin;
+  cJSON*    json;
+  cJSON*    listeners;
+
+  if (!fname || strlen(fname) == 0)
+  {
+    rtLog_Warn("cannot prase empty configuration file");
+    return RT_OK;
+  }
+
+  if (!rtRouted_FileExists(fname))
+  {
+    rtLog_Error("configuration file %s doesn't exist", fname);
+    return RT_OK;
+  }
+
+  n = 0;
+  buff = NULL;
+  fin = NULL;
+  json = NULL;
+
+  rtLog_Debug("parsing configuration from file %s", fname);
+
+  fin = fopen(fname, "r");
+  if (fin)
+  {
+    struct stat st;
+
+    // the whole file, however long its comments
+    if (fstat(fileno(fin), &st) == 0)
+      buff = (char *) malloc(st.st_size + 1);
+    if (!buff)
+    {
+      rtLog_Error("failed to read configuration file %s", fname);
+      exit(1);
+    }
+    n = (int) fread(buff, 1, st.st_size, fin);
+    buff[n] = '\0';
+    fclose(fin);
+  }
+  else
+  {
+    int err = errno;
+    rtLog_Error("failed to open configuration file %s. %s", fname, strerror(errno));
+    exit(1);
+  }
+
+  // drops the comments along with the whitespace
+  cJSON_Minify(buff);
+  json = cJSON_Parse(buff);
+
+  if (!json)
+  {
+    rtLog_Error("error parising configuration file");
+
+    char const* p = cJSON_GetErrorPtr();
+    if (p)
+    {
+      char const* end = (buff + strlen(buff));
+      int n = (int) (end - p);
+      if (n > 64)
+        n = 64;
+      rtLog_Error("%.*s\n", n, p);
+    }
+
+    exit(1);
+  }
+  else
+  {
+    free(buff);
+
+    // after a takeover the listeners are the ones handed over by the old instance
+    listeners = cJSON_GetObjectItem(json, "listeners");
+    if (listeners && bind_listeners)
+    {
+      for (i = 0, n = cJSON_GetArraySize(listeners); i < n; ++i)
+      {
+        cJSON* item = cJSON_GetArrayItem(listeners, i);
+        if (item)
+        {
+          cJSON* uri = cJSON_GetObjectItem(item, "uri");
+          if (uri)
+            rtRouted_BindListener(uri->valuestring, 1);
+        }
+      }
+    }
+
+    cJSON* retained = cJSON_GetObjectItem(json, "retained_topics");
+    if (retained)
+    {
+      for (i = 0, n = cJSON_GetArraySize(retained); i < n; ++i)
+      {
+        cJSON* item = cJSON_GetArrayItem(retained, i);
+        if (item)
+        {
+          cJSON* topic = cJSON_GetObjectItem(item, "topic");
+          if (topic && topic->valuestring)
+          {
+            rtVector_PushBack(retained_topics, strdup(topic->valuestring));
+            rtLog_Debug("retaining last value for topics matching:%s", topic->valuestring);
+          }
+        }
+      }
+    }
+
+    // the router's own frames, and any header, always fit
+    cJSON* max_size = cJSON_GetObjectItem(json, "max_message_size");
+    if (max_size && max_size->valueint > 0)
+      max_message_size = max_size->valueint < RTMSG_CLIENT_READ_BUFFER_SIZE ?
+        RTMSG_CLIENT_READ_BUFFER_SIZE : (uint32_t) max_size->valueint;
+
+    cJSON* max_bytes = cJSON_GetObjectItem(json, "retained_max_bytes");
+    if (max_bytes && max_bytes->valueint >= 0)
+      retained_max_bytes = (size_t) max_bytes->valueint;
+
+    cJSON* coalesced = cJSON_GetObjectItem(json, "coalesced_topics");
+    if (coalesced)
+    {
+      for (i = 0, n = cJSON_GetArraySize(coalesced); i < n; ++i)
+      {
+        cJSON* item = cJSON_GetArrayItem(coalesced, i);
+        if (item)
+        {
+          cJSON* topic = cJSON_GetObjectItem(item, "topic");
+          if (topic && topic->valuestring)
+          {
+            rtVector_PushBack(coalesced_topics, strdup(topic->valuestring));
+            rtLog_Debug("coalescing requests for topics matching:%s", topic->valuestring);
+          }
+        }
+      }
+    }
+
+    cJSON* timeout = cJSON_GetObjectItem(json, "coalesce_timeout");
+    if (timeout && timeout->valueint > 0)
+      coalesce_timeout = (uint32_t) timeout->valueint;
+
+    cJSON* policy = cJSON_GetObjectItem(json, "queue_group_policy");
+    if (policy && policy->valuestring)
+    {
+      if (strcmp(policy->valuestring, "least_outstanding") == 0)
+        queue_group_policy = rtQueueGroupPolicy_LeastOutstanding;
+      else if (strcmp(policy->valuestring, "round_robin") == 0)
+        queue_group_policy = rtQueueGroupPolicy_RoundRobin;
+      else
+        rtLog_Warn("unknown queue_group_policy:%s", policy->valuestring);
+    }
+
+    cJSON* limits = cJSON_GetObjectItem(json, "rate_limits");
+    if (limits)
+    {
+      for (i = 0, n = cJSON_GetArraySize(limits); i < n; ++i)
+      {
+        cJSON* item = cJSON_GetArrayItem(limits, i);
+        if (item)
+        {
+          cJSON* topic = cJSON_GetObjectItem(item, "topic");
+          cJSON* rate = cJSON_GetObjectItem(item, "rate");
+          cJSON* burst = cJSON_GetObjectItem(item, "burst");
+          cJSON* action = cJSON_GetObjectItem(item, "action");
+          rtRateLimit* limit;
+
+          if (!rate || rate->valuedouble <= 0)
+          {
+            rtLog_Warn("ignoring rate limit without a rate");
+            continue;
+          }
+
+          limit = (rtRateLimit *) malloc(sizeof(rtRateLimit));
+          if (!limit)
+            continue;
+
+          // without a topic the limit covers everything the client sends
+          strncpy(limit->expression, topic && topic->valuestring ? topic->valuestring : ">",
+            RTMSG_MAX_EXPRESSION_LEN - 1);
+          limit->expression[RTMSG_MAX_EXPRESSION_LEN - 1] = '\0';
+          limit->rate = rate->valuedouble;
+          limit->burst = burst && burst->valuedouble >= 1 ? burst->valuedouble : limit->rate;
+          if (limit->burst < 1)
+            limit->burst = 1;
+
+          limit->action = rtRateLimitAction_Drop;
+          if (action && action->valuestring)
+          {
+            if (strcmp(action->valuestring, "delay") == 0)
+              limit->action = rtRateLimitAction_Delay;
+            else if (strcmp(action->valuestring, "disconnect") == 0)
+              limit->action = rtRateLimitAction_Disconnect;
+            else if (strcmp(action->valuestring, "drop") != 0)
+              rtLog_Warn("unknown rate limit action:%s, dropping instead", action->valuestring);
+          }
+
+          rtVector_PushBack(rate_limits, limit);
+          rtLog_Debug("limiting %s to %.1f messages/sec per client", limit->expression, limit->rate);
+        }
+      }
+    }
+
+    cJSON_Delete(json);
+  }
+}
+
+static rtError
+rtRouted_ClearClientRoutes(rtConnectedClient* clnt)
+{
+  size_t i;
+  for (i = 0; i < rtVector_Size(routes);)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (route->subscription && route->subscription->client == clnt)
+    {
+      rtVector_RemoveItem(routes, route, NULL);
+      interest_changed = 1;
+      if (route->subscription->group)
+        rtRouted_LeaveQueueGroup(route);
+      rtSubscription_Destroy(route->subscription);
+      free(route);
+    }
+    else
+    {
+      i++;
+    }
+  }
+
+  return RT_OK;
+}
+
+static void
+rtRouted_ClearSubscription(rtConnectedClient* clnt, uint32_t id)
+{
+  size_t i;
+  for (i = 0; i < rtVector_Size(routes);)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (route->subscription && route->subscription->client == clnt && route->subscription->id == id)
+    {
+      rtVector_RemoveItem(routes, route, NULL);
+      interest_changed = 1;
+      if (route->subscription->group)
+        rtRouted_LeaveQueueGroup(route);
+      rtSubscription_Destroy(route->subscription);
+      free(route);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+static int
+rtRouted_HasSubscription(rtConnectedClient const* clnt, uint32_t id)
+{
+  size_t i;
+  for (i = 0; i < rtVector_Size(routes); ++i)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (route->subscription && route->subscription->client == clnt && route->subscription->id == id)
+      return 1;
+  }
+  return 0;
+}
+
+static int
+rtConnectedClient_HasPendingOutput(rtConnectedClient const* clnt)
+{
+  int lane;
+
+  if (clnt->partial_frame)
+    return 1;
+  for (lane = 0; lane < RTMSG_PRIORITY_LANES; ++lane)
+  {
+    if (clnt->outbound[lane].head)
+      return 1;
+  }
+  return 0;
+}
+
+static rtError
+rtConnectedClient_SendError(int err)
+{
+  if (err == EBADF)
+    return rtErrorFromErrno(EBADF);
+  rtLog_Warn("error forwarding message to client. %d %s", err, strerror(err));
+  return RT_FAIL;
+}
+
+/**
+ * Lines up to RTMSG_FLUSH_MAX_IOV queued frames in the order they go out. A
+ * frame that was partially written always goes first, then frames from the
+ * highest priority lane that has any.
+ * @return number of frames gathered
+ */
+static int
+rtConnectedClient_GatherOutput(rtConnectedClient* clnt, struct iovec* iov, rtOutboundFrame** frames,
+  int* lanes, size_t* bytes_queued)
+{
+  int i;
+  int lane;
+  int count;
+  rtOutboundFrame* frame;
+
+  count = 0;
+  if (clnt->partial_frame)
+  {
+    frames[count] = clnt->partial_frame;
+    lanes[count++] = -1;
+  }
+  for (lane = RTMSG_PRIORITY_LANES - 1; lane >= 0 && count < RTMSG_FLUSH_MAX_IOV; --lane)
+  {
+    for (frame = clnt->outbound[lane].head; frame && count < RTMSG_FLUSH_MAX_IOV; frame = frame->next)
+    {
+      frames[count] = frame;
+      lanes[count++] = lane;
+    }
+  }
+
+  *bytes_queued = 0;
+  for (i = 0; i < count; ++i)
+  {
+    iov[i].iov_base = frames[i]->data + frames[i]->offset;
+    iov[i].iov_len = frames[i]->length - frames[i]->offset;
+    *bytes_queued += iov[i].iov_len;
+  }
+
+  return count;
+}
+
+/**
+ * Frees the gathered frames that have been written completely. Frames went out
+ * in the order they were gathered, so each one is at the head of its queue by
+ * the time it is retired. A frame that was cut short becomes the partial frame.
+ */
+static void
+rtConnectedClient_RetireOutput(rtConnectedClient* clnt, rtOutboundFrame** frames, int const* lanes,
+  int count, size_t bytes_sent)
+{
+  int i;
+  rtOutboundFrame* frame;
+
+  stats.write_calls++;
+  clnt->outbound_bytes -= bytes_sent;
+
+  for (i = 0; i < count && bytes_sent > 0; ++i)
+  {
+    uint32_t remaining = frames[i]->length - frames[i]->offset;
+
+    frame = frames[i];
+    if (lanes[i] >= 0)
+    {
+      clnt->outbound[lanes[i]].head = frame->next;
+      if (!clnt->outbound[lanes[i]].head)
+        clnt->outbound[lanes[i]].tail = NULL;
+      frame->next = NULL;
+    }
+
+    if (bytes_sent >= remaining)
+    {
+      bytes_sent -= remaining;
+      if (clnt->partial_frame == frame)
+        clnt->partial_frame = NULL;
+      stats.frames_sent++;
+      free(frame);
+    }
+    else
+    {
+      frame->offset += bytes_sent;
+      bytes_sent = 0;
+      clnt->partial_frame = frame;
+    }
+  }
+}
+
+/**
+ * Writes as much of the client's queued output as the socket takes without
+ * blocking, RTMSG_FLUSH_MAX_IOV frames per call.
+ */
+static rtError
+rtConnectedClient_Flush(rtConnectedClient* clnt)
+{
+  int count;
+  size_t bytes_queued;
+  ssize_t bytes_sent;
+  struct msghdr msg;
+  struct iovec iov[RTMSG_FLUSH_MAX_IOV];
+  rtOutboundFrame* frames[RTMSG_FLUSH_MAX_IOV];
+  int lanes[RTMSG_FLUSH_MAX_IOV];
+
+  clnt->dirty = 0;
+
+  while (1)
+  {
+    count = rtConnectedClient_GatherOutput(clnt, iov, frames, lanes, &bytes_queued);
+    if (count == 0)
+      return RT_OK;
+
+    // sendmsg rather than writev for MSG_NOSIGNAL
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    bytes_sent = sendmsg(clnt->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (bytes_sent == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return RT_OK;
+      return rtConnectedClient_SendError(errno);
+    }
+
+    rtConnectedClient_RetireOutput(clnt, frames, lanes, count, bytes_sent);
+
+    // the socket took less than it was offered, it's full
+    if ((size_t) bytes_sent < bytes_queued)
+      return RT_OK;
+  }
+
+  return RT_OK;
+}
+
+/**
+ * Writes the client's queued output with whichever backend is running. With
+ * io_uring the send is only queued, it goes out with the next submit.
+ */
+static rtError
+rtRouted_FlushClient(rtConnectedClient* clnt)
+{
+#ifdef RTROUTED_USE_IO_URING
+  if (uring_active)
+    return rtRouted_UringQueueSend(clnt);
+#endif
+  return rtConnectedClient_Flush(clnt);
+}
+
+/**
+ * Copies a frame, or what's left of one, onto a client's queue. A lane of -1
+ * makes it the partial frame, which goes out before anything else.
+ */
+static rtError
+rtConnectedClient_QueueFrame(rtConnectedClient* clnt, int lane, uint8_t const* hdr,
+  uint32_t header_length, uint8_t const* buff, uint32_t n)
+{
+  rtOutboundFrame* frame;
+  rtOutboundQueue* queue;
+
+  frame = (rtOutboundFrame *) malloc(sizeof(rtOutboundFrame) + header_length + n);
+  if (!frame)
+    return rtErrorFromErrno(ENOMEM);
+
+  frame->next = NULL;
+  frame->length = header_length + n;
+  frame->offset = 0;
+  frame->data = (uint8_t *) (frame + 1);
+  memcpy(frame->data, hdr, header_length);
+  if (n > 0)
+    memcpy(frame->data + header_length, buff, n);
+  clnt->outbound_bytes += frame->length;
+
+  if (lane < 0)
+  {
+    clnt->partial_frame = frame;
+    return RT_OK;
+  }
+
+  queue = &clnt->outbound[lane];
+  if (queue->tail)
+    queue->tail->next = frame;
+  else
+    queue->head = frame;
+  queue->tail = frame;
+  return RT_OK;
+}
+
+/**
+ * Writes a frame straight from the caller's buffers, after whatever was
+ * queued for the client this pass. Only the part the socket doesn't take is
+ * copied.
+ */
+static rtError
+rtConnectedClient_SendDirect(rtConnectedClient* clnt, rtMessagePriority priority, uint8_t const* hdr,
+  uint32_t header_length, uint8_t const* buff, uint32_t n)
+{
+  uint32_t sent;
+  ssize_t bytes_sent;
+  rtError err;
+  struct msghdr msg;
+  struct iovec iov[2];
+
+  err = rtConnectedClient_Flush(clnt);
+  if (err != RT_OK)
+    return err;
+
+  // the socket filled up, the frame waits behind the rest
+  if (rtConnectedClient_HasPendingOutput(clnt))
+    return rtConnectedClient_QueueFrame(clnt, priority, hdr, header_length, buff, n);
+
+  iov[0].iov_base = (void *) hdr;
+  iov[0].iov_len = header_length;
+  iov[1].iov_base = (void *) buff;
+  iov[1].iov_len = n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  do
+  {
+    bytes_sent = sendmsg(clnt->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+  while (bytes_sent == -1 && errno == EINTR);
+
+  if (bytes_sent == -1)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return rtConnectedClient_QueueFrame(clnt, priority, hdr, header_length, buff, n);
+    return rtConnectedClient_SendError(errno);
+  }
+
+  stats.write_calls++;
+  sent = (uint32_t) bytes_sent;
+  if (sent == header_length + n)
+  {
+    stats.frames_sent++;
+    return RT_OK;
+  }
+
+  if (sent < header_length)
+    return rtConnectedClient_QueueFrame(clnt, -1, hdr + sent, header_length - sent, buff, n);
+  sent -= header_length;
+  return rtConnectedClient_QueueFrame(clnt, -1, buff + sent, n - sent, NULL, 0);
+}
+
+/**
+ * Sends a frame to a client. Small frames for a client with no backlog are
+ * copied and written together at the end of the dispatch pass, or sooner when
+ * RTMSG_FLUSH_MAX_BYTES have built up. Larger ones aren't worth the copy and
+ * go out right away. A client with a backlog is flushed when its socket
+ * becomes writable.
+ */
+static rtError
+rtConnectedClient_Send(rtConnectedClient* clnt, rtMessagePriority priority, uint8_t const* hdr,
+  uint32_t header_length, uint8_t const* buff, uint32_t n)
+{
+  int direct;
+  uint32_t length;
+  rtError err;
+
+  length = header_length + n;
+
+  if (clnt->outbound_bytes + length > RTMSG_CLIENT_MAX_OUTBOUND_BYTES)
+  {
+    rtLog_Warn("client [%s] is too far behind, dropping message", clnt->ident);
+    stats.backlog_dropped++;
+    return RT_FAIL;
+  }
+
+  // io_uring sends after the caller's buffers are gone, it always copies
+  direct = length > RTMSG_FLUSH_COPY_MAX_BYTES && (clnt->dirty || !rtConnectedClient_HasPendingOutput(clnt));
+#ifdef RTROUTED_USE_IO_URING
+  if (uring_active)
+    direct = 0;
+#endif
+  if (direct)
+    return rtConnectedClient_SendDirect(clnt, priority, hdr, header_length, buff, n);
+
+  if (!rtConnectedClient_HasPendingOutput(clnt))
+    clnt->dirty = 1;
+
+  err = rtConnectedClient_QueueFrame(clnt, priority, hdr, header_length, buff, n);
+  if (err != RT_OK)
+    return err;
+
+  if (clnt->dirty && clnt->outbound_bytes >= RTMSG_FLUSH_MAX_BYTES)
+    return rtRouted_FlushClient(clnt);
+
+  return RT_OK;
+}
+
+/**
+ * Flushes clients that had output queued during this pass. Errors are left for
+ * the end of the pass, where the client is dropped.
+ */
+static void
+rtRouted_FlushDirtyClients()
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(clients); i < n; ++i)
+  {
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+    if (clnt->dirty)
+      rtConnectedClient_Flush(clnt);
+  }
+}
+
+static void
+rtConnectedClient_Destroy(rtConnectedClient* clnt)
+{
+  int lane;
+
+  rtRouted_ClearClientRoutes(clnt);
+
+  if (clnt->fd != -1)
+    close(clnt->fd);
+
+  if (clnt->read_buffer)
+    free(clnt->read_buffer);
+
+  if (clnt->send_buffer)
+    free(clnt->send_buffer);
+
+  if (clnt->partial_frame)
+    free(clnt->partial_frame);
+
+  if (clnt->buckets)
+    free(clnt->buckets);
+
+  if (clnt->pending_input)
+    free(clnt->pending_input);
+
+  rtVector_Destroy(clnt->declared_topics, free);
+
+  for (lane = 0; lane < RTMSG_PRIORITY_LANES; ++lane)
+  {
+    while (clnt->outbound[lane].head)
+    {
+      rtOutboundFrame* frame = clnt->outbound[lane].head;
+      clnt->outbound[lane].head = frame->next;
+      free(frame);
+    }
+  }
+
+  free(clnt);
+}
+
+/**
+ * Removes a client that hit an error or hung up. Its routes go right away,
+ * with io_uring the client itself lives on until the kernel is done with its
+ * buffers.
+ */
+static void
+rtRouted_DropClient(rtConnectedClient* clnt)
+{
+  rtVector_RemoveItem(clients, clnt, NULL);
+#ifdef RTROUTED_USE_IO_URING
+  if (uring_active)
+  {
+    rtRouted_UringClose(clnt);
+    return;
+  }
+#endif
+  rtConnectedClient_Destroy(clnt);
+}
+
+/**
+ * Sends one copy of a message to a client for all of the given subscription
+ * ids. The first id goes in control_data, any others are listed in the header
+ * for clients that asked for that.
+ */
+static rtError
+rtRouted_ForwardToClient(rtConnectedClient* clnt, rtMessageHeader* hdr, uint8_t const* buff, int n,
+  uint32_t const* ids, uint32_t num_ids)
+{
+  rtMessageHeader new_header;
+  rtMessageHeader_Init(&new_header);
+  new_header.version = hdr->version;
+  new_header.header_length = hdr->header_length;
+  new_header.sequence_number = hdr->sequence_number;
+  new_header.control_data = ids[0];
+  new_header.payload_length = hdr->payload_length;
+  new_header.topic_length = hdr->topic_length;
+  new_header.reply_topic_length = hdr->reply_topic_length;
+  new_header.flags = hdr->flags;
+  strcpy(new_header.topic, hdr->topic);
+  strcpy(new_header.reply_topic, hdr->reply_topic);
+  rtMessageHeader_Encode(&new_header, clnt->send_buffer);
+  rtMessageHeader_EncodeSubscriptions(&new_header, clnt->send_buffer, ids + 1, num_ids - 1);
+
+  // rtDebug_PrintBuffer("fwd header", clnt->send_buffer, new_header.length);
+
+  return rtConnectedClient_Send(clnt, rtMessageHeader_GetPriority(hdr), clnt->send_buffer,
+    new_header.header_length, buff, n);
+}
+
+static rtError
+rtRouted_ForwardMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff, int n, rtSubscription* subscription)
+{
+  (void) sender;
+  return rtRouted_ForwardToClient(subscription->client, hdr, buff, n, &subscription->id, 1);
+}
+
+/**
+ * Forwards a message to a subscription with a max_rate right away when its
+ * topic hasn't been sent within the interval, otherwise keeps it as the
+ * topic's pending value, replacing any older one.
+ */
+static rtError
+rtRouted_ConflateMessage(rtMessageHeader* hdr, uint8_t const* buff, int n, rtSubscription* subscription)
+{
+  size_t i;
+  size_t num_slots;
+  uint8_t* payload;
+  uint64_t now;
+  rtConflatedSlot* slot;
+
+  slot = NULL;
+  for (i = 0, num_slots = rtVector_Size(subscription->slots); i < num_slots; ++i)
+  {
+    rtConflatedSlot* item = (rtConflatedSlot *) rtVector_At(subscription->slots, i);
+    if (strcmp(item->header.topic, hdr->topic) == 0)
+    {
+      slot = item;
+      break;
+    }
+  }
+
+  if (!slot)
+  {
+    // too many distinct topics, the rest aren't held back
+    if (num_slots >= RTMSG_MAX_CONFLATED_TOPICS)
+      return rtRouted_ForwardMessage(NULL, hdr, buff, n, subscription);
+
+    slot = (rtConflatedSlot *) calloc(1, sizeof(rtConflatedSlot));
+    if (!slot)
+      return rtErrorFromErrno(ENOMEM);
+    rtVector_PushBack(subscription->slots, slot);
+  }
+
+  now = rtRouted_GetTimeMillis();
+  if (!slot->pending && now - slot->last_sent >= subscription->interval)
+  {
+    slot->header = *hdr;
+    slot->last_sent = now;
+    return rtRouted_ForwardMessage(NULL, hdr, buff, n, subscription);
+  }
+
+  payload = (uint8_t *) realloc(slot->payload, n > 0 ? n : 1);
+  if (!payload)
+    return rtErrorFromErrno(ENOMEM);
+
+  if (slot->pending)
+    stats.conflated++;
+  slot->payload = payload;
+  slot->header = *hdr;
+  slot->pending = 1;
+  memcpy(slot->payload, buff, n);
+  return RT_OK;
+}
+
+/**
+ * Sends the pending values of conflated subscriptions that are due, or all
+ * of them when forced, and forgets topics that have been quiet for an
+ * interval.
+ * @return time of the next pending value, zero when nothing is pending
+ */
+static uint64_t
+rtRouted_FlushConflated(int force)
+{
+  size_t i;
+  size_t j;
+  uint64_t now;
+  uint64_t next;
+
+  now = rtRouted_GetTimeMillis();
+  next = 0;
+  for (i = 0; i < rtVector_Size(conflated_subscriptions); ++i)
+  {
+    rtSubscription* subscription = (rtSubscription *) rtVector_At(conflated_subscriptions, i);
+    for (j = 0; j < rtVector_Size(subscription->slots);)
+    {
+      rtConflatedSlot* slot = (rtConflatedSlot *) rtVector_At(subscription->slots, j);
+      uint64_t due = slot->last_sent + subscription->interval;
+
+      if (slot->pending && (force || due <= now))
+      {
+        slot->pending = 0;
+        slot->last_sent = now;
+        rtRouted_ForwardMessage(NULL, &slot->header, slot->payload, slot->header.payload_length,
+          subscription);
+      }
+      else if (slot->pending)
+      {
+        if (next == 0 || due < next)
+          next = due;
+      }
+      else if (due <= now)
+      {
+        rtVector_RemoveItem(subscription->slots, slot, rtConflatedSlot_Destroy);
+        continue;
+      }
+      j++;
+    }
+  }
+  return next;
+}
+
+static uint32_t
+rtRouted_FindSubscriptionId(rtConnectedClient const* clnt, char const* topic)
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(routes); i < n; ++i)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (route->subscription && route->subscription->client == clnt &&
+        rtRouted_IsTopicMatch(topic, route->expression))
+      return route->subscription->id;
+  }
+  return 0;
+}
+
+static void
+rtRouted_SendResponse(rtConnectedClient* clnt, rtMessageHeader const* request_header,
+  char const* reply_topic, uint32_t subscription_id, rtMessage res)
+{
+  uint8_t* p;
+  uint32_t n;
+  rtMessageHeader new_header;
+
+  // responses from the router itself go through the client's queue so they
+  // can't land in the middle of a frame
+  rtMessage_ToByteArray(res, &p, &n);
+
+  rtMessageHeader_Init(&new_header);
+  strcpy(new_header.topic, request_header->reply_topic);
+  new_header.topic_length = strlen(new_header.topic);
+  strcpy(new_header.reply_topic, reply_topic);
+  new_header.reply_topic_length = strlen(new_header.reply_topic);
+  new_header.sequence_number = request_header->sequence_number;
+  new_header.control_data = subscription_id;
+  new_header.flags = rtMessageFlags_Response | (request_header->flags & rtMessageFlags_PriorityMask);
+  new_header.payload_length = n;
+  rtMessageHeader_Encode(&new_header, clnt->send_buffer);
+
+  rtConnectedClient_Send(clnt, rtMessageHeader_GetPriority(request_header), clnt->send_buffer,
+    new_header.header_length, p, n);
+
+  free(p);
+}
+
+static void
+rtRouted_SendErrorMessageToCaller(rtConnectedClient* clnt, rtMessageHeader const* request_header)
+{
+  rtMessage res;
+  rtMessage msg;
+
+  // same response rtConnection_SendErrorMessageToCaller builds
+  rtMessage_Create(&res);
+  rtMessage_Create(&msg);
+  rtMessage_SetString(msg, "name", " ");
+  rtMessage_SetString(msg, "value", " ");
+  rtMessage_SetString(msg, "status_msg", "No Route found for this Parameter");
+  rtMessage_SetInt32(msg, "status", 1);
+  rtMessage_AddMessage(res, "result", msg);
+
+  // clients recognise these by the reply topic, not the subscription id
+  rtRouted_SendResponse(clnt, request_header, "NO.ROUTE.RESPONSE", 0, res);
+
+  rtMessage_Release(msg);
+  rtMessage_Release(res);
+}
+
+static void
+rtRouted_SendStats(rtConnectedClient* clnt, rtMessageHeader const* request_header)
+{
+  size_t i;
+  size_t n;
+  rtMessage res;
+
+  rtMessage_Create(&res);
+  rtMessage_SetInt32(res, "clients", (int32_t) rtVector_Size(clients));
+  rtMessage_SetInt32(res, "routes", (int32_t) rtVector_Size(routes));
+  rtMessage_SetInt32(res, "retained_bytes", (int32_t) retained_bytes);
+  rtMessage_SetInt32(res, "interned_topics", (int32_t) rtVector_Size(interned_topics));
+  rtMessage_SetDouble(res, "messages_received", (double) stats.messages_received);
+  rtMessage_SetDouble(res, "rate_limit_dropped", (double) stats.rate_limit_dropped);
+  rtMessage_SetDouble(res, "rate_limit_delayed", (double) stats.rate_limit_delayed);
+  rtMessage_SetDouble(res, "rate_limit_disconnects", (double) stats.rate_limit_disconnects);
+  rtMessage_SetDouble(res, "backlog_dropped", (double) stats.backlog_dropped);
+  rtMessage_SetDouble(res, "conflated", (double) stats.conflated);
+  rtMessage_SetDouble(res, "frames_sent", (double) stats.frames_sent);
+  rtMessage_SetDouble(res, "write_calls", (double) stats.write_calls);
+
+  for (i = 0, n = rtVector_Size(clients); i < n; ++i)
+  {
+    rtMessage item;
+    rtConnectedClient* c = (rtConnectedClient *) rtVector_At(clients, i);
+
+    rtMessage_Create(&item);
+    rtMessage_SetString(item, "ident", c->ident);
+    rtMessage_SetInt32(item, "outbound_bytes", (int32_t) c->outbound_bytes);
+    rtMessage_SetDouble(item, "rate_limited", (double) c->rate_limited);
+    rtMessage_AddMessage(res, "client_stats", item);
+    rtMessage_Release(item);
+  }
+
+  rtRouted_SendResponse(clnt, request_header, "",
+    rtRouted_FindSubscriptionId(clnt, request_header->reply_topic), res);
+  rtMessage_Release(res);
+}
+
+/**
+ * Hands out the id for a topic. Ids are shared by all clients, a topic that
+ * was interned before gets its existing id. The reply carries id 0 when the
+ * table is full, the client then keeps sending the topic string.
+ */
+static void
+rtRouted_InternTopic(rtConnectedClient* clnt, rtMessageHeader const* request_header,
+  uint8_t const* buff, int n)
+{
+  size_t i;
+  int32_t id;
+  char const* topic;
+  rtMessage req;
+  rtMessage res;
+
+  id = 0;
+  topic = NULL;
+
+  rtMessage_FromBytes(&req, buff, n);
+  rtMessage_GetString(req, "topic", &topic);
+
+  if (topic && strlen(topic) > 0 && strlen(topic) < RTMSG_HEADER_MAX_TOPIC_LENGTH)
+  {
+    for (i = 0; i < rtVector_Size(interned_topics); ++i)
+    {
+      if (strcmp((char const *) rtVector_At(interned_topics, i), topic) == 0)
+      {
+        id = (int32_t) (i + 1);
+        break;
+      }
+    }
+
+    if (id == 0 && rtVector_Size(interned_topics) < RTMSG_MAX_INTERNED_TOPICS)
+    {
+      rtVector_PushBack(interned_topics, strdup(topic));
+      id = (int32_t) rtVector_Size(interned_topics);
+      rtLog_Debug("interned %s as %d", topic, id);
+    }
+
+    if (id == 0)
+      rtLog_Warn("topic table is full, client [%s] can't intern %s", clnt->ident, topic);
+  }
+
+  rtMessage_Create(&res);
+  rtMessage_SetInt32(res, "id", id);
+  rtRouted_SendResponse(clnt, request_header, "",
+    rtRouted_FindSubscriptionId(clnt, request_header->reply_topic), res);
+  rtMessage_Release(res);
+  rtMessage_Release(req);
+}
+
+/**
+ * Checks whether a client's process delivers a message to a subscriber
+ * itself. Only plain messages are delivered locally, and only between
+ * clients that asked for it.
+ */
+static int
+rtRouted_IsDeliveredLocally(rtConnectedClient const* sender, uint32_t flags,
+  rtSubscription const* subscription)
+{
+  return subscription->local && sender->process[0] &&
+    !(flags & (rtMessageFlags_Request | rtMessageFlags_Response)) &&
+    strcmp(sender->process, subscription->client->process) == 0;
+}
+
+static int
+rtRouted_HasInterest(rtConnectedClient const* clnt, char const* topic)
+{
+  size_t i;
+  size_t n;
+
+  // a retained topic has to reach the router for subscribers that come later
+  if (rtRouted_IsRetainedTopic(topic))
+    return 1;
+
+  // subscribers in the publisher's own process don't need the router
+  for (i = 0, n = rtVector_Size(routes); i < n; ++i)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (route->subscription && rtRouted_IsTopicMatch(topic, route->expression) &&
+        !rtRouted_IsDeliveredLocally(clnt, 0, route->subscription))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Tells a publisher whether a topic it declared has subscribers. Updates go
+ * to the inbox given with the declaration, with RTMSG_INTEREST_TOPIC as the
+ * reply topic so the client can tell them apart from other messages.
+ */
+static void
+rtRouted_SendInterest(rtConnectedClient* clnt, rtDeclaredTopic const* declared)
+{
+  uint8_t* p;
+  uint32_t n;
+  rtMessage m;
+  rtMessageHeader header;
+
+  rtMessage_Create(&m);
+  rtMessage_SetString(m, "topic", declared->topic);
+  rtMessage_SetInt32(m, "interest", declared->interest);
+  rtMessage_ToByteArray(m, &p, &n);
+
+  rtMessageHeader_Init(&header);
+  strcpy(header.topic, clnt->interest_inbox);
+  header.topic_length = strlen(header.topic);
+  strcpy(header.reply_topic, RTMSG_INTEREST_TOPIC);
+  header.reply_topic_length = strlen(header.reply_topic);
+  header.control_data = rtRouted_FindSubscriptionId(clnt, clnt->interest_inbox);
+  header.payload_length = n;
+  rtMessageHeader_Encode(&header, clnt->send_buffer);
+
+  rtConnectedClient_Send(clnt, rtMessagePriority_High, clnt->send_buffer, header.header_length, p, n);
+
+  free(p);
+  rtMessage_Release(m);
+}
+
+static void
+rtRouted_DeclareTopic(rtConnectedClient* clnt, uint8_t const* buff, int n)
+{
+  size_t i;
+  char const* topic;
+  char const* inbox;
+  rtMessage m;
+  rtDeclaredTopic* declared;
+
+  topic = NULL;
+  inbox = NULL;
+
+  rtMessage_FromBytes(&m, buff, n);
+  rtMessage_GetString(m, "topic", &topic);
+  rtMessage_GetString(m, "inbox", &inbox);
+
+  if (!topic || !inbox || strlen(topic) >= RTMSG_HEADER_MAX_TOPIC_LENGTH ||
+      strlen(inbox) >= RTMSG_HEADER_MAX_TOPIC_LENGTH)
+  {
+    rtMessage_Release(m);
+    return;
+  }
+
+  strcpy(clnt->interest_inbox, inbox);
+
+  declared = NULL;
+  for (i = 0; i < rtVector_Size(clnt->declared_topics); ++i)
+  {
+    rtDeclaredTopic* item = (rtDeclaredTopic *) rtVector_At(clnt->declared_topics, i);
+    if (strcmp(item->topic, topic) == 0)
+    {
+      declared = item;
+      break;
+    }
+  }
+
+  if (!declared)
+  {
+    if (rtVector_Size(clnt->declared_topics) >= RTMSG_MAX_DECLARED_TOPICS)
+    {
+      rtLog_Warn("client [%s] declared too many topics, ignoring %s", clnt->ident, topic);
+      rtMessage_Release(m);
+      return;
+    }
+    declared = (rtDeclaredTopic *) malloc(sizeof(rtDeclaredTopic));
+    if (!declared)
+    {
+      rtMessage_Release(m);
+      return;
+    }
+    strcpy(declared->topic, topic);
+    rtVector_PushBack(clnt->declared_topics, declared);
+  }
+
+  // the current state always goes back, the client assumes interest until
+  // it hears otherwise
+  declared->interest = rtRouted_HasInterest(clnt, topic);
+  rtRouted_SendInterest(clnt, declared);
+
+  rtMessage_Release(m);
+}
+
+/**
+ * Pushes interest updates after subscriptions came or went. Called once per
+ * pass so a client with many subscriptions going away costs one update.
+ */
+static void
+rtRouted_UpdateInterest()
+{
+  size_t i;
+  size_t j;
+  int interest;
+
+  if (!interest_changed)
+    return;
+  interest_changed = 0;
+
+  for (i = 0; i < rtVector_Size(clients); ++i)
+  {
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+    for (j = 0; j < rtVector_Size(clnt->declared_topics); ++j)
+    {
+      rtDeclaredTopic* declared = (rtDeclaredTopic *) rtVector_At(clnt->declared_topics, j);
+      interest = rtRouted_HasInterest(clnt, declared->topic);
+      if (interest != declared->interest)
+      {
+        declared->interest = interest;
+        rtRouted_SendInterest(clnt, declared);
+      }
+    }
+  }
+}
+
+static rtError 
+rtRouted_PrintMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff,
+  int n, rtSubscription* subscription)
+{
+  (void) hdr;
+  (void) sender;
+  (void) subscription;
+
+  printf("message debug\n");
+  printf("'%.*s'\n", n, (char *) buff);
+  return RT_OK;
+}
+
+static rtError
+rtRouted_OnMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff,
+  int n, rtSubscription* not_unsed)
+{
+  (void) not_unsed;
+
+  if (strcmp(hdr->topic, "_RTROUTED.INBOX.SUBSCRIBE") == 0)
+  {
+    char const* expression = NULL;
+    char const* group = NULL;
+    char const* filter = NULL;
+    int32_t route_id = 0;
+    int32_t multiple_subscriptions = 0;
+    int32_t max_rate = 0;
+    int32_t local = 0;
+
+    rtMessage m;
+    rtMessage_FromBytes(&m, buff, n);
+    rtMessage_GetString(m, "topic", &expression);
+    rtMessage_GetInt32(m, "route_id", &route_id);
+    rtMessage_GetString(m, "group", &group);
+    rtMessage_GetInt32(m, "multiple_subscriptions", &multiple_subscriptions);
+    rtMessage_GetString(m, "filter", &filter);
+    rtMessage_GetInt32(m, "max_rate", &max_rate);
+    rtMessage_GetInt32(m, "local", &local);
+    if (multiple_subscriptions)
+      sender->multiple_subscriptions = 1;
+
+    // a client may send a subscription again around a reconnect
+    if (route_id != 0 && rtRouted_HasSubscription(sender, (uint32_t) route_id))
+    {
+      rtMessage_Release(m);
+      return RT_OK;
+    }
+
+    rtSubscription* subscription = (rtSubscription *) malloc(sizeof(rtSubscription));
+    subscription->id = route_id;
+    subscription->client = sender;
+    subscription->group = NULL;
+    subscription->filter = NULL;
+    subscription->max_rate = 0;
+    subscription->slots = NULL;
+    subscription->local = 0;
+
+    // without its filter the listener would get every message on the topic
+    if (filter && strlen(filter) > 0 && rtFilter_Create(&subscription->filter, filter) != RT_OK)
+    {
+      rtLog_Warn("client [%s] sent an invalid filter for %s, not subscribing it. %s", sender->ident,
+        expression, filter);
+      free(subscription);
+      rtMessage_Release(m);
+      return RT_OK;
+    }
+    if (max_rate > 0)
+      rtSubscription_SetMaxRate(subscription, max_rate);
+    subscription->local = local && sender->process[0];
+    rtRouted_AddRoute(rtRouted_ForwardMessage, expression, subscription);
+    if (group && strlen(group) > 0)
+      rtRouted_JoinQueueGroup(group, (rtRouteEntry *) rtVector_At(routes, rtVector_Size(routes) - 1));
+    rtRouted_SendRetained(subscription, expression);
+
+    rtMessage_Release(m);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.UNSUBSCRIBE") == 0)
+  {
+    int32_t route_id = 0;
+
+    rtMessage m;
+    rtMessage_FromBytes(&m, buff, n);
+    rtMessage_GetInt32(m, "route_id", &route_id);
+    if (route_id != 0)
+      rtRouted_ClearSubscription(sender, (uint32_t) route_id);
+    rtMessage_Release(m);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.HELLO") == 0)
+  {
+    char const* inbox = NULL;
+
+    rtMessage m;
+    rtMessage_FromBytes(&m, buff, n);
+    rtMessage_GetString(m, "inbox", &inbox);
+
+    rtSubscription* subscription = (rtSubscription *) malloc(sizeof(rtSubscription));
+    subscription->id = 0;
+    subscription->client = sender;
+    subscription->group = NULL;
+    subscription->filter = NULL;
+    subscription->max_rate = 0;
+    subscription->slots = NULL;
+    subscription->local = 0;
+    rtRouted_AddRoute(rtRouted_ForwardMessage, inbox, subscription);
+
+    rtMessage_Release(m);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.STATS") == 0)
+  {
+    if (rtMessageHeader_IsRequest(hdr))
+      rtRouted_SendStats(sender, hdr);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.INTERN") == 0)
+  {
+    if (rtMessageHeader_IsRequest(hdr))
+      rtRouted_InternTopic(sender, hdr, buff, n);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.DECLARE") == 0)
+  {
+    rtRouted_DeclareTopic(sender, buff, n);
+  }
+  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.LOCAL") == 0)
+  {
+    char const* process = NULL;
+
+    rtMessage m;
+    rtMessage_FromBytes(&m, buff, n);
+    rtMessage_GetString(m, "process", &process);
+    if (process && strlen(process) < sizeof(sender->process))
+      strcpy(sender->process, process);
+    rtMessage_Release(m);
+  }
+  else if (strncmp(hdr->topic, RTMSG_COALESCE_TOPIC_PREFIX, strlen(RTMSG_COALESCE_TOPIC_PREFIX)) == 0)
+  {
+    rtRouted_CompleteCoalescedRequest(sender, hdr, buff, n);
+  }
+  else
+  {
+    rtLog_Debug("no handler for message:%s", hdr->topic);
+  }
+  return RT_OK;
+}
+
+static int
+rtRouted_IsTopicMatch(char const* topic, char const* exp)
+{
+  char const* t = topic;
+  char const* e = exp;
+
+
+  while (*t && *e)
+  {
+    if (*e == '*')
+    {
+      while (*t && *t != '.')
+        t++;
+      e++;
+    }
+
+    if (*e == '>')
+    {
+      while (*t)
+        t++;
+      e++;
+    }
+
+    if (!(*t || *e))
+      break;
+
+    if (*t != *e)
+      break;
+
+    t++;
+    e++;
+  }
+
+  // rtLogInfo("match[%d]: %s <> %s", !(*t || *e), topic, exp);
+  return !(*t || *e);
+}
+
+static int
+rtRouted_IsRetainedTopic(char const* topic)
+{
+  size_t i;
+  size_t n;
+
+  if (strncmp(topic, "_RTROUTED.", 10) == 0)
+    return 0;
+
+  for (i = 0, n = rtVector_Size(retained_topics); i < n; ++i)
+  {
+    if (rtRouted_IsTopicMatch(topic, (char const *) rtVector_At(retained_topics, i)))
+      return 1;
+  }
+  return 0;
+}
+
+static size_t
+rtRetainedMessage_Size(rtRetainedMessage const* msg)
+{
+  return msg->header.header_length + msg->header.payload_length;
+}
+
+static void
+rtRetainedMessage_Destroy(void* p)
+{
+  rtRetainedMessage* msg = (rtRetainedMessage *) p;
+  retained_bytes -= rtRetainedMessage_Size(msg);
+  free(msg->payload);
+  free(msg);
+}
+
+static void
+rtRouted_EvictRetained()
+{
+  // drop least recently updated topics until we're back within budget
+  while (retained_bytes > retained_max_bytes)
+  {
+    size_t i;
+    size_t n;
+    rtRetainedMessage* oldest = NULL;
+
+    for (i = 0, n = rtVector_Size(retained_messages); i < n; ++i)
+    {
+      rtRetainedMessage* msg = (rtRetainedMessage *) rtVector_At(retained_messages, i);
+      if (!oldest || msg->last_update < oldest->last_update)
+        oldest = msg;
+    }
+
+    if (!oldest)
+      break;
+
+    rtLog_Debug("evicting retained message for topic:%s", oldest->header.topic);
+    rtVector_RemoveItem(retained_messages, oldest, rtRetainedMessage_Destroy);
+  }
+}
+
+static void
+rtRouted_RetainMessage(rtMessageHeader const* hdr, uint8_t const* buff, uint32_t n)
+{
+  size_t i;
+  size_t count;
+  uint8_t* payload;
+  rtRetainedMessage* msg;
+
+  if ((size_t) hdr->header_length + n > retained_max_bytes)
+  {
+    rtLog_Debug("message on %s exceeds retained budget, not retaining", hdr->topic);
+    return;
+  }
+
+  payload = (uint8_t *) malloc(n > 0 ? n : 1);
+  if (!payload)
+    return;
+  memcpy(payload, buff, n);
+
+  msg = NULL;
+  for (i = 0, count = rtVector_Size(retained_messages); i < count; ++i)
+  {
+    rtRetainedMessage* item = (rtRetainedMessage *) rtVector_At(retained_messages, i);
+    if (strcmp(item->header.topic, hdr->topic) == 0)
+    {
+      msg = item;
+      break;
+    }
+  }
+
+  if (msg)
+  {
+    retained_bytes -= rtRetainedMessage_Size(msg);
+    free(msg->payload);
+  }
+  else
+  {
+    msg = (rtRetainedMessage *) malloc(sizeof(rtRetainedMessage));
+    if (!msg)
+    {
+      free(payload);
+      return;
+    }
+    rtVector_PushBack(retained_messages, msg);
+  }
+
+  memcpy(&msg->header, hdr, sizeof(rtMessageHeader));
+  msg->header.payload_length = n;
+  msg->payload = payload;
+  msg->last_update = ++retained_clock;
+  retained_bytes += rtRetainedMessage_Size(msg);
+
+  rtRouted_EvictRetained();
+}
+
+static uint64_t
+rtRouted_GetTimeMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int
+rtRouted_IsCoalescedTopic(char const* topic)
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(coalesced_topics); i < n; ++i)
+  {
+    if (rtRouted_IsTopicMatch(topic, (char const *) rtVector_At(coalesced_topics, i)))
+      return 1;
+  }
+  return 0;
+}
+
+static void
+rtCoalescedRequest_Destroy(void* p)
+{
+  rtCoalescedRequest* req = (rtCoalescedRequest *) p;
+  rtVector_Destroy(req->waiters, free);
+  free(req->payload);
+  free(req);
+}
+
+static void
+rtRouted_ExpireCoalescedRequests(uint64_t now)
+{
+  size_t i;
+
+  for (i = 0; i < rtVector_Size(coalesced_requests);)
+  {
+    rtCoalescedRequest* req = (rtCoalescedRequest *) rtVector_At(coalesced_requests, i);
+    if (now - req->start_time >= coalesce_timeout)
+    {
+      rtLog_Debug("coalesced request %u on %s timed out", req->id, req->topic);
+      rtVector_RemoveItem(coalesced_requests, req, rtCoalescedRequest_Destroy);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+/**
+ * Parks a request behind an identical one that is already in flight. If there
+ * isn't one, the request becomes the leader. Its reply topic is rewritten so
+ * the response comes back to the router and can be fanned out to every waiter.
+ * @return 1 if the request was parked and must not be forwarded
+ */
+static int
+rtRouted_CoalesceRequest(rtMessageHeader* hdr, uint8_t const* buff, rtCoalescedRequest** leader)
+{
+  size_t i;
+  size_t n;
+  uint64_t now;
+  rtCoalescedWaiter* waiter;
+  rtCoalescedRequest* req;
+
+  now = rtRouted_GetTimeMillis();
+  rtRouted_ExpireCoalescedRequests(now);
+
+  req = NULL;
+  for (i = 0, n = rtVector_Size(coalesced_requests); i < n; ++i)
+  {
+    rtCoalescedRequest* item = (rtCoalescedRequest *) rtVector_At(coalesced_requests, i);
+    if (item->payload_length == hdr->payload_length &&
+        strcmp(item->topic, hdr->topic) == 0 &&
+        memcmp(item->payload, buff, hdr->payload_length) == 0)
+    {
+      req = item;
+      break;
+    }
+  }
+
+  waiter = (rtCoalescedWaiter *) malloc(sizeof(rtCoalescedWaiter));
+  if (!waiter)
+    return 0;
+  strcpy(waiter->reply_topic, hdr->reply_topic);
+  waiter->sequence_number = hdr->sequence_number;
+
+  if (req)
+  {
+    rtLog_Debug("parking request on %s behind in-flight request %u", hdr->topic, req->id);
+    rtVector_PushBack(req->waiters, waiter);
+    return 1;
+  }
+
+  req = (rtCoalescedRequest *) malloc(sizeof(rtCoalescedRequest));
+  if (req)
+    req->payload = (uint8_t *) malloc(hdr->payload_length > 0 ? hdr->payload_length : 1);
+  if (!req || !req->payload)
+  {
+    free(req);
+    free(waiter);
+    return 0;
+  }
+
+  req->id = coalesce_next_id++;
+  strcpy(req->topic, hdr->topic);
+  memcpy(req->payload, buff, hdr->payload_length);
+  req->payload_length = hdr->payload_length;
+  req->start_time = now;
+  rtVector_Create(&req->waiters);
+  rtVector_PushBack(req->waiters, waiter);
+  rtVector_PushBack(coalesced_requests, req);
+
+  snprintf(hdr->reply_topic, RTMSG_HEADER_MAX_TOPIC_LENGTH, "%s%u", RTMSG_COALESCE_TOPIC_PREFIX, req->id);
+  hdr->reply_topic_length = strlen(hdr->reply_topic);
+
+  *leader = req;
+  return 0;
+}
+
+static void
+rtRouted_CompleteCoalescedRequest(rtConnectedClient* sender, rtMessageHeader* hdr,
+  uint8_t const* buff, int n)
+{
+  size_t i;
+  size_t count;
+  uint32_t id;
+  rtCoalescedRequest* req;
+
+  if (!(hdr->flags & rtMessageFlags_Response))
+    return;
+
+  id = (uint32_t) strtoul(hdr->topic + strlen(RTMSG_COALESCE_TOPIC_PREFIX), NULL, 10);
+
+  req = NULL;
+  for (i = 0, count = rtVector_Size(coalesced_requests); i < count; ++i)
+  {
+    rtCoalescedRequest* item = (rtCoalescedRequest *) rtVector_At(coalesced_requests, i);
+    if (item->id == id)
+    {
+      req = item;
+      break;
+    }
+  }
+
+  if (!req)
+  {
+    rtLog_Debug("response for unknown coalesced request %u", id);
+    return;
+  }
+
+  // the request is done, it must not take new waiters while the response is
+  // being fanned out
+  rtVector_RemoveItem(coalesced_requests, req, NULL);
+
+  for (i = 0, count = rtVector_Size(req->waiters); i < count; ++i)
+  {
+    rtMessageHeader res;
+    rtCoalescedWaiter* waiter = (rtCoalescedWaiter *) rtVector_At(req->waiters, i);
+
+    // only the header differs per requester. The payload is written from
+    // buff, a requester only gets its own copy when the frame is queued for
+    // it, see rtConnectedClient_Send
+    memcpy(&res, hdr, sizeof(rtMessageHeader));
+    strcpy(res.topic, waiter->reply_topic);
+    res.topic_length = strlen(res.topic);
+    res.sequence_number = waiter->sequence_number;
+    rtRouted_RouteMessage(sender, &res, buff, n);
+  }
+
+  rtLog_Debug("coalesced request %u answered %d requests", req->id, (int) count);
+  rtCoalescedRequest_Destroy(req);
+}
+
+static void
+rtRouted_SendRetained(rtSubscription* subscription, char const* expression)
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(retained_messages); i < n; ++i)
+  {
+    rtRetainedMessage* msg = (rtRetainedMessage *) rtVector_At(retained_messages, i);
+    if (rtRouted_IsTopicMatch(msg->header.topic, expression) &&
+        rtFilter_Match(subscription->filter, msg->payload, msg->header.payload_length))
+    {
+      rtLog_Debug("sending retained message %s to client [%s]", msg->header.topic,
+        subscription->client->ident);
+      if (rtRouted_ForwardMessage(NULL, &msg->header, msg->payload, msg->header.payload_length,
+            subscription) != RT_OK)
+        break;
+    }
+  }
+}
+
+static void
+rtConnectedClient_Init(rtConnectedClient* clnt, int fd, struct sockaddr_storage* remote_endpoint)
+{
+  clnt->fd = fd;
+  clnt->state = rtConnectionState_ReadHeaderPreamble;
+  clnt->bytes_read = 0;
+  clnt->bytes_to_read = 4;
+  clnt->outstanding_requests = 0;
+  clnt->partial_frame = NULL;
+  clnt->outbound_bytes = 0;
+  clnt->pending_input = NULL;
+  clnt->pending_input_length = 0;
+  clnt->dirty = 0;
+  clnt->buckets = NULL;
+  clnt->resume_time = 0;
+  clnt->rate_limited = 0;
+  clnt->topic_id = 0;
+  clnt->multiple_subscriptions = 0;
+  rtVector_Create(&clnt->declared_topics);
+  clnt->interest_inbox[0] = '\0';
+  clnt->process[0] = '\0';
+  memset(clnt->outbound, 0, sizeof(clnt->outbound));
+#ifdef RTROUTED_USE_IO_URING
+  clnt->closing = 0;
+  clnt->ops_inflight = 0;
+  clnt->recv_armed = 0;
+  clnt->recv_cancelled = 0;
+  clnt->send_inflight = 0;
+  clnt->send_count = 0;
+#endif
+  clnt->read_buffer = (uint8_t *) malloc(RTMSG_CLIENT_READ_BUFFER_SIZE);
+  clnt->read_buffer_size = RTMSG_CLIENT_READ_BUFFER_SIZE;
+  clnt->send_buffer = (uint8_t *) malloc(RTMSG_CLIENT_READ_BUFFER_SIZE);
+  memcpy(&clnt->endpoint, remote_endpoint, sizeof(struct sockaddr_storage));
+  memset(clnt->read_buffer, 0, RTMSG_CLIENT_READ_BUFFER_SIZE);
+  memset(clnt->send_buffer, 0, RTMSG_CLIENT_READ_BUFFER_SIZE);
+  rtMessageHeader_Init(&clnt->header);
+}
+
+static int
+rtRouted_QueueGroupExists(rtQueueGroup const* group)
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(queue_groups); i < n; ++i)
+  {
+    if (rtVector_At(queue_groups, i) == group)
+      return 1;
+  }
+  return 0;
+}
+
+static rtRouteEntry*
+rtRouted_SelectQueueGroupMember(rtQueueGroup* group)
+{
+  size_t i;
+  size_t n;
+  rtRouteEntry* selected;
+
+  n = rtVector_Size(group->members);
+  if (n == 0)
+    return NULL;
+
+  selected = (rtRouteEntry *) rtVector_At(group->members, group->next_member % n);
+  if (queue_group_policy == rtQueueGroupPolicy_LeastOutstanding)
+  {
+    // start at the round-robin position so ties are spread across members
+    for (i = 1; i < n; ++i)
+    {
+      rtRouteEntry* route = (rtRouteEntry *) rtVector_At(group->members, (group->next_member + i) % n);
+      if (route->subscription->client->outstanding_requests <
+          selected->subscription->client->outstanding_requests)
+        selected = route;
+    }
+  }
+
+  group->next_member = (group->next_member + 1) % n;
+  return selected;
+}
+
+static void
+rtRouted_DeliverToQueueGroup(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff,
+  int n, rtQueueGroup* group)
+{
+  rtError err;
+  rtRouteEntry* route;
+  rtConnectedClient* member;
+
+  // a member whose socket has gone away leaves the group, try the next one.
+  // the group is freed when its last member leaves
+  do
+  {
+    route = rtRouted_SelectQueueGroupMember(group);
+    if (!route)
+      break;
+
+    member = route->subscription->client;
+    err = route->message_handler(sender, hdr, buff, n, route->subscription);
+    if (err == RT_OK && rtMessageHeader_IsRequest(hdr))
+      member->outstanding_requests++;
+    if (err == rtErrorFromErrno(EBADF))
+    {
+      rtRouted_ClearClientRoutes(member);
+      if (!rtRouted_QueueGroupExists(group))
+        break;
+    }
+  }
+  while (err == rtErrorFromErrno(EBADF));
+}
+
+/**
+ * Adds a subscription to the frame going to its client.
+ * @return zero when the frame or the table is full, the subscription then
+ * gets a frame of its own
+ */
+static int
+rtRouted_AddDelivery(rtClientDelivery* deliveries, size_t* num_deliveries, rtSubscription* subscription)
+{
+  size_t i;
+
+  for (i = 0; i < *num_deliveries; ++i)
+  {
+    if (deliveries[i].client == subscription->client)
+    {
+      if (deliveries[i].num_ids > RTMSG_HEADER_MAX_SUBSCRIPTIONS)
+        return 0;
+      deliveries[i].ids[deliveries[i].num_ids++] = subscription->id;
+      return 1;
+    }
+  }
+
+  if (*num_deliveries >= RTMSG_MAX_CLIENTS_PER_MESSAGE)
+    return 0;
+
+  deliveries[*num_deliveries].client = subscription->client;
+  deliveries[*num_deliveries].ids[0] = subscription->id;
+  deliveries[*num_deliveries].num_ids = 1;
+  (*num_deliveries)++;
+  return 1;
+}
+
+static int
+rtRouted_RouteMessage(rtConnectedClient* sender, rtMessageHeader* hdr, uint8_t const* buff, int n)
+{
+  size_t i;
+  size_t j;
+  size_t num_groups;
+  size_t num_deliveries;
+  rtQueueGroup* groups[RTMSG_MAX_GROUPS_PER_MESSAGE];
+  rtClientDelivery deliveries[RTMSG_MAX_CLIENTS_PER_MESSAGE];
+  int match_found = 0;
+
+  num_groups = 0;
+  num_deliveries = 0;
+
+  for (i = 0; i < rtVector_Size(routes);)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (rtRouted_IsTopicMatch(hdr->topic, route->expression))
+    {
+      rtError err;
+
+      match_found = 1;
+
+      // the publisher's process already handed it to this subscriber
+      if (route->subscription && rtRouted_IsDeliveredLocally(sender, hdr->flags, route->subscription))
+      {
+        i++;
+        continue;
+      }
+
+      if (route->subscription && !rtFilter_Match(route->subscription->filter, buff, n))
+      {
+        i++;
+        continue;
+      }
+
+      // latest value wins, whatever doesn't fit the subscriber's rate waits
+      // in its slot for the topic
+      if (route->subscription && route->subscription->slots && !route->subscription->group &&
+          !(hdr->flags & (rtMessageFlags_Request | rtMessageFlags_Response)))
+      {
+        rtRouted_ConflateMessage(hdr, buff, n, route->subscription);
+        i++;
+        continue;
+      }
+
+      // queue groups get exactly one delivery, once all routes have been matched
+      if (route->subscription && route->subscription->group)
+      {
+        rtQueueGroup* group = route->subscription->group;
+        for (j = 0; j < num_groups; ++j)
+        {
+          if (groups[j] == group)
+            break;
+        }
+        if (j == num_groups)
+        {
+          if (num_groups < RTMSG_MAX_GROUPS_PER_MESSAGE)
+            groups[num_groups++] = group;
+          else
+            rtLog_Warn("too many queue groups match %s, dropping delivery to %s", hdr->topic, group->name);
+        }
+        i++;
+        continue;
+      }
+
+      // a client that can take several subscription ids per frame gets one
+      // frame, sent once all routes have been matched
+      if (route->message_handler == rtRouted_ForwardMessage &&
+          route->subscription->client->multiple_subscriptions &&
+          rtRouted_AddDelivery(deliveries, &num_deliveries, route->subscription))
+      {
+        i++;
+        continue;
+      }
+
+      err = route->message_handler(sender, hdr, buff, n, route->subscription);
+
+      // the subscriber's socket is gone, its routes are removed and the
+      // route now at index i hasn't been looked at yet
+      if (err == rtErrorFromErrno(EBADF) && route->subscription)
+      {
+        rtRouted_ClearClientRoutes(route->subscription->client);
+        continue;
+      }
+    }
+    i++;
+  }
+
+  for (j = 0; j < num_deliveries; ++j)
+  {
+    rtError err = rtRouted_ForwardToClient(deliveries[j].client, hdr, buff, n, deliveries[j].ids,
+      deliveries[j].num_ids);
+    if (err == rtErrorFromErrno(EBADF))
+      rtRouted_ClearClientRoutes(deliveries[j].client);
+  }
+
+  for (j = 0; j < num_groups; ++j)
+  {
+    // an earlier delivery may have emptied and freed this group
+    if (rtRouted_QueueGroupExists(groups[j]))
+      rtRouted_DeliverToQueueGroup(sender, hdr, buff, n, groups[j]);
+  }
+
+  return match_found;
+}
+
+static void
+rtRouter_DispatchMessageFromClient(rtConnectedClient* clnt)
+{
+  int match_found;
+  rtCoalescedRequest* coalesced;
+  uint8_t const* payload;
+
+  coalesced = NULL;
+  payload = clnt->read_buffer + clnt->header.header_length;
+
+  if ((clnt->header.flags & rtMessageFlags_Response) && clnt->outstanding_requests > 0)
+    clnt->outstanding_requests--;
+
+  if (!(clnt->header.flags & (rtMessageFlags_Request | rtMessageFlags_Response)) &&
+      rtRouted_IsRetainedTopic(clnt->header.topic))
+  {
+    rtRouted_RetainMessage(&clnt->header, payload, clnt->header.payload_length);
+  }
+
+  if (rtMessageHeader_IsRequest(&clnt->header) && rtRouted_IsCoalescedTopic(clnt->header.topic))
+  {
+    // an identical request is already with the provider
+    if (rtRouted_CoalesceRequest(&clnt->header, payload, &coalesced))
+      return;
+  }
+
+  match_found = rtRouted_RouteMessage(clnt, &clnt->header, payload, clnt->header.payload_length);
+
+  int is_request = rtMessageHeader_IsRequest(&clnt->header);
+  if (!match_found && is_request)
+  {
+    if (coalesced)
+    {
+      rtCoalescedWaiter* waiter = (rtCoalescedWaiter *) rtVector_At(coalesced->waiters, 0);
+      strcpy(clnt->header.reply_topic, waiter->reply_topic);
+      clnt->header.reply_topic_length = strlen(clnt->header.reply_topic);
+      rtVector_RemoveItem(coalesced_requests, coalesced, rtCoalescedRequest_Destroy);
+    }
+
+    // TODO: If this is a request, then send message directly back
+    // to caller
+    rtLog_Error("no client found for match:%s", clnt->header.topic);
+    //No route Found , Returning a Error Message to caller
+    rtRouted_SendErrorMessageToCaller(clnt, &clnt->header);
+  }
+}
+
+/**
+ * Takes a token from every bucket of this client whose limit matches the
+ * message, but only when all of them have one. Otherwise nothing is taken
+ * and the most severe action of the exhausted limits is returned.
+ */
+static rtRateLimitAction
+rtRouted_CheckRateLimits(rtConnectedClient* clnt, uint64_t* wait)
+{
+  size_t i;
+  size_t n;
+  uint64_t now;
+  rtRateLimitAction action;
+
+  *wait = 0;
+  n = rtVector_Size(rate_limits);
+  if (n == 0 || strncmp(clnt->header.topic, "_RTROUTED.", 10) == 0)
+    return rtRateLimitAction_None;
+
+  now = rtRouted_GetTimeMillis();
+  if (!clnt->buckets)
+  {
+    clnt->buckets = (rtTokenBucket *) malloc(sizeof(rtTokenBucket) * n);
+    if (!clnt->buckets)
+      return rtRateLimitAction_None;
+    for (i = 0; i < n; ++i)
+    {
+      clnt->buckets[i].tokens = ((rtRateLimit *) rtVector_At(rate_limits, i))->burst;
+      clnt->buckets[i].last_refill = now;
+    }
+  }
+
+  action = rtRateLimitAction_None;
+  for (i = 0; i < n; ++i)
+  {
+    rtRateLimit* limit = (rtRateLimit *) rtVector_At(rate_limits, i);
+    rtTokenBucket* bucket = &clnt->buckets[i];
+
+    if (!rtRouted_IsTopicMatch(clnt->header.topic, limit->expression))
+      continue;
+
+    bucket->tokens += (now - bucket->last_refill) * limit->rate / 1000.0;
+    if (bucket->tokens > limit->burst)
+      bucket->tokens = limit->burst;
+    bucket->last_refill = now;
+
+    if (bucket->tokens >= 1.0)
+      continue;
+
+    if (limit->action > action)
+      action = limit->action;
+
+    if (limit->action == rtRateLimitAction_Delay)
+    {
+      uint64_t ms = (uint64_t) ((1.0 - bucket->tokens) * 1000.0 / limit->rate) + 1;
+      if (ms > *wait)
+        *wait = ms;
+    }
+  }
+
+  if (action == rtRateLimitAction_None)
+  {
+    for (i = 0; i < n; ++i)
+    {
+      if (rtRouted_IsTopicMatch(clnt->header.topic, ((rtRateLimit *) rtVector_At(rate_limits, i))->expression))
+        clnt->buckets[i].tokens -= 1.0;
+    }
+  }
+
+  return action;
+}
+
+/**
+ * Dispatches the frame sitting in the client's read buffer, subject to rate
+ * limits. A delayed frame stays in the buffer and nothing more is read from
+ * the client until resume_time, when this is called again.
+ */
+/**
+ * Grows the read buffer to take a frame of the given size, up to
+ * max_message_size.
+ */
+static rtError
+rtConnectedClient_ReserveReadBuffer(rtConnectedClient* clnt, int size)
+{
+  uint8_t* p;
+
+  if (size <= clnt->read_buffer_size)
+    return RT_OK;
+  if ((uint32_t) size > max_message_size)
+    return RT_ERROR_PROTOCOL_ERROR;
+
+  p = (uint8_t *) realloc(clnt->read_buffer, size);
+  if (!p)
+    return rtErrorFromErrno(ENOMEM);
+  clnt->read_buffer = p;
+  clnt->read_buffer_size = size;
+  return RT_OK;
+}
+
+/**
+ * Gets ready for the next frame. A read buffer grown for a large message is
+ * given back.
+ */
+static void
+rtConnectedClient_ResetRead(rtConnectedClient* clnt)
+{
+  uint8_t* p;
+
+  if (clnt->read_buffer_size > RTMSG_CLIENT_READ_BUFFER_SIZE)
+  {
+    p = (uint8_t *) realloc(clnt->read_buffer, RTMSG_CLIENT_READ_BUFFER_SIZE);
+    if (p)
+    {
+      clnt->read_buffer = p;
+      clnt->read_buffer_size = RTMSG_CLIENT_READ_BUFFER_SIZE;
+    }
+  }
+
+  clnt->bytes_to_read = 4;
+  clnt->bytes_read = 0;
+  clnt->state = rtConnectionState_ReadHeaderPreamble;
+  rtMessageHeader_Init(&clnt->header);
+}
+
+static rtError
+rtConnectedClient_ProcessFrame(rtConnectedClient* clnt)
+{
+  uint64_t wait;
+
+  switch (rtRouted_CheckRateLimits(clnt, &wait))
+  {
+    case rtRateLimitAction_None:
+      rtRouter_DispatchMessageFromClient(clnt);
+      break;
+
+    case rtRateLimitAction_Drop:
+      rtLog_Debug("client [%s] over rate limit, dropping message on %s", clnt->ident, clnt->header.topic);
+      stats.rate_limit_dropped++;
+      clnt->rate_limited++;
+      break;
+
+    case rtRateLimitAction_Delay:
+      if (clnt->resume_time == 0)
+      {
+        stats.rate_limit_delayed++;
+        clnt->rate_limited++;
+      }
+      clnt->resume_time = rtRouted_GetTimeMillis() + wait;
+      return RT_OK;
+
+    case rtRateLimitAction_Disconnect:
+      rtLog_Warn("client [%s] over rate limit on %s, disconnecting", clnt->ident, clnt->header.topic);
+      stats.rate_limit_disconnects++;
+      return RT_FAIL;
+  }
+
+  clnt->resume_time = 0;
+  rtConnectedClient_ResetRead(clnt);
+  return RT_OK;
+}
+
+/**
+ * Decodes the header of the frame in the read buffer. An interned topic is
+ * looked up by id, from here on the frame is handled like any other.
+ */
+static void
+rtConnectedClient_DecodeHeader(rtConnectedClient* clnt)
+{
+  char const* topic;
+
+  rtMessageHeader_Decode(&clnt->header, clnt->read_buffer);
+
+  // only the router lists subscriptions
+  clnt->header.flags &= ~rtMessageFlags_MultipleSubscriptions;
+
+  clnt->topic_id = 0;
+  if (clnt->header.flags & rtMessageFlags_InternedTopic)
+  {
+    clnt->topic_id = clnt->header.control_data;
+    topic = (char const *) rtVector_At(interned_topics, clnt->topic_id - 1);
+    if (topic)
+    {
+      strcpy(clnt->header.topic, topic);
+      clnt->header.topic_length = strlen(topic);
+    }
+    else
+    {
+      rtLog_Warn("client [%s] sent unknown topic id %u", clnt->ident, clnt->topic_id);
+    }
+    clnt->header.flags &= ~rtMessageFlags_InternedTopic;
+    clnt->header.control_data = 0;
+  }
+}
+
+/**
+ * Captures the frame in the read buffer. Frames sent with an interned topic
+ * are written with the topic string so captures replay against any router.
+ */
+static void
+rtConnectedClient_CaptureFrame(rtConnectedClient* clnt)
+{
+  uint8_t* frame;
+  uint32_t payload_offset;
+  rtMessageHeader header;
+
+  if (clnt->topic_id == 0)
+  {
+    rtRouted_CaptureFrame(clnt->read_buffer, clnt->bytes_read);
+    return;
+  }
+
+  payload_offset = clnt->header.header_length;
+  frame = (uint8_t *) malloc(28 + (2 * RTMSG_HEADER_MAX_TOPIC_LENGTH) + clnt->header.payload_length);
+  if (!frame)
+    return;
+
+  memcpy(&header, &clnt->header, sizeof(rtMessageHeader));
+  rtMessageHeader_Encode(&header, frame);
+  memcpy(frame + header.header_length, clnt->read_buffer + payload_offset, header.payload_length);
+  rtRouted_CaptureFrame(frame, header.header_length + header.payload_length);
+  free(frame);
+}
+
+/**
+ * Moves the read state machine on after bytes were added to the read buffer
+ * and dispatches the frame once it is complete.
+ */
+static rtError
+rtConnectedClient_Advance(rtConnectedClient* clnt, int* frame_done)
+{
+  rtError err;
+
+  *frame_done = 0;
+
+  switch (clnt->state)
+  {
+    case rtConnectionState_ReadHeaderPreamble:
+    {
+      // read version/length of header
+      if (clnt->bytes_read == clnt->bytes_to_read)
+      {
+        uint8_t const* itr = &clnt->read_buffer[2];
+        uint16_t header_length = 0;
+        rtEncoder_DecodeUInt16(&itr, &header_length);
+        clnt->bytes_to_read += (header_length - 4);
+        clnt->state = rtConnectionState_ReadHeader;
+      }
+    }
+    break;
+
+    case rtConnectionState_ReadHeader:
+    {
+      if (clnt->bytes_read == clnt->bytes_to_read)
+      {
+        rtConnectedClient_DecodeHeader(clnt);
+        if ((uint64_t) clnt->bytes_to_read + clnt->header.payload_length <= max_message_size)
+        {
+          clnt->bytes_to_read += clnt->header.payload_length;
+          clnt->state = rtConnectionState_ReadPayload;
+        }
+        else if (clnt->header.payload_length <= INT32_MAX)
+        {
+          // the payload is read past without keeping it, the client stays
+          rtLog_Warn("client [%s] sent a %u byte message on %s, more than the %u bytes allowed, "
+            "dropping it", clnt->ident, clnt->header.payload_length, clnt->header.topic, max_message_size);
+          clnt->bytes_to_read = (int) clnt->header.payload_length;
+          clnt->bytes_read = 0;
+          clnt->state = rtConnectionState_DiscardPayload;
+        }
+        else
+        {
+          rtLog_Error("client [%s] sent a %u byte payload", clnt->ident, clnt->header.payload_length);
+          return RT_ERROR_PROTOCOL_ERROR;
+        }
+      }
+    }
+    break;
+
+    case rtConnectionState_ReadPayload:
+    case rtConnectionState_DiscardPayload:
+    break;
+  }
+
+  if (clnt->state == rtConnectionState_DiscardPayload)
+  {
+    if (clnt->bytes_read == clnt->bytes_to_read)
+    {
+      rtConnectedClient_ResetRead(clnt);
+      *frame_done = 1;
+    }
+    return RT_OK;
+  }
+
+  // a header too large to take leaves no telling where the next frame starts
+  err = rtConnectedClient_ReserveReadBuffer(clnt, clnt->bytes_to_read);
+  if (err != RT_OK)
+  {
+    rtLog_Error("can't take a %d byte frame from client [%s]. %s", clnt->bytes_to_read, clnt->ident,
+      rtStrError(err));
+    return err;
+  }
+
+  // checked outside the switch, a message with an empty payload is
+  // complete as soon as its header is in
+  if (clnt->state == rtConnectionState_ReadPayload && clnt->bytes_read == clnt->bytes_to_read)
+  {
+    if (capture)
+      rtConnectedClient_CaptureFrame(clnt);
+    stats.messages_received++;
+    *frame_done = 1;
+    return rtConnectedClient_ProcessFrame(clnt);
+  }
+
+  return RT_OK;
+}
+
+static rtError
+rtConnectedClient_Read(rtConnectedClient* clnt)
+{
+  int flags;
+  int frame_done;
+  int num_frames;
+  ssize_t bytes_read;
+  rtError err;
+
+  flags = MSG_NOSIGNAL;
+  num_frames = 0;
+
+  // keep reading while the socket has data, a burst from one client is then
+  // dispatched in a single pass and its deliveries can be written together
+  while (1)
+  {
+    int offset = clnt->bytes_read;
+    int bytes_to_read = (clnt->bytes_to_read - clnt->bytes_read);
+
+    // a payload that's being dropped is read over the start of the buffer
+    if (clnt->state == rtConnectionState_DiscardPayload)
+    {
+      offset = 0;
+      if (bytes_to_read > clnt->read_buffer_size)
+        bytes_to_read = clnt->read_buffer_size;
+    }
+
+    bytes_read = recv(clnt->fd, &clnt->read_buffer[offset], bytes_to_read, flags);
+    if (bytes_read == -1)
+    {
+      if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return RT_OK;
+
+      rtError e = rtErrorFromErrno(errno);
+      rtLog_Warn("read:%s", rtStrError(e));
+      return e;
+    }
+
+    if (bytes_read == 0)
+    {
+      rtLog_Debug("read zero bytes, stream closed");
+      return RT_ERROR_STREAM_CLOSED;
+    }
+
+    clnt->bytes_read += bytes_read;
+
+    err = rtConnectedClient_Advance(clnt, &frame_done);
+    if (err != RT_OK)
+      return err;
+
+    if (frame_done && (clnt->resume_time != 0 || ++num_frames >= RTMSG_MAX_FRAMES_PER_READ))
+      return RT_OK;
+
+    flags |= MSG_DONTWAIT;
+  }
+
+  return RT_OK;
+}
+
+/**
+ * Feeds bytes that were read from the client's socket by other means through
+ * the read state machine. Whatever is left over when a frame is held back by a
+ * rate limit is kept as pending input until the client resumes.
+ */
+static rtError
+rtConnectedClient_Consume(rtConnectedClient* clnt, uint8_t const* p, size_t n)
+{
+  int frame_done;
+  size_t take;
+  uint8_t* pending;
+  rtError err;
+
+  while (n > 0 && clnt->resume_time == 0)
+  {
+    take = clnt->bytes_to_read - clnt->bytes_read;
+    if (take > n)
+      take = n;
+
+    if (clnt->state != rtConnectionState_DiscardPayload)
+      memcpy(clnt->read_buffer + clnt->bytes_read, p, take);
+    clnt->bytes_read += take;
+    p += take;
+    n -= take;
+
+    err = rtConnectedClient_Advance(clnt, &frame_done);
+    if (err != RT_OK)
+      return err;
+  }
+
+  if (n > 0)
+  {
+    pending = (uint8_t *) realloc(clnt->pending_input, clnt->pending_input_length + n);
+    if (!pending)
+      return rtErrorFromErrno(ENOMEM);
+    memcpy(pending + clnt->pending_input_length, p, n);
+    clnt->pending_input = pending;
+    clnt->pending_input_length += n;
+  }
+
+  return RT_OK;
+}
+
+static rtError
+rtConnectedClient_DrainPendingInput(rtConnectedClient* clnt)
+{
+  size_t n;
+  uint8_t* p;
+  rtError err;
+
+  // anything still left goes back into a fresh pending buffer
+  p = clnt->pending_input;
+  n = clnt->pending_input_length;
+  clnt->pending_input = NULL;
+  clnt->pending_input_length = 0;
+
+  err = rtConnectedClient_Consume(clnt, p, n);
+  free(p);
+  return err;
+}
+
+static void
+rtRouted_ResumeDelayedClients()
+{
+  size_t i;
+  uint64_t now;
+
+  now = rtRouted_GetTimeMillis();
+  for (i = 0; i < rtVector_Size(clients);)
+  {
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+    if (clnt->resume_time != 0 && clnt->resume_time <= now)
+    {
+      rtError err = RT_OK;
+
+      // a client handed over with pending input may not have a frame held
+      if (clnt->state == rtConnectionState_ReadPayload && clnt->bytes_read == clnt->bytes_to_read)
+        err = rtConnectedClient_ProcessFrame(clnt);
+      else
+        clnt->resume_time = 0;
+
+      if (err == RT_OK && clnt->resume_time == 0 && clnt->pending_input_length > 0)
+        err = rtConnectedClient_DrainPendingInput(clnt);
+
+      if (err != RT_OK)
+      {
+        rtRouted_DropClient(clnt);
+        continue;
+      }
+    }
+    i++;
+  }
+}
+
+static void
+rtRouted_PushFd(fd_set* fds, int fd, int* maxFd)
+{
+  if (fd != RTMSG_INVALID_FD)
+  {
+    FD_SET(fd, fds);
+    if (maxFd && fd > *maxFd)
+      *maxFd = fd;
+  }
+}
+
+static void
+rtRouted_RegisterNewClient(int fd, struct sockaddr_storage* remote_endpoint)
+{
+  char remote_address[64];
+  uint16_t remote_port;
+  rtConnectedClient* new_client;
+
+  remote_address[0] = '\0';
+  remote_port = 0;
+  new_client = (rtConnectedClient *) malloc(sizeof(rtConnectedClient));
+  new_client->fd = -1;
+
+  rtConnectedClient_Init(new_client, fd, remote_endpoint);
+  rtSocketStorage_ToString(&new_client->endpoint, remote_address, sizeof(remote_address), &remote_port);
+  snprintf(new_client->ident, RTMSG_ADDR_MAX, "%s:%d/%d", remote_address, remote_port, fd);
+  rtVector_PushBack(clients, new_client);
+
+  rtLog_Debug("new client:%s", new_client->ident);
+}
+
+static void
+rtRouted_AcceptClientConnection(rtListener* listener)
+{
+  int                       fd;
+  socklen_t                 socket_length;
+  struct sockaddr_storage   remote_endpoint;
+
+  socket_length = sizeof(struct sockaddr_storage);
+  memset(&remote_endpoint, 0, sizeof(struct sockaddr_storage));
+
+  fd = accept(listener->fd, (struct sockaddr *)&remote_endpoint, &socket_length);
+  if (fd == -1)
+  {
+    rtLog_Warn("accept:%s", rtStrError(errno));
+    return;
+  }
+
+  rtRouted_RegisterNewClient(fd, &remote_endpoint);
+}
+
+rtError
+rtRouted_BindListener(char const* socket_name, int no_delay)
+{
+  int ret;
+  rtError err;
+  socklen_t socket_length;
+  rtListener* listener;
+
+  listener = (rtListener *) malloc(sizeof(rtListener));
+  listener->fd = -1;
+  memset(&listener->local_endpoint, 0, sizeof(struct sockaddr_storage));
+
+  err = rtSocketStorage_FromString(&listener->local_endpoint, socket_name);
+  if (err != RT_OK)
+    return err;
+
+  rtLog_Debug("binding listener:%s", socket_name);
+
+  listener->fd = socket(listener->local_endpoint.ss_family, SOCK_STREAM, 0);
+  if (listener->fd == -1)
+  {
+    rtLog_Fatal("socket:%s", rtStrError(errno));
+    exit(1);
+  }
+
+  rtSocketStorage_GetLength(&listener->local_endpoint, &socket_length);
+
+  if (listener->local_endpoint.ss_family != AF_UNIX)
+  {
+    uint32_t one = 1;
+    if (no_delay)
+      setsockopt(listener->fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ret = setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+  }
+
+  ret = bind(listener->fd, (struct sockaddr *)&listener->local_endpoint, socket_length);
+  if (ret == -1)
+  {
+    rtError err = rtErrorFromErrno(errno);
+    rtLog_Warn("failed to bind socket. %s", rtStrError(err));
+    exit(1);
+  }
+
+  ret = listen(listener->fd, 4);
+  if (ret == -1)
+  {
+    rtLog_Warn("failed to set socket to listen mode. %s", rtStrError(errno));
+    exit(1);
+  }
+
+  rtVector_PushBack(listeners, listener);
+  return RT_OK;
+}
+
+static void
+rtHandoffBuffer_Reserve(rtHandoffBuffer* buff, size_t n)
+{
+  uint8_t* p;
+  size_t capacity;
+
+  if (buff->failed || buff->length + n <= buff->capacity)
+    return;
+
+  capacity = buff->capacity > 0 ? buff->capacity : 4096;
+  while (buff->length + n > capacity)
+    capacity *= 2;
+
+  p = (uint8_t *) realloc(buff->data, capacity);
+  if (!p)
+  {
+    buff->failed = 1;
+    return;
+  }
+  buff->data = p;
+  buff->capacity = capacity;
+}
+
+static void
+rtHandoffBuffer_PutRaw(rtHandoffBuffer* buff, void const* p, uint32_t n)
+{
+  rtHandoffBuffer_Reserve(buff, n);
+  if (buff->failed || n == 0)
+    return;
+  memcpy(buff->data + buff->length, p, n);
+  buff->length += n;
+}
+
+static void
+rtHandoffBuffer_PutUInt32(rtHandoffBuffer* buff, uint32_t n)
+{
+  uint8_t* p;
+
+  rtHandoffBuffer_Reserve(buff, 4);
+  if (buff->failed)
+    return;
+  p = buff->data + buff->length;
+  rtEncoder_EncodeUInt32(&p, n);
+  buff->length += 4;
+}
+
+static void
+rtHandoffBuffer_PutBytes(rtHandoffBuffer* buff, void const* p, uint32_t n)
+{
+  rtHandoffBuffer_PutUInt32(buff, n);
+  rtHandoffBuffer_PutRaw(buff, p, n);
+}
+
+static void
+rtHandoffBuffer_PutString(rtHandoffBuffer* buff, char const* s)
+{
+  rtHandoffBuffer_PutBytes(buff, s, strlen(s));
+}
+
+static uint32_t
+rtHandoffBuffer_GetUInt32(rtHandoffBuffer* buff)
+{
+  uint32_t n;
+  uint8_t const* p;
+
+  n = 0;
+  if (buff->failed || buff->offset + 4 > buff->length)
+  {
+    buff->failed = 1;
+    return 0;
+  }
+  p = buff->data + buff->offset;
+  rtEncoder_DecodeUInt32(&p, &n);
+  buff->offset += 4;
+  return n;
+}
+
+static uint8_t const*
+rtHandoffBuffer_GetBytes(rtHandoffBuffer* buff, uint32_t* n)
+{
+  uint8_t const* p;
+
+  *n = rtHandoffBuffer_GetUInt32(buff);
+  if (buff->failed || buff->offset + *n > buff->length)
   {
-    char const* expression = NULL;
-    int32_t route_id = 0;
+    buff->failed = 1;
+    *n = 0;
+    return NULL;
+  }
+  p = buff->data + buff->offset;
+  buff->offset += *n;
+  return p;
+}
 
-    rtMessage m;
-    rtMessage_FromBytes(&m, buff, n);
-    rtMessage_GetString(m, "topic", &expression);
-    rtMessage_GetInt32(m, "route_id", &route_id);
+static void
+rtHandoffBuffer_GetString(rtHandoffBuffer* buff, char* s, size_t max)
+{
+  uint32_t n;
+  uint8_t const* p;
+
+  s[0] = '\0';
+  p = rtHandoffBuffer_GetBytes(buff, &n);
+  if (!p || n >= max)
+  {
+    buff->failed = 1;
+    return;
+  }
+  memcpy(s, p, n);
+  s[n] = '\0';
+}
+
+static int
+rtRouted_ClientIndex(rtConnectedClient const* clnt)
+{
+  size_t i;
+  size_t n;
+
+  for (i = 0, n = rtVector_Size(clients); i < n; ++i)
+  {
+    if (rtVector_At(clients, i) == clnt)
+      return (int) i;
+  }
+  return -1;
+}
+
+/**
+ * Writes everything a new instance needs to carry on where this one stops.
+ * Sockets are passed separately, listeners first and then clients, in the
+ * same order they are described here.
+ */
+static void
+rtRouted_SaveState(rtHandoffBuffer* buff)
+{
+  size_t i;
+  size_t j;
+  size_t n;
+  size_t count;
+  int lane;
+  int discarding;
+  uint64_t now;
+  uint8_t header[28 + (2 * RTMSG_HEADER_MAX_TOPIC_LENGTH)];
+
+  rtHandoffBuffer_PutUInt32(buff, RTMSG_HANDOFF_VERSION);
+
+  // ids are indexes into the table, clients keep using them after the handoff
+  n = rtVector_Size(interned_topics);
+  rtHandoffBuffer_PutUInt32(buff, n);
+  for (i = 0; i < n; ++i)
+    rtHandoffBuffer_PutString(buff, (char const *) rtVector_At(interned_topics, i));
+
+  n = rtVector_Size(listeners);
+  rtHandoffBuffer_PutUInt32(buff, n);
+  for (i = 0; i < n; ++i)
+  {
+    rtListener* listener = (rtListener *) rtVector_At(listeners, i);
+    rtHandoffBuffer_PutBytes(buff, &listener->local_endpoint, sizeof(struct sockaddr_storage));
+  }
+
+  n = rtVector_Size(clients);
+  rtHandoffBuffer_PutUInt32(buff, n);
+  for (i = 0; i < n; ++i)
+  {
+    rtOutboundFrame* frame;
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+
+    rtHandoffBuffer_PutBytes(buff, &clnt->endpoint, sizeof(struct sockaddr_storage));
+    // a payload that's being dropped goes across as what's left of it
+    discarding = clnt->state == rtConnectionState_DiscardPayload;
+    rtHandoffBuffer_PutUInt32(buff, clnt->state);
+    rtHandoffBuffer_PutUInt32(buff, discarding ? clnt->bytes_to_read - clnt->bytes_read : clnt->bytes_to_read);
+    rtHandoffBuffer_PutUInt32(buff, clnt->outstanding_requests);
+    rtHandoffBuffer_PutBytes(buff, clnt->read_buffer, discarding ? 0 : clnt->bytes_read);
+    rtHandoffBuffer_PutBytes(buff, clnt->pending_input, clnt->pending_input_length);
+
+    rtHandoffBuffer_PutUInt32(buff, clnt->multiple_subscriptions);
+    rtHandoffBuffer_PutString(buff, clnt->interest_inbox);
+    rtHandoffBuffer_PutString(buff, clnt->process);
+    rtHandoffBuffer_PutUInt32(buff, rtVector_Size(clnt->declared_topics));
+    for (j = 0; j < rtVector_Size(clnt->declared_topics); ++j)
+    {
+      rtDeclaredTopic* declared = (rtDeclaredTopic *) rtVector_At(clnt->declared_topics, j);
+      rtHandoffBuffer_PutString(buff, declared->topic);
+      rtHandoffBuffer_PutUInt32(buff, declared->interest);
+    }
+
+    // queued output goes across as one stream, in the order Flush would
+    // have written it
+    rtHandoffBuffer_PutUInt32(buff, clnt->outbound_bytes);
+    if (clnt->partial_frame)
+    {
+      frame = clnt->partial_frame;
+      rtHandoffBuffer_PutRaw(buff, frame->data + frame->offset, frame->length - frame->offset);
+    }
+    for (lane = RTMSG_PRIORITY_LANES - 1; lane >= 0; --lane)
+    {
+      for (frame = clnt->outbound[lane].head; frame; frame = frame->next)
+        rtHandoffBuffer_PutRaw(buff, frame->data + frame->offset, frame->length - frame->offset);
+    }
+  }
+
+  for (i = 0, count = 0, n = rtVector_Size(routes); i < n; ++i)
+  {
+    if (((rtRouteEntry *) rtVector_At(routes, i))->subscription)
+      count++;
+  }
+  rtHandoffBuffer_PutUInt32(buff, count);
+  for (i = 0; i < n; ++i)
+  {
+    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
+    if (!route->subscription)
+      continue;
+    rtHandoffBuffer_PutUInt32(buff, rtRouted_ClientIndex(route->subscription->client));
+    rtHandoffBuffer_PutUInt32(buff, route->subscription->id);
+    rtHandoffBuffer_PutString(buff, route->expression);
+    rtHandoffBuffer_PutString(buff, route->subscription->group ? route->subscription->group->name : "");
+    rtHandoffBuffer_PutString(buff, route->subscription->filter ? route->subscription->filter->text : "");
+    rtHandoffBuffer_PutUInt32(buff, route->subscription->max_rate);
+    rtHandoffBuffer_PutUInt32(buff, route->subscription->local);
+  }
+
+  n = rtVector_Size(retained_messages);
+  rtHandoffBuffer_PutUInt32(buff, n);
+  for (i = 0; i < n; ++i)
+  {
+    rtRetainedMessage* msg = (rtRetainedMessage *) rtVector_At(retained_messages, i);
+    rtMessageHeader_Encode(&msg->header, header);
+    rtHandoffBuffer_PutBytes(buff, header, msg->header.header_length);
+    rtHandoffBuffer_PutBytes(buff, msg->payload, msg->header.payload_length);
+    rtHandoffBuffer_PutUInt32(buff, (uint32_t) (msg->last_update >> 32));
+    rtHandoffBuffer_PutUInt32(buff, (uint32_t) msg->last_update);
+  }
+
+  now = rtRouted_GetTimeMillis();
+  n = rtVector_Size(coalesced_requests);
+  rtHandoffBuffer_PutUInt32(buff, coalesce_next_id);
+  rtHandoffBuffer_PutUInt32(buff, n);
+  for (i = 0; i < n; ++i)
+  {
+    rtCoalescedRequest* req = (rtCoalescedRequest *) rtVector_At(coalesced_requests, i);
+    rtHandoffBuffer_PutUInt32(buff, req->id);
+    rtHandoffBuffer_PutString(buff, req->topic);
+    rtHandoffBuffer_PutBytes(buff, req->payload, req->payload_length);
+    rtHandoffBuffer_PutUInt32(buff, (uint32_t) (now - req->start_time));
+
+    count = rtVector_Size(req->waiters);
+    rtHandoffBuffer_PutUInt32(buff, count);
+    for (j = 0; j < count; ++j)
+    {
+      rtCoalescedWaiter* waiter = (rtCoalescedWaiter *) rtVector_At(req->waiters, j);
+      rtHandoffBuffer_PutString(buff, waiter->reply_topic);
+      rtHandoffBuffer_PutUInt32(buff, waiter->sequence_number);
+    }
+  }
+}
+
+static rtError
+rtRouted_RestoreState(rtHandoffBuffer* buff, int const* fds, uint32_t num_fds)
+{
+  uint32_t i;
+  uint32_t j;
+  uint32_t n;
+  uint32_t count;
+  uint32_t length;
+  uint32_t next_fd;
+  uint64_t now;
+  uint8_t const* p;
+
+  next_fd = 0;
+
+  if (rtHandoffBuffer_GetUInt32(buff) != RTMSG_HANDOFF_VERSION)
+  {
+    rtLog_Error("unsupported handoff version");
+    return RT_ERROR_PROTOCOL_ERROR;
+  }
+
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    char topic[RTMSG_HEADER_MAX_TOPIC_LENGTH];
+
+    rtHandoffBuffer_GetString(buff, topic, sizeof(topic));
+    rtVector_PushBack(interned_topics, strdup(topic));
+  }
+
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    rtListener* listener;
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p || length != sizeof(struct sockaddr_storage) || next_fd >= num_fds)
+      return RT_ERROR_PROTOCOL_ERROR;
+
+    listener = (rtListener *) malloc(sizeof(rtListener));
+    if (!listener)
+      return rtErrorFromErrno(ENOMEM);
+    listener->fd = fds[next_fd++];
+    memcpy(&listener->local_endpoint, p, length);
+    rtVector_PushBack(listeners, listener);
+  }
+
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    struct sockaddr_storage endpoint;
+    rtConnectedClient* clnt;
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p || length != sizeof(struct sockaddr_storage) || next_fd >= num_fds)
+      return RT_ERROR_PROTOCOL_ERROR;
+    memcpy(&endpoint, p, length);
+
+    rtRouted_RegisterNewClient(fds[next_fd++], &endpoint);
+    clnt = (rtConnectedClient *) rtVector_At(clients, rtVector_Size(clients) - 1);
+
+    clnt->state = (rtConnectionState) rtHandoffBuffer_GetUInt32(buff);
+    clnt->bytes_to_read = (int) rtHandoffBuffer_GetUInt32(buff);
+    clnt->outstanding_requests = (int) rtHandoffBuffer_GetUInt32(buff);
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p || (int) length > clnt->bytes_to_read)
+      return RT_ERROR_PROTOCOL_ERROR;
+    if (clnt->state == rtConnectionState_DiscardPayload ? length > 0 :
+        rtConnectedClient_ReserveReadBuffer(clnt, clnt->bytes_to_read) != RT_OK)
+      return RT_ERROR_PROTOCOL_ERROR;
+    memcpy(clnt->read_buffer, p, length);
+    clnt->bytes_read = (int) length;
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p)
+      return RT_ERROR_PROTOCOL_ERROR;
+    if (length > 0)
+    {
+      clnt->pending_input = (uint8_t *) malloc(length);
+      if (!clnt->pending_input)
+        return rtErrorFromErrno(ENOMEM);
+      memcpy(clnt->pending_input, p, length);
+      clnt->pending_input_length = length;
+      clnt->resume_time = rtRouted_GetTimeMillis();
+    }
+
+    clnt->multiple_subscriptions = (int) rtHandoffBuffer_GetUInt32(buff);
+    rtHandoffBuffer_GetString(buff, clnt->interest_inbox, sizeof(clnt->interest_inbox));
+    rtHandoffBuffer_GetString(buff, clnt->process, sizeof(clnt->process));
+    count = rtHandoffBuffer_GetUInt32(buff);
+    for (j = 0; j < count && !buff->failed; ++j)
+    {
+      rtDeclaredTopic* declared = (rtDeclaredTopic *) malloc(sizeof(rtDeclaredTopic));
+      if (!declared)
+        return rtErrorFromErrno(ENOMEM);
+      rtHandoffBuffer_GetString(buff, declared->topic, sizeof(declared->topic));
+      declared->interest = (int) rtHandoffBuffer_GetUInt32(buff);
+      rtVector_PushBack(clnt->declared_topics, declared);
+    }
+
+    // the header was decoded before the payload started coming in. a frame
+    // that is already complete was held back by a rate limit
+    if (clnt->state == rtConnectionState_ReadPayload)
+    {
+      rtConnectedClient_DecodeHeader(clnt);
+      if (clnt->bytes_read == clnt->bytes_to_read)
+        clnt->resume_time = rtRouted_GetTimeMillis();
+    }
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p)
+      return RT_ERROR_PROTOCOL_ERROR;
+    if (length > 0)
+    {
+      rtOutboundFrame* frame = (rtOutboundFrame *) malloc(sizeof(rtOutboundFrame) + length);
+      if (!frame)
+        return rtErrorFromErrno(ENOMEM);
+      frame->next = NULL;
+      frame->length = length;
+      frame->offset = 0;
+      frame->data = (uint8_t *) (frame + 1);
+      memcpy(frame->data, p, length);
+      clnt->partial_frame = frame;
+      clnt->outbound_bytes = length;
+    }
+  }
+
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    uint32_t index;
+    char expression[RTMSG_MAX_EXPRESSION_LEN];
+    char group[RTMSG_MAX_EXPRESSION_LEN];
+    char filter[RTMSG_MAX_FILTER_LEN];
+    uint32_t max_rate;
+    rtSubscription* subscription;
+
+    index = rtHandoffBuffer_GetUInt32(buff);
+    subscription = (rtSubscription *) malloc(sizeof(rtSubscription));
+    if (!subscription)
+      return rtErrorFromErrno(ENOMEM);
+    subscription->id = rtHandoffBuffer_GetUInt32(buff);
+    subscription->group = NULL;
+    subscription->filter = NULL;
+    subscription->max_rate = 0;
+    subscription->slots = NULL;
+    subscription->local = 0;
+    rtHandoffBuffer_GetString(buff, expression, sizeof(expression));
+    rtHandoffBuffer_GetString(buff, group, sizeof(group));
+    rtHandoffBuffer_GetString(buff, filter, sizeof(filter));
+    max_rate = rtHandoffBuffer_GetUInt32(buff);
+    subscription->local = (int) rtHandoffBuffer_GetUInt32(buff);
+    if (buff->failed || index >= rtVector_Size(clients))
+    {
+      free(subscription);
+      return RT_ERROR_PROTOCOL_ERROR;
+    }
+    subscription->client = (rtConnectedClient *) rtVector_At(clients, index);
+    if (strlen(filter) > 0 && rtFilter_Create(&subscription->filter, filter) != RT_OK)
+    {
+      rtLog_Warn("client [%s] has an invalid filter for %s, not restoring it. %s",
+        subscription->client->ident, expression, filter);
+      free(subscription);
+      continue;
+    }
+    if (max_rate > 0)
+      rtSubscription_SetMaxRate(subscription, max_rate);
 
-    rtSubscription* subscription = (rtSubscription *) malloc(sizeof(rtSubscription));
-    subscription->id = route_id;
-    subscription->client = sender;
     rtRouted_AddRoute(rtRouted_ForwardMessage, expression, subscription);
+    if (strlen(group) > 0)
+      rtRouted_JoinQueueGroup(group, (rtRouteEntry *) rtVector_At(routes, rtVector_Size(routes) - 1));
+  }
+
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    uint8_t const* payload;
+    rtRetainedMessage* msg;
+
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    payload = rtHandoffBuffer_GetBytes(buff, &count);
+    if (!p || !payload || length < 28)
+      return RT_ERROR_PROTOCOL_ERROR;
+
+    msg = (rtRetainedMessage *) malloc(sizeof(rtRetainedMessage));
+    if (!msg)
+      return rtErrorFromErrno(ENOMEM);
+    msg->payload = (uint8_t *) malloc(count > 0 ? count : 1);
+    if (!msg->payload)
+    {
+      free(msg);
+      return rtErrorFromErrno(ENOMEM);
+    }
+
+    rtMessageHeader_Init(&msg->header);
+    rtMessageHeader_Decode(&msg->header, p);
+    msg->header.payload_length = count;
+    memcpy(msg->payload, payload, count);
+    msg->last_update = ((uint64_t) rtHandoffBuffer_GetUInt32(buff)) << 32;
+    msg->last_update |= rtHandoffBuffer_GetUInt32(buff);
+    if (msg->last_update > retained_clock)
+      retained_clock = msg->last_update;
+    retained_bytes += rtRetainedMessage_Size(msg);
+    rtVector_PushBack(retained_messages, msg);
+  }
+
+  // the new configuration may have a smaller budget
+  rtRouted_EvictRetained();
+
+  now = rtRouted_GetTimeMillis();
+  coalesce_next_id = rtHandoffBuffer_GetUInt32(buff);
+  n = rtHandoffBuffer_GetUInt32(buff);
+  for (i = 0; i < n && !buff->failed; ++i)
+  {
+    uint32_t age;
+    rtCoalescedRequest* req;
+
+    req = (rtCoalescedRequest *) malloc(sizeof(rtCoalescedRequest));
+    if (!req)
+      return rtErrorFromErrno(ENOMEM);
+    rtVector_Create(&req->waiters);
+    req->payload = NULL;
+    rtVector_PushBack(coalesced_requests, req);
+
+    req->id = rtHandoffBuffer_GetUInt32(buff);
+    rtHandoffBuffer_GetString(buff, req->topic, sizeof(req->topic));
+    p = rtHandoffBuffer_GetBytes(buff, &length);
+    if (!p)
+      return RT_ERROR_PROTOCOL_ERROR;
+    req->payload = (uint8_t *) malloc(length > 0 ? length : 1);
+    if (!req->payload)
+      return rtErrorFromErrno(ENOMEM);
+    memcpy(req->payload, p, length);
+    req->payload_length = length;
+    age = rtHandoffBuffer_GetUInt32(buff);
+    req->start_time = now > age ? now - age : 0;
+
+    count = rtHandoffBuffer_GetUInt32(buff);
+    for (j = 0; j < count && !buff->failed; ++j)
+    {
+      rtCoalescedWaiter* waiter = (rtCoalescedWaiter *) malloc(sizeof(rtCoalescedWaiter));
+      if (!waiter)
+        return rtErrorFromErrno(ENOMEM);
+      rtHandoffBuffer_GetString(buff, waiter->reply_topic, sizeof(waiter->reply_topic));
+      waiter->sequence_number = rtHandoffBuffer_GetUInt32(buff);
+      rtVector_PushBack(req->waiters, waiter);
+    }
+  }
+
+  if (buff->failed || next_fd != num_fds)
+    return RT_ERROR_PROTOCOL_ERROR;
+
+  rtLog_Info("took over %d listeners, %d clients, %d routes",
+    (int) rtVector_Size(listeners), (int) rtVector_Size(clients), (int) rtVector_Size(routes));
+  return RT_OK;
+}
+
+static rtError
+rtRouted_HandoffWrite(int fd, void const* buff, size_t n)
+{
+  ssize_t ret;
+  size_t bytes_sent;
+
+  bytes_sent = 0;
+  while (bytes_sent < n)
+  {
+    ret = send(fd, (uint8_t const *) buff + bytes_sent, n - bytes_sent, MSG_NOSIGNAL);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return rtErrorFromErrno(errno);
+    }
+    bytes_sent += ret;
+  }
+  return RT_OK;
+}
+
+static rtError
+rtRouted_HandoffRead(int fd, void* buff, size_t n)
+{
+  ssize_t ret;
+  size_t bytes_read;
+
+  bytes_read = 0;
+  while (bytes_read < n)
+  {
+    ret = recv(fd, (uint8_t *) buff + bytes_read, n - bytes_read, 0);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return rtErrorFromErrno(errno);
+    }
+    if (ret == 0)
+      return RT_ERROR_STREAM_CLOSED;
+    bytes_read += ret;
+  }
+  return RT_OK;
+}
+
+static rtError
+rtRouted_SendFds(int fd, int const* fds, uint32_t n)
+{
+  ssize_t ret;
+  uint8_t b;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  union
+  {
+    struct cmsghdr  align;
+    char            buff[CMSG_SPACE(sizeof(int) * RTMSG_HANDOFF_MAX_FDS_PER_MESSAGE)];
+  } control;
+
+  // fds need at least one byte of real data to travel with
+  b = (uint8_t) n;
+  iov.iov_base = &b;
+  iov.iov_len = 1;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buff;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+  do
+  {
+    ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  }
+  while (ret == -1 && errno == EINTR);
+
+  return ret == 1 ? RT_OK : rtErrorFromErrno(errno);
+}
+
+static rtError
+rtRouted_RecvFds(int fd, int* fds, uint32_t max, uint32_t* n)
+{
+  ssize_t ret;
+  uint8_t b;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  union
+  {
+    struct cmsghdr  align;
+    char            buff[CMSG_SPACE(sizeof(int) * RTMSG_HANDOFF_MAX_FDS_PER_MESSAGE)];
+  } control;
+
+  *n = 0;
+  iov.iov_base = &b;
+  iov.iov_len = 1;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+
+  do
+  {
+    ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  }
+  while (ret == -1 && errno == EINTR);
+
+  if (ret == -1)
+    return rtErrorFromErrno(errno);
+  if (ret == 0)
+    return RT_ERROR_STREAM_CLOSED;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      (msg.msg_flags & MSG_CTRUNC))
+    return RT_ERROR_PROTOCOL_ERROR;
+
+  *n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  if (*n > max || *n != b)
+    return RT_ERROR_PROTOCOL_ERROR;
+
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (*n));
+  return RT_OK;
+}
+
+static void
+rtRouted_SetHandoffTimeout(int fd)
+{
+  struct timeval tv;
+
+  tv.tv_sec = RTMSG_HANDOFF_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void
+rtRouted_OpenHandoffListener()
+{
+  int fd;
+  struct sockaddr_un local_endpoint;
+
+  memset(&local_endpoint, 0, sizeof(local_endpoint));
+  local_endpoint.sun_family = AF_UNIX;
+  strncpy(local_endpoint.sun_path, RTMSG_HANDOFF_SOCKET, sizeof(local_endpoint.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    rtLog_Warn("failed to create handoff socket. %s", rtStrError(rtErrorFromErrno(errno)));
+    return;
+  }
+
+  // we hold the pid file lock, anything left at this path is stale
+  unlink(RTMSG_HANDOFF_SOCKET);
+  if (bind(fd, (struct sockaddr *) &local_endpoint, sizeof(local_endpoint)) == -1 ||
+      chmod(RTMSG_HANDOFF_SOCKET, 0600) == -1 || listen(fd, 1) == -1)
+  {
+    rtLog_Warn("failed to open handoff socket %s, restarts will drop clients. %s",
+      RTMSG_HANDOFF_SOCKET, rtStrError(rtErrorFromErrno(errno)));
+    close(fd);
+    return;
+  }
+
+  handoff_fd = fd;
+}
+
+/**
+ * Gives all sockets and routing state to a new rtrouted started with
+ * --takeover. Nothing is read from or written to clients while this runs,
+ * whatever arrives in the meantime is waiting in the socket for the new
+ * instance. Exits once the new instance confirms it has everything.
+ */
+static void
+rtRouted_HandOff()
+{
+  int fd;
+  uint8_t ack;
+  uint8_t* p;
+  uint8_t preamble[12];
+  int* fds;
+  uint32_t i;
+  uint32_t n;
+  uint32_t num_fds;
+  rtError err;
+  rtHandoffBuffer state;
+
+  fd = accept(handoff_fd, NULL, NULL);
+  if (fd == -1)
+  {
+    rtLog_Warn("accept:%s", rtStrError(rtErrorFromErrno(errno)));
+    return;
+  }
+
+  rtLog_Info("handing off to new rtrouted instance");
+  rtRouted_SetHandoffTimeout(fd);
+
+  // pending conflated values go out with the queued frames rather than
+  // being lost
+  rtRouted_FlushConflated(1);
+
+  memset(&state, 0, sizeof(state));
+  rtRouted_SaveState(&state);
+
+  num_fds = rtVector_Size(listeners) + rtVector_Size(clients);
+  fds = (int *) malloc(sizeof(int) * (num_fds > 0 ? num_fds : 1));
+  if (!fds || state.failed)
+  {
+    err = rtErrorFromErrno(ENOMEM);
+    goto failed;
+  }
+
+  n = 0;
+  for (i = 0; i < rtVector_Size(listeners); ++i)
+    fds[n++] = ((rtListener *) rtVector_At(listeners, i))->fd;
+  for (i = 0; i < rtVector_Size(clients); ++i)
+    fds[n++] = ((rtConnectedClient *) rtVector_At(clients, i))->fd;
+
+  p = preamble;
+  rtEncoder_EncodeUInt32(&p, RTMSG_HANDOFF_MAGIC);
+  rtEncoder_EncodeUInt32(&p, num_fds);
+  rtEncoder_EncodeUInt32(&p, (uint32_t) state.length);
+  err = rtRouted_HandoffWrite(fd, preamble, sizeof(preamble));
+
+  for (i = 0; i < num_fds && err == RT_OK; i += n)
+  {
+    n = num_fds - i;
+    if (n > RTMSG_HANDOFF_MAX_FDS_PER_MESSAGE)
+      n = RTMSG_HANDOFF_MAX_FDS_PER_MESSAGE;
+    err = rtRouted_SendFds(fd, fds + i, n);
+  }
+
+  if (err == RT_OK)
+    err = rtRouted_HandoffWrite(fd, state.data, state.length);
+  if (err == RT_OK)
+    err = rtRouted_HandoffRead(fd, &ack, 1);
+
+  if (err == RT_OK)
+  {
+    rtLog_Info("handoff complete, exiting");
+    rtRouted_CloseCapture();
+    exit(0);
+  }
+
+failed:
+  rtLog_Error("handoff failed, carrying on. %s", rtStrError(err));
+  free(fds);
+  free(state.data);
+  close(fd);
+}
+
+/**
+ * Receives the sockets and state of the running instance. A failure is
+ * fatal, what was restored so far is left as it is for the process to exit
+ * with. The old instance keeps running without our ack.
+ */
+static rtError
+rtRouted_TakeOver()
+{
+  int fd;
+  uint8_t ack;
+  uint8_t const* p;
+  uint8_t preamble[12];
+  int* fds;
+  uint32_t n;
+  uint32_t magic;
+  uint32_t num_fds;
+  uint32_t received;
+  uint32_t length;
+  rtError err;
+  rtHandoffBuffer state;
+  struct sockaddr_un remote_endpoint;
+
+  fds = NULL;
+  received = 0;
+  memset(&state, 0, sizeof(state));
+  memset(&remote_endpoint, 0, sizeof(remote_endpoint));
+  remote_endpoint.sun_family = AF_UNIX;
+  strncpy(remote_endpoint.sun_path, RTMSG_HANDOFF_SOCKET, sizeof(remote_endpoint.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return rtErrorFromErrno(errno);
+
+  if (connect(fd, (struct sockaddr *) &remote_endpoint, sizeof(remote_endpoint)) == -1)
+  {
+    err = rtErrorFromErrno(errno);
+    rtLog_Error("failed to connect to %s. %s", RTMSG_HANDOFF_SOCKET, rtStrError(err));
+    close(fd);
+    return err;
+  }
+
+  rtRouted_SetHandoffTimeout(fd);
+
+  err = rtRouted_HandoffRead(fd, preamble, sizeof(preamble));
+  if (err != RT_OK)
+    goto out;
+
+  p = preamble;
+  rtEncoder_DecodeUInt32(&p, &magic);
+  rtEncoder_DecodeUInt32(&p, &num_fds);
+  rtEncoder_DecodeUInt32(&p, &length);
+  if (magic != RTMSG_HANDOFF_MAGIC)
+  {
+    err = RT_ERROR_PROTOCOL_ERROR;
+    goto out;
+  }
 
-    rtMessage_Release(m);
+  fds = (int *) malloc(sizeof(int) * (num_fds > 0 ? num_fds : 1));
+  state.data = (uint8_t *) malloc(length > 0 ? length : 1);
+  if (!fds || !state.data)
+  {
+    err = rtErrorFromErrno(ENOMEM);
+    goto out;
   }
-  else if (strcmp(hdr->topic, "_RTROUTED.INBOX.HELLO") == 0)
+
+  while (received < num_fds)
   {
-    char const* inbox = NULL;
+    err = rtRouted_RecvFds(fd, fds + received, num_fds - received, &n);
+    if (err != RT_OK)
+      goto out;
+    received += n;
+  }
 
-    rtMessage m;
-    rtMessage_FromBytes(&m, buff, n);
-    rtMessage_GetString(m, "inbox", &inbox);
+  err = rtRouted_HandoffRead(fd, state.data, length);
+  if (err != RT_OK)
+    goto out;
+  state.length = length;
+  state.capacity = length;
 
-    rtSubscription* subscription = (rtSubscription *) malloc(sizeof(rtSubscription));
-    subscription->id = 0;
-    subscription->client = sender;
-    rtRouted_AddRoute(rtRouted_ForwardMessage, inbox, subscription);
+  err = rtRouted_RestoreState(&state, fds, num_fds);
+  if (err != RT_OK)
+    goto out;
 
-    rtMessage_Release(m);
-  }
-  else
+  ack = 1;
+  err = rtRouted_HandoffWrite(fd, &ack, 1);
+
+out:
+  free(fds);
+  free(state.data);
+  close(fd);
+  return err;
+}
+
+#ifdef RTROUTED_USE_IO_URING
+/*
+ * io_uring backend. Clients are read with multishot recv into a ring of
+ * provided buffers, so no buffer is tied up by an idle client, and the sends
+ * for every client with queued output go to the kernel in a single submit at
+ * the end of each pass. The user_data of each request is the object it belongs
+ * to with the kind of request in the low bits.
+ */
+typedef enum
+{
+  rtUringOp_Accept = 1,
+  rtUringOp_Recv = 2,
+  rtUringOp_Send = 3
+} rtUringOp;
+
+#define RTMSG_URING_OP_MASK 3
+#define RTMSG_URING_HANDOFF ((uint64_t) 4)
+
+static struct io_uring uring;
+static struct io_uring_buf_ring* uring_buffer_ring = NULL;
+static uint8_t* uring_buffers = NULL;
+static int uring_multishot = 1;
+static int uring_accepts_inflight = 0;
+static int uring_handoff_armed = 0;
+static int uring_quiescing = 0;
+static rtVector uring_closing;
+
+static uint64_t
+rtRouted_UringData(void const* p, rtUringOp op)
+{
+  return (uint64_t) (uintptr_t) p | op;
+}
+
+static struct io_uring_sqe*
+rtRouted_UringGetSqe()
+{
+  struct io_uring_sqe* sqe;
+
+  // a full submission queue is pushed to the kernel to make room
+  sqe = io_uring_get_sqe(&uring);
+  if (!sqe)
   {
-    rtLog_Debug("no handler for message:%s", hdr->topic);
+    io_uring_submit(&uring);
+    sqe = io_uring_get_sqe(&uring);
   }
-  return RT_OK;
+  return sqe;
 }
 
-static int
-rtRouted_IsTopicMatch(char const* topic, char const* exp)
+static void
+rtRouted_UringArmAccept(rtListener* listener)
 {
-  char const* t = topic;
-  char const* e = exp;
+  struct io_uring_sqe* sqe = rtRouted_UringGetSqe();
+  if (!sqe)
+    return;
+  io_uring_prep_multishot_accept(sqe, listener->fd, NULL, NULL, SOCK_CLOEXEC);
+  io_uring_sqe_set_data64(sqe, rtRouted_UringData(listener, rtUringOp_Accept));
+  uring_accepts_inflight++;
+}
 
+static void
+rtRouted_UringArmRecv(rtConnectedClient* clnt)
+{
+  struct io_uring_sqe* sqe = rtRouted_UringGetSqe();
+  if (!sqe)
+    return;
+  if (uring_multishot)
+    io_uring_prep_recv_multishot(sqe, clnt->fd, NULL, 0, 0);
+  else
+    io_uring_prep_recv(sqe, clnt->fd, NULL, RTMSG_URING_BUFFER_SIZE, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RTMSG_URING_BUFFER_GROUP;
+  io_uring_sqe_set_data64(sqe, rtRouted_UringData(clnt, rtUringOp_Recv));
+  clnt->recv_armed = 1;
+  clnt->recv_cancelled = 0;
+  clnt->ops_inflight++;
+}
 
-  while (*t && *e)
-  {
-    if (*e == '*')
-    {
-      while (*t && *t != '.')
-        t++;
-      e++;
-    }
+static void
+rtRouted_UringArmHandoff()
+{
+  struct io_uring_sqe* sqe;
 
-    if (*e == '>')
-    {
-      while (*t)
-        t++;
-      e++;
-    }
+  if (handoff_fd == RTMSG_INVALID_FD || uring_handoff_armed)
+    return;
+  sqe = rtRouted_UringGetSqe();
+  if (!sqe)
+    return;
+  io_uring_prep_poll_add(sqe, handoff_fd, POLLIN);
+  io_uring_sqe_set_data64(sqe, RTMSG_URING_HANDOFF);
+  uring_handoff_armed = 1;
+}
 
-    if (!(*t || *e))
-      break;
+static void
+rtRouted_UringCancelFd(int fd)
+{
+  struct io_uring_sqe* sqe = rtRouted_UringGetSqe();
+  if (!sqe)
+    return;
+  io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+  io_uring_sqe_set_data64(sqe, 0);
+}
 
-    if (*t != *e)
-      break;
+static rtError
+rtRouted_UringQueueSend(rtConnectedClient* clnt)
+{
+  size_t bytes_queued;
+  struct io_uring_sqe* sqe;
 
-    t++;
-    e++;
-  }
+  clnt->dirty = 0;
 
-  // rtLogInfo("match[%d]: %s <> %s", !(*t || *e), topic, exp);
-  return !(*t || *e);
+  // the frames of a send in flight stay at the head of their queues until it
+  // completes, the next send picks up from there
+  if (clnt->send_inflight || clnt->closing || uring_quiescing)
+    return RT_OK;
+
+  clnt->send_count = rtConnectedClient_GatherOutput(clnt, clnt->send_iov, clnt->send_frames,
+    clnt->send_lanes, &bytes_queued);
+  if (clnt->send_count == 0)
+    return RT_OK;
+
+  sqe = rtRouted_UringGetSqe();
+  if (!sqe)
+    return RT_OK;
+
+  memset(&clnt->send_msg, 0, sizeof(clnt->send_msg));
+  clnt->send_msg.msg_iov = clnt->send_iov;
+  clnt->send_msg.msg_iovlen = clnt->send_count;
+  io_uring_prep_sendmsg(sqe, clnt->fd, &clnt->send_msg, MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, rtRouted_UringData(clnt, rtUringOp_Send));
+  clnt->send_inflight = 1;
+  clnt->ops_inflight++;
+  return RT_OK;
 }
 
 static void
-rtConnectedClient_Init(rtConnectedClient* clnt, int fd, struct sockaddr_storage* remote_endpoint)
+rtRouted_UringClose(rtConnectedClient* clnt)
 {
-  clnt->fd = fd;
-  clnt->state = rtConnectionState_ReadHeaderPreamble;
-  clnt->bytes_read = 0;
-  clnt->bytes_to_read = 4;
-  clnt->read_buffer = (uint8_t *) malloc(RTMSG_CLIENT_READ_BUFFER_SIZE);
-  clnt->send_buffer = (uint8_t *) malloc(RTMSG_CLIENT_READ_BUFFER_SIZE);
-  memcpy(&clnt->endpoint, remote_endpoint, sizeof(struct sockaddr_storage));
-  memset(clnt->read_buffer, 0, RTMSG_CLIENT_READ_BUFFER_SIZE);
-  memset(clnt->send_buffer, 0, RTMSG_CLIENT_READ_BUFFER_SIZE);
-  rtMessageHeader_Init(&clnt->header);
+  rtRouted_ClearClientRoutes(clnt);
+  clnt->closing = 1;
+  if (clnt->ops_inflight > 0)
+    rtRouted_UringCancelFd(clnt->fd);
+  rtVector_PushBack(uring_closing, clnt);
 }
 
 static void
-rtRouter_DispatchMessageFromClient(rtConnectedClient* clnt)
+rtRouted_UringReapClosed()
 {
   size_t i;
-  size_t n;
-  int match_found = 0;
 
-  for (i = 0, n = rtVector_Size(routes); i < n;)
+  for (i = 0; i < rtVector_Size(uring_closing);)
   {
-    rtError err = RT_OK;
-    rtRouteEntry* route = (rtRouteEntry *) rtVector_At(routes, i);
-    if (rtRouted_IsTopicMatch(clnt->header.topic, route->expression))
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(uring_closing, i);
+    if (clnt->ops_inflight == 0)
     {
-      match_found = 1;
-      err = route->message_handler(clnt, &clnt->header, clnt->read_buffer +
-          clnt->header.header_length, clnt->header.payload_length, route->subscription);
-
-      if (err != RT_OK)
-      {
-        if (err == rtErrorFromErrno(EBADF))
-        {
-          rtRouted_ClearClientRoutes(clnt);
-          n = rtVector_Size(routes);
-        }
-      }
+      rtVector_RemoveItem(uring_closing, clnt, NULL);
+      rtConnectedClient_Destroy(clnt);
+      continue;
     }
-
-    if (err == RT_OK)
-      i++;
+    i++;
   }
+}
 
-  int is_request = rtMessageHeader_IsRequest(&clnt->header);
-  if (!match_found && is_request)
+static void
+rtRouted_UringReturnBuffer(struct io_uring_cqe* cqe)
+{
+  uint16_t bid;
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return;
+  bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  io_uring_buf_ring_add(uring_buffer_ring, uring_buffers + (size_t) bid * RTMSG_URING_BUFFER_SIZE,
+    RTMSG_URING_BUFFER_SIZE, bid, io_uring_buf_ring_mask(RTMSG_URING_BUFFER_COUNT), 0);
+  io_uring_buf_ring_advance(uring_buffer_ring, 1);
+}
+
+static void
+rtRouted_UringOnAccept(struct io_uring_cqe* cqe)
+{
+  socklen_t socket_length;
+  struct sockaddr_storage remote_endpoint;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_accepts_inflight--;
+
+  if (cqe->res < 0)
   {
-    // TODO: If this is a request, then send message directly back
-    // to caller
-    rtLog_Error("no client found for match:%s", clnt->header.topic);
-    //No route Found , Returning a Error Message to caller
-    rtConnection_SendErrorMessageToCaller(clnt->fd, &clnt->header);
+    if (cqe->res != -ECANCELED)
+      rtLog_Warn("accept:%s", rtStrError(rtErrorFromErrno(-cqe->res)));
+    return;
   }
+
+  socket_length = sizeof(struct sockaddr_storage);
+  memset(&remote_endpoint, 0, sizeof(struct sockaddr_storage));
+  getpeername(cqe->res, (struct sockaddr *) &remote_endpoint, &socket_length);
+  rtRouted_RegisterNewClient(cqe->res, &remote_endpoint);
 }
 
-static rtError
-rtConnectedClient_Read(rtConnectedClient* clnt)
+static void
+rtRouted_UringOnRecv(rtConnectedClient* clnt, struct io_uring_cqe* cqe)
 {
-  ssize_t bytes_read;
-  int bytes_to_read = (clnt->bytes_to_read - clnt->bytes_read);
+  rtError err;
+  struct io_uring_sqe* sqe;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    clnt->recv_armed = 0;
+    clnt->ops_inflight--;
+  }
+
+  if (clnt->closing)
+  {
+    rtRouted_UringReturnBuffer(cqe);
+    return;
+  }
 
-  bytes_read = recv(clnt->fd, &clnt->read_buffer[clnt->bytes_read], bytes_to_read, MSG_NOSIGNAL);
-  if (bytes_read == -1)
+  if (cqe->res < 0)
   {
-    rtError e = rtErrorFromErrno(errno);
-    rtLog_Warn("read:%s", rtStrError(e));
-    return e;
+    // out of buffers or cancelled, it's re-armed at the end of the pass
+    if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+      return;
+
+    if (cqe->res == -EINVAL && uring_multishot)
+    {
+      rtLog_Info("kernel has no multishot recv, using single shot receives");
+      uring_multishot = 0;
+      return;
+    }
+
+    rtLog_Warn("read:%s", rtStrError(rtErrorFromErrno(-cqe->res)));
+    rtRouted_DropClient(clnt);
+    return;
   }
 
-  if (bytes_read == 0)
+  if (cqe->res == 0)
   {
     rtLog_Debug("read zero bytes, stream closed");
-    return RT_ERROR_STREAM_CLOSED;
+    rtRouted_DropClient(clnt);
+    return;
   }
 
-  clnt->bytes_read += bytes_read;
+  err = rtConnectedClient_Consume(clnt, uring_buffers + (size_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT)
+    * RTMSG_URING_BUFFER_SIZE, cqe->res);
+  rtRouted_UringReturnBuffer(cqe);
+  if (err != RT_OK)
+  {
+    rtRouted_DropClient(clnt);
+    return;
+  }
 
-  switch (clnt->state)
+  // a rate limited client stops being read, like with select, so it can't
+  // pile up pending input
+  if (clnt->resume_time != 0 && clnt->recv_armed && !clnt->recv_cancelled && uring_multishot)
   {
-    case rtConnectionState_ReadHeaderPreamble:
+    sqe = rtRouted_UringGetSqe();
+    if (sqe)
     {
-      // read version/length of header
-      if (clnt->bytes_read == clnt->bytes_to_read)
-      {
-        uint8_t const* itr = &clnt->read_buffer[2];
-        uint16_t header_length = 0;
-        rtEncoder_DecodeUInt16(&itr, &header_length);
-        clnt->bytes_to_read += (header_length - 4);
-        clnt->state = rtConnectionState_ReadHeader;
-      }
+      io_uring_prep_cancel64(sqe, rtRouted_UringData(clnt, rtUringOp_Recv), 0);
+      io_uring_sqe_set_data64(sqe, 0);
+      clnt->recv_cancelled = 1;
     }
-    break;
+  }
+}
 
-    case rtConnectionState_ReadHeader:
+static void
+rtRouted_UringOnSend(rtConnectedClient* clnt, struct io_uring_cqe* cqe)
+{
+  clnt->send_inflight = 0;
+  clnt->ops_inflight--;
+
+  if (clnt->closing)
+    return;
+
+  if (cqe->res < 0)
+  {
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN || cqe->res == -ECANCELED)
+      return;
+    rtLog_Warn("failed to write to client [%s]. %s", clnt->ident,
+      rtStrError(rtConnectedClient_SendError(-cqe->res)));
+    rtRouted_DropClient(clnt);
+    return;
+  }
+
+  rtConnectedClient_RetireOutput(clnt, clnt->send_frames, clnt->send_lanes, clnt->send_count, cqe->res);
+}
+
+/**
+ * Handles completions until the queue is empty.
+ * @return non-zero when the handoff socket has a new instance waiting
+ */
+static int
+rtRouted_UringProcessCompletions()
+{
+  int handoff;
+  unsigned head;
+  unsigned count;
+  uint64_t data;
+  uint64_t now;
+  uint64_t pass_start;
+  struct io_uring_cqe* cqe;
+
+  handoff = 0;
+  pass_start = rtRouted_GetTimeMillis();
+
+  while (1)
+  {
+    count = 0;
+    io_uring_for_each_cqe(&uring, head, cqe)
     {
-      if (clnt->bytes_read == clnt->bytes_to_read)
+      count++;
+      data = io_uring_cqe_get_data64(cqe);
+      if (data == RTMSG_URING_HANDOFF)
       {
-        rtMessageHeader_Decode(&clnt->header, clnt->read_buffer);
-        clnt->bytes_to_read += clnt->header.payload_length;
-        clnt->state = rtConnectionState_ReadPayload;
+        uring_handoff_armed = 0;
+        handoff = 1;
+        continue;
       }
-    }
-    break;
 
-    case rtConnectionState_ReadPayload:
-    {
-      if (clnt->bytes_read == clnt->bytes_to_read)
+      switch (data & RTMSG_URING_OP_MASK)
       {
-        rtRouter_DispatchMessageFromClient(clnt);
-        clnt->bytes_to_read = 4;
-        clnt->bytes_read = 0;
-        clnt->state = rtConnectionState_ReadHeaderPreamble;
-        rtMessageHeader_Init(&clnt->header);
+        case rtUringOp_Accept:
+          rtRouted_UringOnAccept(cqe);
+          break;
+        case rtUringOp_Recv:
+          rtRouted_UringOnRecv((rtConnectedClient *) (uintptr_t) (data & ~(uint64_t) RTMSG_URING_OP_MASK), cqe);
+          break;
+        case rtUringOp_Send:
+          rtRouted_UringOnSend((rtConnectedClient *) (uintptr_t) (data & ~(uint64_t) RTMSG_URING_OP_MASK), cqe);
+          break;
+        default:
+          // cancellations and timeouts
+          break;
       }
     }
-    break;
+
+    if (count == 0)
+      break;
+    io_uring_cq_advance(&uring, count);
+
+    // don't let subscribers wait on a long pass
+    now = rtRouted_GetTimeMillis();
+    if (now - pass_start >= RTMSG_FLUSH_DEADLINE && !uring_quiescing)
+    {
+      size_t i;
+      for (i = 0; i < rtVector_Size(clients); ++i)
+        rtRouted_UringQueueSend((rtConnectedClient *) rtVector_At(clients, i));
+      io_uring_submit(&uring);
+      pass_start = now;
+    }
   }
 
-  return RT_OK;
+  return handoff;
 }
 
-static void
-rtRouted_PushFd(fd_set* fds, int fd, int* maxFd)
+static int
+rtRouted_UringIsQuiet()
 {
-  if (fd != RTMSG_INVALID_FD)
+  size_t i;
+
+  if (uring_accepts_inflight > 0 || rtVector_Size(uring_closing) > 0)
+    return 0;
+  for (i = 0; i < rtVector_Size(clients); ++i)
   {
-    FD_SET(fd, fds);
-    if (maxFd && fd > *maxFd)
-      *maxFd = fd;
+    if (((rtConnectedClient *) rtVector_At(clients, i))->ops_inflight > 0)
+      return 0;
   }
+  return 1;
 }
 
+/**
+ * Takes everything back from the kernel before a handoff. Data that was
+ * already received is run through the read state machine as usual and ends
+ * up in the handed over state.
+ */
 static void
-rtRouted_RegisterNewClient(int fd, struct sockaddr_storage* remote_endpoint)
+rtRouted_UringQuiesce()
 {
-  char remote_address[64];
-  uint16_t remote_port;
-  rtConnectedClient* new_client;
+  int ret;
+  size_t i;
+
+  uring_quiescing = 1;
+  for (i = 0; i < rtVector_Size(listeners); ++i)
+    rtRouted_UringCancelFd(((rtListener *) rtVector_At(listeners, i))->fd);
+  for (i = 0; i < rtVector_Size(clients); ++i)
+  {
+    rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+    if (clnt->ops_inflight > 0)
+      rtRouted_UringCancelFd(clnt->fd);
+  }
+
+  while (1)
+  {
+    rtRouted_UringReapClosed();
+    if (rtRouted_UringIsQuiet())
+      break;
+    ret = io_uring_submit_and_wait(&uring, 1);
+    if (ret < 0 && ret != -EINTR)
+    {
+      rtLog_Warn("io_uring_submit_and_wait:%s", rtStrError(rtErrorFromErrno(-ret)));
+      break;
+    }
+    rtRouted_UringProcessCompletions();
+  }
+  uring_quiescing = 0;
+}
+
+/**
+ * Runs the router on io_uring. Returns only when the ring can't be set up, the
+ * caller falls back to select then.
+ */
+static rtError
+rtRouted_RunUringLoop()
+{
+  int ret;
+  size_t i;
+  uint64_t now;
+  uint64_t wait;
+  uint64_t held;
+  uint64_t next_conflated;
+  struct io_uring_cqe* cqe;
+  struct __kernel_timespec timeout;
+
+  ret = io_uring_queue_init(RTMSG_URING_ENTRIES, &uring, 0);
+  if (ret < 0)
+    return rtErrorFromErrno(-ret);
+
+  uring_buffer_ring = io_uring_setup_buf_ring(&uring, RTMSG_URING_BUFFER_COUNT, RTMSG_URING_BUFFER_GROUP,
+    0, &ret);
+  uring_buffers = (uint8_t *) malloc((size_t) RTMSG_URING_BUFFER_COUNT * RTMSG_URING_BUFFER_SIZE);
+  if (!uring_buffer_ring || !uring_buffers)
+  {
+    if (uring_buffer_ring)
+      io_uring_free_buf_ring(&uring, uring_buffer_ring, RTMSG_URING_BUFFER_COUNT, RTMSG_URING_BUFFER_GROUP);
+    free(uring_buffers);
+    io_uring_queue_exit(&uring);
+    return rtErrorFromErrno(ret < 0 ? -ret : ENOMEM);
+  }
+
+  for (i = 0; i < RTMSG_URING_BUFFER_COUNT; ++i)
+  {
+    io_uring_buf_ring_add(uring_buffer_ring, uring_buffers + i * RTMSG_URING_BUFFER_SIZE,
+      RTMSG_URING_BUFFER_SIZE, i, io_uring_buf_ring_mask(RTMSG_URING_BUFFER_COUNT), i);
+  }
+  io_uring_buf_ring_advance(uring_buffer_ring, RTMSG_URING_BUFFER_COUNT);
+
+  rtVector_Create(&uring_closing);
+  uring_active = 1;
+  rtLog_Info("using io_uring");
+
+  while (1)
+  {
+    // on a timeout nothing completed, only held and queued frames are
+    // looked at
+    rtRouted_ResumeDelayedClients();
+
+    if (uring_accepts_inflight == 0)
+    {
+      for (i = 0; i < rtVector_Size(listeners); ++i)
+        rtRouted_UringArmAccept((rtListener *) rtVector_At(listeners, i));
+    }
+    rtRouted_UringArmHandoff();
+    rtRouted_UpdateInterest();
+    next_conflated = rtRouted_FlushConflated(0);
+
+    now = rtRouted_GetTimeMillis();
+    wait = 10000;
+    if (next_conflated != 0)
+      wait = next_conflated > now ? next_conflated - now : 0;
+    for (i = 0; i < rtVector_Size(clients); ++i)
+    {
+      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+      if (clnt->resume_time == 0)
+      {
+        if (!clnt->recv_armed)
+          rtRouted_UringArmRecv(clnt);
+      }
+      else
+      {
+        held = clnt->resume_time > now ? clnt->resume_time - now : 0;
+        if (held < wait)
+          wait = held;
+      }
 
-  remote_address[0] = '\0';
-  remote_port = 0;
-  new_client = (rtConnectedClient *) malloc(sizeof(rtConnectedClient));
-  new_client->fd = -1;
+      // everything queued during the pass goes out with this submit
+      if (rtConnectedClient_HasPendingOutput(clnt))
+        rtRouted_UringQueueSend(clnt);
+    }
 
-  rtConnectedClient_Init(new_client, fd, remote_endpoint);
-  rtSocketStorage_ToString(&new_client->endpoint, remote_address, sizeof(remote_address), &remote_port);
-  snprintf(new_client->ident, RTMSG_ADDR_MAX, "%s:%d/%d", remote_address, remote_port, fd);
-  rtVector_PushBack(clients, new_client);
+    rtRouted_UringReapClosed();
 
-  rtLog_Debug("new client:%s", new_client->ident);
+    timeout.tv_sec = wait / 1000;
+    timeout.tv_nsec = (wait % 1000) * 1000000;
+    ret = io_uring_submit_and_wait_timeout(&uring, &cqe, 1, &timeout, NULL);
+    if (ret < 0 && ret != -ETIME && ret != -EINTR)
+      rtLog_Warn("io_uring_submit_and_wait_timeout:%s", rtStrError(rtErrorFromErrno(-ret)));
+
+    if (rtRouted_UringProcessCompletions())
+    {
+      // still here when the handoff failed, everything is armed again at
+      // the top of the loop
+      rtRouted_UringQuiesce();
+      rtRouted_HandOff();
+    }
+  }
+
+  return RT_OK;
 }
+#endif
 
 static void
-rtRouted_AcceptClientConnection(rtListener* listener)
+rtRouted_RunSelectLoop()
 {
-  int                       fd;
-  socklen_t                 socket_length;
-  struct sockaddr_storage   remote_endpoint;
-
-  socket_length = sizeof(struct sockaddr_storage);
-  memset(&remote_endpoint, 0, sizeof(struct sockaddr_storage));
+  int i;
+  int ret;
+  uint64_t next_conflated;
 
-  fd = accept(listener->fd, (struct sockaddr *)&remote_endpoint, &socket_length);
-  if (fd == -1)
+  next_conflated = 0;
+  while (1)
   {
-    rtLog_Warn("accept:%s", rtStrError(errno));
-    return;
-  }
+    int n;
+    uint64_t                    now;
+    uint64_t                    pass_start;
+    int                         max_fd;
+    fd_set                      read_fds;
+    fd_set                      write_fds;
+    fd_set                      err_fds;
+    struct timeval              timeout;
 
-  rtRouted_RegisterNewClient(fd, &remote_endpoint);
-}
+    max_fd= -1;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_ZERO(&err_fds);
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
 
-rtError
-rtRouted_BindListener(char const* socket_name, int no_delay)
-{
-  int ret;
-  rtError err;
-  socklen_t socket_length;
-  rtListener* listener;
+    for (i = 0, n = rtVector_Size(listeners); i < n; ++i)
+    {
+      rtListener* listener = (rtListener *) rtVector_At(listeners, i);
+      if (listener)
+      {
+        rtRouted_PushFd(&read_fds, listener->fd, &max_fd);
+        rtRouted_PushFd(&err_fds, listener->fd, &max_fd);
+      }
+    }
 
-  listener = (rtListener *) malloc(sizeof(rtListener));
-  listener->fd = -1;
-  memset(&listener->local_endpoint, 0, sizeof(struct sockaddr_storage));
+    rtRouted_PushFd(&read_fds, handoff_fd, &max_fd);
 
-  err = rtSocketStorage_FromString(&listener->local_endpoint, socket_name);
-  if (err != RT_OK)
-    return err;
+    now = rtRouted_GetTimeMillis();
+    for (i = 0, n = rtVector_Size(clients); i < n; ++i)
+    {
+      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+      if (clnt)
+      {
+        // a rate limited client isn't read until its held frame can go
+        if (clnt->resume_time == 0)
+        {
+          rtRouted_PushFd(&read_fds, clnt->fd, &max_fd);
+        }
+        else
+        {
+          uint64_t wait = clnt->resume_time > now ? clnt->resume_time - now : 0;
+          if (wait < (uint64_t) timeout.tv_sec * 1000 + timeout.tv_usec / 1000)
+          {
+            timeout.tv_sec = wait / 1000;
+            timeout.tv_usec = (wait % 1000) * 1000;
+          }
+        }
+        rtRouted_PushFd(&err_fds, clnt->fd, &max_fd);
+        if (rtConnectedClient_HasPendingOutput(clnt))
+          rtRouted_PushFd(&write_fds, clnt->fd, &max_fd);
+      }
+    }
 
-  rtLog_Debug("binding listener:%s", socket_name);
+    if (next_conflated != 0)
+    {
+      uint64_t wait = next_conflated > now ? next_conflated - now : 0;
+      if (wait < (uint64_t) timeout.tv_sec * 1000 + timeout.tv_usec / 1000)
+      {
+        timeout.tv_sec = wait / 1000;
+        timeout.tv_usec = (wait % 1000) * 1000;
+      }
+    }
 
-  listener->fd = socket(listener->local_endpoint.ss_family, SOCK_STREAM, 0);
-  if (listener->fd == -1)
-  {
-    rtLog_Fatal("socket:%s", rtStrError(errno));
-    exit(1);
-  }
+    ret = select(max_fd + 1, &read_fds, &write_fds, &err_fds, &timeout);
+    if (ret == -1)
+    {
+      rtLog_Warn("select:%s", rtStrError(errno));
+      continue;
+    }
 
-  rtSocketStorage_GetLength(&listener->local_endpoint, &socket_length);
+    // on a timeout the fd sets are empty, only held and queued frames are
+    // looked at
+    rtRouted_ResumeDelayedClients();
+    pass_start = rtRouted_GetTimeMillis();
 
-  if (listener->local_endpoint.ss_family != AF_UNIX)
-  {
-    uint32_t one = 1;
-    if (no_delay)
-      setsockopt(listener->fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    for (i = 0, n = rtVector_Size(listeners); i < n; ++i)
+    {
+      rtListener* listener = (rtListener *) rtVector_At(listeners, i);
+      if (FD_ISSET(listener->fd, &read_fds))
+        rtRouted_AcceptClientConnection(listener);
+    }
 
-    ret = setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
-  }
+    for (i = 0, n = rtVector_Size(clients); i < n;)
+    {
+      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+      if (FD_ISSET(clnt->fd, &read_fds))
+      {
+        rtError err = rtConnectedClient_Read(clnt);
+        if (err != RT_OK)
+        {
+          rtRouted_DropClient(clnt);
+          n--;
+          continue;
+        }
 
-  ret = bind(listener->fd, (struct sockaddr *)&listener->local_endpoint, socket_length);
-  if (ret == -1)
-  {
-    rtError err = rtErrorFromErrno(errno);
-    rtLog_Warn("failed to bind socket. %s", rtStrError(err));
-    exit(1);
-  }
+        // don't let subscribers wait on a long pass
+        now = rtRouted_GetTimeMillis();
+        if (now - pass_start >= RTMSG_FLUSH_DEADLINE)
+        {
+          rtRouted_FlushDirtyClients();
+          pass_start = now;
+        }
+      }
+      i++;
+    }
 
-  ret = listen(listener->fd, 4);
-  if (ret == -1)
-  {
-    rtLog_Warn("failed to set socket to listen mode. %s", rtStrError(errno));
-    exit(1);
-  }
+    rtRouted_UpdateInterest();
+    next_conflated = rtRouted_FlushConflated(0);
 
-  rtVector_PushBack(listeners, listener);
-  return RT_OK;
+    // everything queued during the pass goes out here, along with backlogs
+    // of clients that became writable
+    for (i = 0, n = rtVector_Size(clients); i < n;)
+    {
+      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
+      if ((clnt->dirty || FD_ISSET(clnt->fd, &write_fds)) && rtConnectedClient_HasPendingOutput(clnt))
+      {
+        rtError err = rtConnectedClient_Flush(clnt);
+        if (err != RT_OK)
+        {
+          rtLog_Warn("failed to write to client [%s]. %s", clnt->ident, rtStrError(err));
+          rtRouted_DropClient(clnt);
+          n--;
+          continue;
+        }
+      }
+      i++;
+    }
+
+    if (handoff_fd != RTMSG_INVALID_FD && FD_ISSET(handoff_fd, &read_fds))
+      rtRouted_HandOff();
+  }
 }
 
 int main(int argc, char* argv[])
 {
-  int c;
   int i;
+  int c;
   int run_in_foreground;
   int use_no_delay;
   int ret;
   char const* socket_name;
   char const* config_file;
+  char const* capture_file;
+  int take_over;
   rtRouteEntry* route;
 
   run_in_foreground = 0;
+  take_over = 0;
   use_no_delay = 0;
 //  socket_name = "tcp://127.0.0.1:10001";
   socket_name = NULL;
   config_file = "/etc/rtrouted.conf";
+  capture_file = NULL;
   
 #ifdef INCLUDE_BREAKPAD
   sleep(1);
@@ -670,21 +4911,15 @@ int main(int argc, char* argv[])
   rtVector_Create(&clients);
   rtVector_Create(&listeners);
   rtVector_Create(&routes);
-
-  FILE* pid_file = fopen("/tmp/rtrouted.pid", "w");
-  if (!pid_file)
-  {
-    printf("failed to open pid file. %s\n", strerror(errno));
-    return 0;
-  }
-  
-  int fd = fileno(pid_file);
-  int retval = flock(fd, LOCK_EX | LOCK_NB);
-  if (retval != 0 && errno == EWOULDBLOCK)
-  {
-    rtLog_Warn("another instance of rtrouted is already running");
-    exit(12);
-  }
+  rtVector_Create(&conflated_subscriptions);
+  rtVector_Create(&retained_topics);
+  rtVector_Create(&retained_messages);
+  rtVector_Create(&coalesced_topics);
+  rtVector_Create(&coalesced_requests);
+  rtVector_Create(&queue_groups);
+  rtVector_Create(&rate_limits);
+  rtVector_Create(&interned_topics);
+  memset(&stats, 0, sizeof(stats));
 
   rtLogSetLogHandler(NULL);
 
@@ -707,12 +4942,14 @@ int main(int argc, char* argv[])
       {"log-level",   required_argument,  0, 'l' },
       {"debug-route", no_argument,        0, 'r' },
       {"socket",      required_argument,  0, 's' },
+      {"capture",     required_argument,  0, 'w' },
+      {"takeover",    no_argument,        0, 't' },
       { "config",     required_argument,  0, 'c' },
       { "help",       no_argument,        0, 'h' },
       {0, 0, 0, 0}
     };
 
-    c = getopt_long(argc, argv, "c:dfl:rhs:", long_options, &option_index);
+    c = getopt_long(argc, argv, "c:dfl:rhs:tw:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -724,6 +4961,12 @@ int main(int argc, char* argv[])
       case 's':
         socket_name = optarg;
         break;
+      case 'w':
+        capture_file = optarg;
+        break;
+      case 't':
+        take_over = 1;
+        break;
       case 'd':
         use_no_delay = 0;
         break;
@@ -751,6 +4994,40 @@ int main(int argc, char* argv[])
     }
   }
 
+  FILE* pid_file = fopen(RTMSG_ROUTER_PID_FILE, "w");
+  if (!pid_file)
+  {
+    printf("failed to open pid file. %s\n", strerror(errno));
+    return 0;
+  }
+  
+  // clients checking whether rtrouted runs hold a shared lock for a moment,
+  // only a lock that stays held means another instance
+  int fd = fileno(pid_file);
+  int retval = flock(fd, LOCK_EX | LOCK_NB);
+  for (i = 0; retval != 0 && errno == EWOULDBLOCK && i < RTMSG_PID_LOCK_ATTEMPTS; ++i)
+  {
+    usleep(RTMSG_PID_LOCK_INTERVAL * 1000);
+    retval = flock(fd, LOCK_EX | LOCK_NB);
+  }
+  if (retval != 0 && errno == EWOULDBLOCK)
+  {
+    if (!take_over)
+    {
+      rtLog_Warn("another instance of rtrouted is already running");
+      exit(12);
+    }
+  }
+  else if (take_over)
+  {
+    rtLog_Warn("no running instance of rtrouted to take over from, starting normally");
+    take_over = 0;
+  }
+
+  // open before daemon() changes directory so relative paths work
+  if (capture_file && rtRouted_OpenCapture(capture_file) != RT_OK)
+    exit(1);
+
   if (!run_in_foreground)
   {
     ret = daemon(0 /*chdir to "/"*/, 1 /*redirect stdout/stderr to /dev/null*/ );
@@ -765,80 +5042,41 @@ int main(int argc, char* argv[])
     rtLog_Debug("running in foreground");
   }
 
-  if (socket_name)
-    rtRouted_BindListener(socket_name, use_no_delay);
-
-  if (config_file)
-    rtRouted_ParseConfig(config_file);
-
-  while (1)
+  if (take_over)
   {
-    int n;
-    int                         max_fd;
-    fd_set                      read_fds;
-    fd_set                      err_fds;
-    struct timeval              timeout;
-
-    max_fd= -1;
-    FD_ZERO(&read_fds);
-    FD_ZERO(&err_fds);
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-
-    for (i = 0, n = rtVector_Size(listeners); i < n; ++i)
-    {
-      rtListener* listener = (rtListener *) rtVector_At(listeners, i);
-      if (listener)
-      {
-        rtRouted_PushFd(&read_fds, listener->fd, &max_fd);
-        rtRouted_PushFd(&err_fds, listener->fd, &max_fd);
-      }
-    }
+    // the retained messages handed over are evicted down to the configured
+    // budget, the listeners are the old instance's
+    if (config_file)
+      rtRouted_ParseConfig(config_file, 0);
 
-    for (i = 0, n = rtVector_Size(clients); i < n; ++i)
+    if (rtRouted_TakeOver() != RT_OK)
     {
-      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
-      if (clnt)
-      {
-        rtRouted_PushFd(&read_fds, clnt->fd, &max_fd);
-        rtRouted_PushFd(&err_fds, clnt->fd, &max_fd);
-      }
+      rtLog_Fatal("failed to take over from running rtrouted");
+      exit(1);
     }
 
-    ret = select(max_fd + 1, &read_fds, NULL, &err_fds, &timeout);
-    if (ret == 0)
-      continue;
-
-    if (ret == -1)
-    {
-      rtLog_Warn("select:%s", rtStrError(errno));
-      continue;
-    }
+    // the old instance exits as soon as it has our ack
+    while (flock(fd, LOCK_EX) == -1 && errno == EINTR)
+      ;
+  }
+  else
+  {
+    if (socket_name)
+      rtRouted_BindListener(socket_name, use_no_delay);
+    if (config_file)
+      rtRouted_ParseConfig(config_file, 1);
+  }
 
-    for (i = 0, n = rtVector_Size(listeners); i < n; ++i)
-    {
-      rtListener* listener = (rtListener *) rtVector_At(listeners, i);
-      if (FD_ISSET(listener->fd, &read_fds))
-        rtRouted_AcceptClientConnection(listener);
-    }
+  rtRouted_OpenHandoffListener();
 
-    for (i = 0, n = rtVector_Size(clients); i < n;)
-    {
-      rtConnectedClient* clnt = (rtConnectedClient *) rtVector_At(clients, i);
-      if (FD_ISSET(clnt->fd, &read_fds))
-      {
-        rtError err = rtConnectedClient_Read(clnt);
-        if (err != RT_OK)
-        {
-          rtVector_RemoveItem(clients, clnt, NULL);
-          rtConnectedClient_Destroy(clnt);
-          n--;
-          continue;
-        }
-      }
-      i++;
-    }
+#ifdef RTROUTED_USE_IO_URING
+  {
+    rtError err = rtRouted_RunUringLoop();
+    rtLog_Warn("io_uring isn't available, falling back to select. %s", rtStrError(err));
   }
+#endif
+
+  rtRouted_RunSelectLoop();
 
   rtVector_Destroy(listeners, NULL);
   rtVector_Destroy(clients, NULL);